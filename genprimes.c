@@ -1,119 +1,374 @@
-#include <gmp.h>
+#include <argp.h>
+#include <errno.h> // error codes
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h> // convert strings to int/longs
 #include <string.h> // to parse strings
+#include <time.h>
+#include <unistd.h> // sysconf
 
-#include <time.h> // TODO: remove this
+#include "src/primesDB.h"
 
-#define N_PRIMES 203280220
-#define N_REFINED_PRIMES 101642128
-#define N_BEST_PRIMES 49091941
+// Generate the prime database used by constructmPower
+// we run a segmented sieve of Eratosthenes over the odd numbers in (2^(bits-1), 2^bits)
+// each thread sieves its own segments and the primes are written in order, in a single streaming pass
 
+#define SEGMENT_BYTES (1<<18) // odd numbers sieved per segment (fits in L2)
+#define SEGMENTS_PER_CHUNK 16 // segments given to a thread in each round
+#define MAX_BITS 32
 
-int refineprimes(){
+const char * argp_program_version = "genprimes v2.0";
+const char * argp_program_bug_address = "ivo.maffei@uni.lu";
+static char args_doc[] = "[FILENAME]";
+static char doc[] = "Generate the database of 32-bit primes used for m2^k moduli. The default output is bestprimes.gap (or bestprimes.32b for --format=raw).";
 
-    FILE *db, *newdb;
-    db = fopen("primes.32b", "rb");
-    if (!db) return 1;
+static struct argp_option options[] = {
+    { "threads", 't', "nThreads", 0, "Number of threads to use (default: all cores)" },
+    { "bits", 'b', "bits", 0, "Keep only primes in (2^(bits-1), 2^bits) (default: 32)" },
+    { "residue", 'r', "res", 0, "Keep only primes which are res mod 3, 0 keeps all primes (default: 2)" },
+    { "format", 'f', "raw|gap", 0, "Write a raw array of uint32_t or the compact format (default: gap)" },
+    { "compress", -1, 0, 0, "Do not sieve, instead convert bestprimes.32b into the compact format" },
+    { 0 }
+};
 
-    newdb = fopen("bestprimes.32b", "wb");
-    if (!newdb) return 1;
+struct input {
+    char *filename;
+    long nThreads;
+    unsigned int bits;
+    unsigned int residue;
+    bool raw;
+    bool compress;
+};
 
-    unsigned long count = 0;
-    uint32_t prime;
+error_t parser_fun(int key, char *arg, struct argp_state *state) {
+
+    struct input *input = state->input;
+
+    switch(key){
+    case 't':
+	input->nThreads = strtol(arg, (char**) NULL, 10);
+	break;
+    case 'b':
+	input->bits = strtoul(arg, (char**) NULL, 10);
+	if (input->bits < 3 || input->bits > MAX_BITS) {
+	    argp_error(state, "--bits must be between 3 and %d", MAX_BITS);
+	    return EINVAL;
+	}
+	break;
+    case 'r':
+	input->residue = strtoul(arg, (char**) NULL, 10);
+	if (input->residue > 2) {
+	    argp_error(state, "--residue must be 0, 1 or 2");
+	    return EINVAL;
+	}
+	break;
+    case 'f':
+	if (strcmp(arg, "raw") == 0) input->raw = true;
+	else if (strcmp(arg, "gap") == 0) input->raw = false;
+	else {
+	    argp_error(state, "--format must be raw or gap");
+	    return EINVAL;
+	}
+	break;
+    case -1:
+	input->compress = true;
+	break;
+    case ARGP_KEY_ARG:
+	if (state->arg_num != 0) {
+	    argp_error(state, "Only one output file can be specified");
+	    return EINVAL;
+	}
+	input->filename = arg;
+	break;
+    default:
+	return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp_struct = { options, parser_fun, args_doc, doc };
+
+
+/************************************************************************************/
+// DATABASE WRITER
+// primes must be given in increasing order
+
+struct dbWriter {
+    FILE* fp;
+    bool raw;
+    struct primesDBHeader header;
+    struct primesDBBlock* index;
+    uint64_t indexSize; // allocated entries of index
+    uint32_t previous;
+};
 
+int dbWriterInit(struct dbWriter* w, const char* filename, const bool raw, const unsigned int residue, const unsigned int bits) {
+    *w = (struct dbWriter) { .raw = raw,
+	.header = { .magic = PRIMES_DB_MAGIC, .version = PRIMES_DB_VERSION, .blockSize = PRIMES_DB_BLOCK,
+		    .gapUnit = residue ? 6 : 2, // consecutive odd primes with the same residue mod 3 differ by a multiple of 6
+		    .residue = residue, .bits = bits } };
+
+    w->fp = fopen(filename, "wb");
+    if (!w->fp) {
+	fprintf(stderr, "Cannot open %s\n", filename);
+	return 1;
+    }
+
+    // placeholder for the header, we know its content only at the end
+    if (!raw && fwrite(&w->header, sizeof(w->header), 1, w->fp) != 1) {
+	fprintf(stderr, "Error while writing file\n");
+	return 1;
+    }
+    return 0;
+}
 
-    while (!feof(db)) {// more bytes to read
+int dbWriterPut(struct dbWriter* w, const uint32_t prime) {
+    uint8_t gap[3];
+    int n;
 
-	if (fread(&prime, sizeof(prime), 1, db) != 1) {
-	    if(ferror(db)) fprintf(stderr, "Error while reading file\n");
-	    else if(feof(db)) printf("EOF reached\n");
-	    else printf("some error\n");
-	    break;
+    if (w->raw) {
+	if (fwrite(&prime, sizeof(prime), 1, w->fp) != 1) {
+	    fprintf(stderr, "Error while writing file\n");
+	    return 1;
 	}
+	++w->header.nprimes;
+	return 0;
+    }
 
-	if (prime > (1l<<31) && prime%3 == 2) { // good for new database
-	    if (fwrite(&prime, sizeof(prime), 1, newdb) != 1){
-		fprintf(stderr, "Error while writing file\n");
-		break;
+    if (w->header.nprimes % w->header.blockSize == 0) { // start a new block
+	if (w->header.nblocks == w->indexSize) {
+	    w->indexSize = w->indexSize ? 2*w->indexSize : 1<<16;
+	    w->index = realloc(w->index, w->indexSize*sizeof(*w->index));
+	    if (!w->index) {
+		fprintf(stderr, "Cannot allocate the block index\n");
+		return 1;
 	    }
-	    ++count;
 	}
+	w->index[w->header.nblocks].first = prime;
+	w->index[w->header.nblocks].offset = w->header.gapsBytes;
+	++w->header.nblocks;
+    } else {
+	if (prime <= w->previous || (prime - w->previous) % w->header.gapUnit != 0 || (prime - w->previous) / w->header.gapUnit >= (1<<16)) {
+	    fprintf(stderr, "Cannot encode gap between %u and %u\n", w->previous, prime);
+	    return 1;
+	}
+	n = primesDBPutGap(gap, (prime - w->previous) / w->header.gapUnit);
+	if (fwrite(gap, 1, n, w->fp) != n) {
+	    fprintf(stderr, "Error while writing file\n");
+	    return 1;
+	}
+	w->header.gapsBytes += n;
     }
-
-    printf("Written %lu primes\n", count);
-    fclose(db);
-    fclose(newdb);
+    w->previous = prime;
+    ++w->header.nprimes;
     return 0;
 }
 
-int getprimes(const int numprimes){
+// write the block index and the real header
+int dbWriterFinish(struct dbWriter* w) {
+    uint8_t padding[8] = {0};
+    int n, err = 0;
 
-    FILE *db;
-    db = fopen("refinedprimes.32b", "rb");
-    if (!db) return 1;
+    if (!w->raw) {
+	// pad so that the index is aligned
+	n = (8 - w->header.gapsBytes % 8) % 8;
+	w->header.indexOffset = sizeof(w->header) + w->header.gapsBytes + n;
+
+	if (fwrite(padding, 1, n, w->fp) != n
+	    || fwrite(w->index, sizeof(*w->index), w->header.nblocks, w->fp) != w->header.nblocks) err = 1;
+
+	rewind(w->fp);
+	if (fwrite(&w->header, sizeof(w->header), 1, w->fp) != 1) err = 1;
+    }
+
+    if (fclose(w->fp) != 0) err = 1;
+    if (err) fprintf(stderr, "Error while writing file\n");
+    free(w->index);
+    return err;
+}
+
+
+/************************************************************************************/
+// SEGMENTED SIEVE
+
+struct sieveJob {
+    const uint32_t* basePrimes; // odd primes up to sqrt(2^bits)
+    int nBasePrimes;
+    uint64_t lo, hi; // sieve odd numbers in [lo, hi)
+    unsigned int residue;
+    uint32_t* primes; // output
+    uint64_t nprimes;
+    uint8_t* segment; // scratch
+};
+
+// sieve [job->lo, job->hi) one segment at a time and store the primes which pass the filters
+void* sieveChunk(void* arg) {
+    struct sieveJob* job = (struct sieveJob*) arg;
+    uint8_t* const seg = job->segment;
+    uint64_t start, end, len, p, j;
+
+    job->nprimes = 0;
 
-    uint32_t place;
-    uint32_t* dbprimes = malloc(N_BEST_PRIMES*sizeof(uint32_t));
-    uint32_t *primes = (uint32_t *) malloc(numprimes*sizeof(uint32_t));
+    for (start = job->lo; start < job->hi; start += 2*SEGMENT_BYTES) {
+	end = start + 2*SEGMENT_BYTES;
+	if (end > job->hi) end = job->hi;
+	len = (end - start) / 2; // seg[j] represents start + 2j
 
-    size_t e = fread(dbprimes, sizeof(*dbprimes), N_BEST_PRIMES, db);
-    if (e != N_BEST_PRIMES) {
-	fprintf(stderr, "ERROR read less primes: %lu instead of %lu\n", e, N_BEST_PRIMES);
+	memset(seg, 1, len);
+	for (int i = 0; i < job->nBasePrimes; ++i) {
+	    p = job->basePrimes[i];
+	    if (p*p >= end) break;
+
+	    // first odd multiple of p which is at least max(p^2, start)
+	    j = (start + p - 1) / p * p;
+	    if (j < p*p) j = p*p;
+	    if (!(j & 1)) j += p;
+
+	    for (j = (j - start) / 2; j < len; j += p) seg[j] = 0;
+	}
+
+	for (j = 0; j < len; ++j) {
+	    if (!seg[j]) continue;
+	    p = start + 2*j;
+	    if (job->residue && p%3 != job->residue) continue;
+	    job->primes[job->nprimes++] = p;
+	}
+    }
+
+    return NULL;
+}
+
+int sievePrimes(struct dbWriter* w, const unsigned int bits, const unsigned int residue, const int nThreads) {
+
+    const uint64_t lo = (1ull << (bits-1)) + 1; // odd, and 2^(bits-1) is never prime
+    const uint64_t hi = 1ull << bits;
+    const uint64_t chunk = 2ull * SEGMENT_BYTES * SEGMENTS_PER_CHUNK; // size of the interval given to a thread
+    const uint32_t sqrtHi = 1u << ((bits+1)/2);
+    uint32_t* basePrimes;
+    uint8_t* small;
+    int nBasePrimes = 0, err = 0;
+    struct sieveJob* jobs;
+    pthread_t* threads;
+
+    // odd primes up to sqrt(2^bits) with a simple sieve
+    small = calloc(sqrtHi+1, 1);
+    basePrimes = malloc((sqrtHi/2+1)*sizeof(uint32_t));
+    jobs = calloc(nThreads, sizeof(*jobs));
+    threads = malloc(nThreads*sizeof(*threads));
+    if (!small || !basePrimes || !jobs || !threads) {
+	fprintf(stderr, "Cannot allocate memory for the sieve\n");
 	return 1;
     }
+    for (uint64_t i = 3; i <= sqrtHi; i += 2) {
+	if (small[i]) continue;
+	basePrimes[nBasePrimes++] = i;
+	for (uint64_t j = i*i; j <= sqrtHi; j += 2*i) small[j] = 1;
+    }
+    free(small);
+
+    for (int t = 0; t < nThreads; ++t) {
+	jobs[t].basePrimes = basePrimes;
+	jobs[t].nBasePrimes = nBasePrimes;
+	jobs[t].residue = residue;
+	jobs[t].primes = malloc(chunk/2*sizeof(uint32_t)); // at most one prime per odd number
+	jobs[t].segment = malloc(SEGMENT_BYTES);
+	if (!jobs[t].primes || !jobs[t].segment) {
+	    fprintf(stderr, "Cannot allocate memory for the sieve\n");
+	    return 1;
+	}
+    }
 
-    for (int i=0; i<numprimes; ++i){
+    // each round gives a chunk to every thread, then writes the chunks in order
+    for (uint64_t start = lo; start < hi && !err; start += nThreads*chunk) {
+	int running = 0;
+	for (int t = 0; t < nThreads && start + t*chunk < hi; ++t) {
+	    jobs[t].lo = start + t*chunk;
+	    jobs[t].hi = (jobs[t].lo + chunk < hi) ? jobs[t].lo + chunk : hi;
+	    if (pthread_create(threads+t, NULL, sieveChunk, jobs+t) != 0) {
+		fprintf(stderr, "Cannot create thread\n");
+		return 1;
+	    }
+	    ++running;
+	}
+
+	for (int t = 0; t < running; ++t) {
+	    pthread_join(threads[t], NULL);
+	    for (uint64_t i = 0; i < jobs[t].nprimes && !err; ++i) err = dbWriterPut(w, jobs[t].primes[i]);
+	}
 	fprintf(stderr, ".");
-	place = rand() % N_BEST_PRIMES;
+    }
+    fprintf(stderr, "\n");
 
-	primes[i] = dbprimes[place];
-	if (primes[i]%3 != 2) fprintf(stderr, "found a BAD prime\n");
+    for (int t = 0; t < nThreads; ++t) {
+	free(jobs[t].primes);
+	free(jobs[t].segment);
     }
-    
+    free(jobs);
+    free(threads);
+    free(basePrimes);
+    return err;
+}
+
+// convert bestprimes.32b into the compact format
+int compressprimes(struct dbWriter* w){
+
+    FILE *db;
+    uint32_t prime;
+    int err = 0;
+
+    db = fopen("bestprimes.32b", "rb");
+    if (!db) return 1;
+
+    while (!err && fread(&prime, sizeof(prime), 1, db) == 1) err = dbWriterPut(w, prime);
+    if (ferror(db)) {
+	fprintf(stderr, "Error while reading file\n");
+	err = 1;
+    }
+
     fclose(db);
-    return 0;
+    return err;
 }
 
 
 int main(int argc, char **argv) {
 
-    /* refineprimes(); */
-    /* return 0; */
-
-    time_t start, end;
-    
-    start =time(NULL);
-    if(getprimes(1000000)) fprintf(stderr, "error!\n");
-    end = time(NULL);
-    
-    fprintf(stderr, "it took %lu s in total\n", (end-start));
-    
-    return 0;
-    
-    // see how long to generate tons of 32 bit primes using GMP
+    struct input input = { .nThreads = sysconf(_SC_NPROCESSORS_ONLN), .bits = 32, .residue = 2 };
+    struct dbWriter writer;
+    struct timespec start, end;
+    int err;
 
-    mpz_t p;
-    
-    mpz_init(p);
+    error_t errorcode = argp_parse(&argp_struct, argc, argv, 0, NULL, &input);
+    if (errorcode) return errorcode;
 
-    mpz_set_ui(p, (1l<<31)); // p is smallest 32-bit prime
-    printf("p has size %lu\n", mpz_sizeinbase(p, 2));
+    if (input.nThreads < 1) input.nThreads = 1;
+    if (input.compress && input.raw) {
+	fprintf(stderr, "--compress only writes the compact format\n");
+	return EINVAL;
+    }
+    if (!input.filename) input.filename = input.raw ? "bestprimes.32b" : "bestprimes.gap";
 
-    unsigned long count = 0;
+    if (dbWriterInit(&writer, input.filename, input.raw, input.residue, input.bits)) return 1;
 
-    start = time(NULL);
-    while (mpz_sizeinbase(p, 2) == 32) {
-	mpz_nextprime(p, p);
-	if (count % 100 == 0) {
-	    //fprintf(stderr, "%lu th prime found: %lu\n", count, mpz_get_ui(p));
-	    fprintf(stderr, ".");
-	}
-	++count;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (input.compress) err = compressprimes(&writer);
+    else {
+	printf("Sieving primes in (2^%u, 2^%u) with %ld threads\n", input.bits-1, input.bits, input.nThreads);
+	err = sievePrimes(&writer, input.bits, input.residue, input.nThreads);
+    }
+
+    err |= dbWriterFinish(&writer);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (err) {
+	fprintf(stderr, "Failed to generate %s\n", input.filename);
+	return 1;
     }
-    end = time(NULL);
 
-    fprintf(stderr, "computed %lu (pseudo) primes in %lu seconds\n", count, end-start);
-    mpz_clear(p);
+    printf("Written %lu primes to %s in %.1f s\n", writer.header.nprimes, input.filename,
+	   (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9);
     return 0;
 }
@@ -0,0 +1,228 @@
+#include "batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cube.h"
+
+#define DIGIT_MASK ((1ull << BATCH_DIGIT_BITS) - 1)
+
+// vmadd(t, tnext, a, b) accumulates a*b into the digits t, tnext; vmullo(a, b) = a*b mod 2^BATCH_DIGIT_BITS
+// all inputs are below 2^BATCH_DIGIT_BITS
+#ifdef __AVX512IFMA__
+#define vmadd(t, tnext, a, b) { t = _mm512_madd52lo_epu64(t, a, b); tnext = _mm512_madd52hi_epu64(tnext, a, b); }
+#define vmullo(a, b) _mm512_madd52lo_epu64(vset1(0), a, b)
+#else
+// products of 26-bit digits have at most 52 bits, so they all go in t and are never split
+#define vmadd(t, tnext, a, b) t = vadd(t, vmul32(a, b))
+#define vmullo(a, b) vand(vmul32(a, b), vset1(DIGIT_MASK))
+#endif
+
+// vectors aligned to a cache line
+static vec_t* allocVec(const size_t n) {
+    return aligned_alloc(64, (n*sizeof(vec_t) + 63) & ~(size_t)63);
+}
+
+// write x as digits in lane l of d
+static void toLane(vec_t* d, const int l, const int ndigits, const mpz_t x) {
+    const mp_limb_t* xp = mpz_limbs_read(x);
+    const size_t xn = mpz_size(x);
+
+    for (int j = 0; j < ndigits; ++j) {
+	const size_t bit = (size_t)j*BATCH_DIGIT_BITS, limb = bit/64, off = bit%64;
+	uint64_t v = limb < xn ? xp[limb] >> off : 0;
+	if (off + BATCH_DIGIT_BITS > 64 && limb+1 < xn) v |= xp[limb+1] << (64-off);
+	vlane(d[j], l) = v & DIGIT_MASK;
+    }
+}
+
+// read lane l of d into x, reduced mod q (the digits hold a value below 2q)
+static void fromLane(mpz_t x, const vec_t* d, const int l, const int ndigits, const mpz_t q) {
+    const size_t xn = ((size_t)ndigits*BATCH_DIGIT_BITS + 63)/64 + 1;
+    mp_limb_t* xp = mpz_limbs_write(x, xn);
+
+    memset(xp, 0, xn*sizeof(mp_limb_t));
+    for (int j = 0; j < ndigits; ++j) {
+	const size_t bit = (size_t)j*BATCH_DIGIT_BITS, limb = bit/64, off = bit%64;
+	const uint64_t v = vlane(d[j], l);
+	xp[limb] |= v << off;
+	if (off + BATCH_DIGIT_BITS > 64) xp[limb+1] |= v >> (64-off);
+    }
+    mpz_limbs_finish(x, xn);
+
+    if (mpz_cmp(x, q) >= 0) mpz_sub(x, x, q);
+}
+
+// r = a b / R mod q in every lane, with a, b < 2q and r < 2q (as 4q < R); r may alias a or b
+// this is the textbook digit by digit Montgomery multiplication, but the digits of t are accumulated
+// without carries (they have enough room) and the carries are propagated only once at the end
+static void laneMul(struct batchCtx* ctx, vec_t* r, const vec_t* a, const vec_t* b) {
+    const int n = ctx->ndigits;
+    vec_t* const t = ctx->t;
+    const vec_t* const qd = ctx->qd;
+    const vec_t k0 = vset1(ctx->k0), mask = vset1(DIGIT_MASK);
+    vec_t bi, m, x, carry;
+
+    for (int j = 0; j <= 2*n; ++j) t[j] = vset1(0);
+
+    for (int i = 0; i < n; ++i) {
+	bi = b[i];
+	for (int j = 0; j < n; ++j) vmadd(t[i+j], t[i+j+1], a[j], bi);
+	m = vmullo(t[i], k0);
+	for (int j = 0; j < n; ++j) vmadd(t[i+j], t[i+j+1], qd[j], m);
+	t[i+1] = vadd(t[i+1], vshr(t[i], BATCH_DIGIT_BITS)); // the low digit is now 0
+    }
+
+    carry = vset1(0);
+    for (int j = 0; j < n; ++j) {
+	x = vadd(t[n+j], carry);
+	r[j] = vand(x, mask);
+	carry = vshr(x, BATCH_DIGIT_BITS);
+    }
+}
+
+// a constant broadcast to all lanes
+static void broadcast(vec_t* d, const int ndigits, const mpz_t x) {
+    for (int l = 0; l < BATCH_LANES; ++l) toLane(d, l, ndigits, x);
+}
+
+int batchInit(struct batchCtx* ctx, const mpz_t q) {
+    const size_t bits = mpz_sizeinbase(q, 2);
+    int n;
+    mpz_t t;
+
+    memset(ctx, 0, sizeof(*ctx));
+    if (montInit(&ctx->mont, q)) return 1;
+    mpz_init_set(ctx->q, q);
+
+    ctx->lanes = BATCH_LANES > 1 && bits <= BATCH_MAX_BITS;
+    if (!ctx->lanes) return 0;
+
+    // R = 2^(BATCH_DIGIT_BITS n) > 4q
+    n = ctx->ndigits = (bits + 2 + BATCH_DIGIT_BITS-1)/BATCH_DIGIT_BITS;
+
+    ctx->qd = allocVec(n);
+    ctx->r2 = allocVec(n);
+    ctx->r3 = allocVec(n);
+    ctx->one = allocVec(n);
+    ctx->t = allocVec(2*n + 1);
+    ctx->x = allocVec(n);
+    ctx->y = allocVec(n);
+    if (!ctx->qd || !ctx->r2 || !ctx->r3 || !ctx->one || !ctx->t || !ctx->x || !ctx->y) {
+	batchClear(ctx);
+	return 1;
+    }
+
+    // -q^{-1} mod 2^64 by Newton iteration, q is its own inverse mod 8
+    uint64_t q0 = mpz_getlimbn(q, 0), inv = q0;
+    for (int i = 0; i < 5; ++i) inv *= 2 - q0*inv;
+    ctx->k0 = -inv & DIGIT_MASK;
+
+    mpz_init(t);
+    broadcast(ctx->qd, n, q);
+    mpz_set_ui(t, 1);
+    broadcast(ctx->one, n, t);
+    mpz_set_ui(t, 0);
+    mpz_setbit(t, 2*n*BATCH_DIGIT_BITS);
+    mpz_mod(t, t, q);
+    broadcast(ctx->r2, n, t);
+    mpz_mul_2exp(t, t, n*BATCH_DIGIT_BITS);
+    mpz_mod(t, t, q);
+    broadcast(ctx->r3, n, t);
+    mpz_clear(t);
+
+    return 0;
+}
+
+void batchClear(struct batchCtx* ctx) {
+    free(ctx->qd);
+    free(ctx->r2);
+    free(ctx->r3);
+    free(ctx->one);
+    free(ctx->t);
+    free(ctx->x);
+    free(ctx->y);
+    free(ctx->table);
+    montClear(&ctx->mont);
+    mpz_clear(ctx->q);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+// load up to BATCH_LANES messages starting from m[i], the unused lanes are 0
+static void loadLanes(struct batchCtx* ctx, vec_t* d, mpz_t* m, const int i, const int count) {
+    for (int l = 0; l < BATCH_LANES; ++l) {
+	if (i + l < count) toLane(d, l, ctx->ndigits, m[i+l]);
+	else for (int j = 0; j < ctx->ndigits; ++j) vlane(d[j], l) = 0;
+    }
+}
+
+static void storeLanes(struct batchCtx* ctx, mpz_t* m, const vec_t* d, const int i, const int count) {
+    for (int l = 0; l < BATCH_LANES && i + l < count; ++l) fromLane(m[i+l], d, l, ctx->ndigits, ctx->q);
+}
+
+void batchCube(struct batchCtx* ctx, mpz_t* c, mpz_t* m, const int count) {
+    if (!ctx->lanes) {
+	for (int i = 0; i < count; ++i) cube(c[i], m[i], ctx->q);
+	return;
+    }
+
+    // x^2/R, x^3/R^2 and finally x^3 multiplying by R^3, so we never convert to Montgomery form
+    for (int i = 0; i < count; i += BATCH_LANES) {
+	loadLanes(ctx, ctx->x, m, i, count);
+	laneMul(ctx, ctx->y, ctx->x, ctx->x);
+	laneMul(ctx, ctx->y, ctx->y, ctx->x);
+	laneMul(ctx, ctx->y, ctx->y, ctx->r3);
+	storeLanes(ctx, c, ctx->y, i, count);
+    }
+}
+
+void batchCubeRoot(struct batchCtx* ctx, mpz_t* m, mpz_t* c, const mpz_t b, const int count) {
+    const int n = ctx->ndigits;
+    struct expPlan plan;
+    vec_t *x = ctx->x, *b2 = ctx->y, *table;
+    mp_bitcnt_t s;
+
+    if (expPlanInit(&plan, b) != 0) {
+	for (int k = 0; k < count; ++k) montPowm(&ctx->mont, m[k], c[k], b);
+	return;
+    }
+
+    if (!ctx->lanes || plan.nwindows == 0) {
+	for (int k = 0; k < count; ++k) montPowmPlan(&ctx->mont, m[k], c[k], &plan);
+	expPlanClear(&plan);
+	return;
+    }
+
+    // table[k] = c^(2k+1) in Montgomery form, for all lanes
+    if (ctx->tableSize < plan.nentries) {
+	free(ctx->table);
+	ctx->table = allocVec((size_t)plan.nentries*n);
+	ctx->tableSize = ctx->table ? plan.nentries : 0;
+	if (!ctx->table) {
+	    for (int k = 0; k < count; ++k) montPowmPlan(&ctx->mont, m[k], c[k], &plan);
+	    expPlanClear(&plan);
+	    return;
+	}
+    }
+    table = ctx->table;
+
+    // all lanes share the exponent, so they follow the same windows
+    for (int k = 0; k < count; k += BATCH_LANES) {
+	loadLanes(ctx, table, c, k, count);
+	laneMul(ctx, table, table, ctx->r2);
+	laneMul(ctx, b2, table, table);
+	for (long i = 1; i < plan.nentries; ++i) laneMul(ctx, table + i*n, table + (i-1)*n, b2);
+
+	memcpy(x, table + plan.idx[0]*n, n*sizeof(vec_t));
+	for (long i = 1; i < plan.nwindows; ++i) {
+	    for (s = plan.nsq[i]; s; --s) laneMul(ctx, x, x, x);
+	    laneMul(ctx, x, x, table + plan.idx[i]*n);
+	}
+	for (s = plan.tail; s; --s) laneMul(ctx, x, x, x);
+
+	laneMul(ctx, x, x, ctx->one); // out of Montgomery form
+	storeLanes(ctx, m, x, k, count);
+    }
+
+    expPlanClear(&plan);
+}
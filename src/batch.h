@@ -0,0 +1,62 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "montgomery.h"
+
+// Cubing and cube roots of many messages under the same modulus.
+// Messages are processed BATCH_LANES at a time, one per SIMD lane: lane l holds message l split in digits of
+// BATCH_DIGIT_BITS bits and all lanes go through the same Montgomery multiplications in lockstep.
+// With AVX-512 IFMA digits are 52 bits, otherwise 26 bits multiplied with vpmuludq.
+// Cube roots use the same exponent b for every message, so the lanes never diverge and BATCH_LANES
+// exponentiations are interleaved in every instruction.
+// Without SIMD, or for moduli bigger than BATCH_MAX_BITS (where GMP's subquadratic multiplication wins),
+// the batch simply loops over the messages reusing a Montgomery context.
+
+#include "simd.h"
+
+#ifdef __AVX512IFMA__
+#define BATCH_DIGIT_BITS 52
+#else
+#define BATCH_DIGIT_BITS 26
+#endif
+
+#define BATCH_LANES VLANES
+
+// above this size the lanes are slower than GMP
+// without IFMA, 26-bit digits need four times the multiplications of GMP's 64-bit limbs and in our tests they are
+// never faster (AVX-512F is on par, AVX2 half the speed), so the lanes are only used if enabled at compile time
+#ifndef BATCH_MAX_BITS
+#ifdef __AVX512IFMA__
+#define BATCH_MAX_BITS 8192
+#else
+#define BATCH_MAX_BITS 0
+#endif
+#endif
+
+struct batchCtx {
+    mpz_t q; // the modulus
+    bool lanes; // whether we use the lanes or loop with mont
+    int ndigits; // digits of R
+    uint64_t k0; // -q^{-1} mod 2^BATCH_DIGIT_BITS
+    vec_t *qd, *r2, *r3, *one; // q, R^2 mod q, R^3 mod q and 1 as digits, broadcast to all lanes
+    vec_t *t, *x, *y, *table; // scratch space for the lanes
+    int tableSize; // number of entries in table
+    struct montCtx mont;
+};
+
+// returns 0 on success
+int batchInit(struct batchCtx* ctx, const mpz_t q);
+
+void batchClear(struct batchCtx* ctx);
+
+// c[i] = m[i]^3 mod q for 0 <= i < count; c and m may be the same array
+void batchCube(struct batchCtx* ctx, mpz_t* c, mpz_t* m, const int count);
+
+// m[i] = c[i]^b mod q for 0 <= i < count; c and m may be the same array
+void batchCubeRoot(struct batchCtx* ctx, mpz_t* m, mpz_t* c, const mpz_t b, const int count);
+
+#endif
@@ -3,10 +3,32 @@
 #include <assert.h>
 #include "rand.h"
 #include <openssl/bn.h>
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close
+#include <string.h> // memcmp
+#include <pthread.h>
 
-#define N_BEST_PRIMES 49091941
+#include "primesDB.h"
+#include "millerRabin.h"
 
-uint32_t* dbprimes = NULL;
+#define N_BEST_PRIMES 49091941
+#define PRIMES_DB_FILE "bestprimes.32b"
+#define PRIMES_DB_COMPACT_FILE "bestprimes.gap"
+
+// the database is mapped read-only and shared, so the page cache is shared
+// among all processes using it and pages are only faulted in when a prime is drawn
+// we prefer the compact format, if found, and fallback to the raw array of uint32_t
+static const uint32_t* dbprimes = NULL; // raw format
+static const struct primesDBHeader* dbheader = NULL; // compact format
+static const struct primesDBBlock* dbindex = NULL;
+static const uint8_t* dbgaps = NULL;
+static void* dbmap = NULL;
+static size_t dbsize = 0; // size in bytes of the mapping
+static uint64_t nDBPrimes = 0;
+
+static enum primeSource primeSource = PRIMES_FROM_DB;
 
 const unsigned long availablePrimeSizes[] = {
     256,
@@ -23,28 +45,134 @@ const unsigned long availablePrimeSizes[] = {
 const unsigned long numAvailablePrimes = 9;
 
 void clearPrimesDB(){
-    if (dbprimes) free(dbprimes);
-    dbprimes=NULL;
+    if (dbmap) munmap(dbmap, dbsize);
+    dbmap = NULL;
+    dbprimes = NULL;
+    dbheader = NULL;
+    dbindex = NULL;
+    dbgaps = NULL;
+    dbsize = 0;
+    nDBPrimes = 0;
+}
+
+void setPrimeSource(const enum primeSource source) {
+    primeSource = source;
+}
+
+enum primeSource getPrimeSource() {
+    return primeSource;
+}
+
+// check that a database entry is one of the primes we expect: 2^31 < p < 2^32 and p = 2 mod 3
+static bool validDBPrime(const uint32_t p) {
+    return p > (1ul<<31) && p%3 == 2;
+}
+
+// returns the i-th prime of the database
+static inline uint32_t getDBPrime(const uint64_t i) {
+    if (dbprimes) return dbprimes[i];
+
+    // compact format: start from the first prime of the block and add the gaps
+    const struct primesDBBlock block = dbindex[i / dbheader->blockSize];
+    const uint8_t* gaps = dbgaps + block.offset;
+    uint32_t p = block.first, g = 0;
+
+    for (uint64_t j = i % dbheader->blockSize; j > 0; --j) g += primesDBGetGap(&gaps);
+
+    return p + g*dbheader->gapUnit;
+}
+
+// maps filename read-only and returns its size (0 on failure)
+static size_t mapDBFile(const char* filename) {
+    int fd;
+    struct stat st;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+	close(fd);
+	return 0;
+    }
+
+    dbmap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (dbmap == MAP_FAILED){
+	fprintf(stderr, "ERROR failed to map prime database %s\n", filename);
+	dbmap = NULL;
+	return 0;
+    }
+
+    // we draw primes at random positions, so read-ahead would only waste memory
+    madvise(dbmap, st.st_size, MADV_RANDOM);
+
+    dbsize = st.st_size;
+    return dbsize;
+}
+
+// validate the header of the compact database and setup the pointers into it
+static int loadCompactDB() {
+    const struct primesDBHeader* h = (const struct primesDBHeader*) dbmap;
+
+    if (dbsize < sizeof(*h) || memcmp(h->magic, PRIMES_DB_MAGIC, 8) != 0 || h->version != PRIMES_DB_VERSION) {
+	fprintf(stderr, "ERROR %s is not a prime database\n", PRIMES_DB_COMPACT_FILE);
+	return 1;
+    }
+
+    // we need primes of 32 bits that are 2 mod 3
+    if (h->bits != 32 || h->residue != 2 || h->gapUnit == 0 || h->blockSize == 0 || h->nprimes == 0) {
+	fprintf(stderr, "ERROR prime database %s has the wrong kind of primes\n", PRIMES_DB_COMPACT_FILE);
+	return 1;
+    }
+
+    if (h->nblocks != (h->nprimes + h->blockSize - 1) / h->blockSize || h->indexOffset < sizeof(*h) + h->gapsBytes
+	|| h->indexOffset % 8 != 0 || h->gapsBytes >= (1ull<<32)
+	|| dbsize != h->indexOffset + h->nblocks*sizeof(struct primesDBBlock)) {
+	fprintf(stderr, "ERROR prime database %s has the wrong size\n", PRIMES_DB_COMPACT_FILE);
+	return 1;
+    }
+
+    dbheader = h;
+    dbgaps = (const uint8_t*) dbmap + sizeof(*h);
+    dbindex = (const struct primesDBBlock*) ((const uint8_t*) dbmap + h->indexOffset);
+    nDBPrimes = h->nprimes;
+
+    if (dbindex[h->nblocks-1].offset > h->gapsBytes) {
+	fprintf(stderr, "ERROR prime database %s is corrupted\n", PRIMES_DB_COMPACT_FILE);
+	return 1;
+    }
+    return 0;
 }
 
 int loadPrimesDB(){
-    if (dbprimes) return 0; // already initialised
+    if (dbmap) return 0; // already initialised
 
-    FILE *db;
-    dbprimes = malloc(N_BEST_PRIMES*sizeof(uint32_t));
-    if (dbprimes == NULL){
-	fprintf(stderr, "ERROR failed to initialise prime database\n");
+    if (mapDBFile(PRIMES_DB_COMPACT_FILE)) {
+	if (loadCompactDB() != 0) {
+	    clearPrimesDB();
+	    return 1;
+	}
+    } else if (mapDBFile(PRIMES_DB_FILE)) {
+	// the file has no header, so its size must match exactly the number of primes
+	if (dbsize != N_BEST_PRIMES*sizeof(uint32_t)) {
+	    fprintf(stderr, "ERROR prime database has size %lu instead of %lu\n", dbsize, N_BEST_PRIMES*sizeof(uint32_t));
+	    clearPrimesDB();
+	    return 1;
+	}
+	dbprimes = (const uint32_t*) dbmap;
+	nDBPrimes = N_BEST_PRIMES;
+    } else {
+	fprintf(stderr, "ERROR cannot open prime database %s or %s\n", PRIMES_DB_COMPACT_FILE, PRIMES_DB_FILE);
 	return 1;
     }
-    db = fopen("bestprimes.32b", "rb");
-    if (!db) return 1;
 
-    size_t e = fread(dbprimes, sizeof(*dbprimes), N_BEST_PRIMES, db);
-    if (e != N_BEST_PRIMES) {
-	fprintf(stderr, "ERROR read less primes: %lu instead of %lu\n", e, N_BEST_PRIMES);
+    // sanity check on the first and last primes (this only touches a few pages)
+    if (!validDBPrime(getDBPrime(0)) || !validDBPrime(getDBPrime(nDBPrimes-1)) || getDBPrime(0) >= getDBPrime(nDBPrimes-1)) {
+	fprintf(stderr, "ERROR prime database is corrupted\n");
+	clearPrimesDB();
 	return 1;
     }
-    fclose(db);
+
     return 0;
 }
 
@@ -191,44 +319,116 @@ void findOpensslPrime(mpz_t p, const unsigned long Nbits, const bool safe) {
 }
 
 
-// get 32 bit primes using the saved database
+static int compareuint32(const void* a, const void* b) {
+    const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// get 32 bit primes using the saved database or Miller-Rabin, depending on primeSource
+// the primes returned are distinct (and sorted)
 int get32bprimes(uint32_t* primes, const int numprimes){
 
-    int fail = loadPrimesDB();
-    if (fail) return fail;
+    int filled = 0, i, j;
 
-    uint32_t place;
+    if (primeSource == PRIMES_FROM_DB) {
+	int fail = loadPrimesDB();
+	if (fail) return fail;
+    }
 
-    for (int i=0; i<numprimes; ++i){
-	place = rand() % N_BEST_PRIMES;
+    // draw the missing primes, then sort and remove duplicates
+    // this is O(n log n) so that we can use many primes for huge moduli
+    while (filled < numprimes) {
+	if (primeSource == PRIMES_FROM_MR) sample32bprimes(primes+filled, numprimes-filled);
+	else for (i=filled; i<numprimes; ++i) primes[i] = getDBPrime(rand() % nDBPrimes);
 
-	primes[i] = dbprimes[place];
-	// if we already found such prime, then decrease i so that we replace it
-	for (int j=0; j<i; ++j) if (primes[j] == primes[i]) { --i; break;}
+	qsort(primes, numprimes, sizeof(uint32_t), compareuint32);
+	for (i=1, j=1; i<numprimes; ++i) if (primes[i] != primes[j-1]) primes[j++] = primes[i];
+	filled = j;
     }
 
     return 0;
 }
 
-void constructmPower(mpz_t q, mpz_t b, const int nprimes, const unsigned long N) {
+// arguments for productTree when run on its own thread
+struct productTreeArgs {
+    mpz_ptr r;
+    const uint32_t* ps;
+    int n;
+    uint32_t offset;
+};
 
-    mp_bitcnt_t k;
-    uint32_t* ps = malloc(nprimes*sizeof(uint32_t));
+// r = prod_{i<n} (ps[i]-offset)
+// we use a balanced product tree so that the top multiplications are between numbers of the same size
+// and GMP can use its subquadratic algorithms, rather than a quadratic chain of mpz_mul_ui
+static void* productTree(void* a) {
+    const struct productTreeArgs* args = (const struct productTreeArgs*) a;
+    const int n = args->n;
+    int m = (n+1)/2;
+    mpz_t* level;
+
+    if (n == 0) {
+	mpz_set_ui(args->r, 1);
+	return NULL;
+    }
 
-    if (ps == NULL){
-	fprintf(stderr, "ERRROR initialising temporary primes\n");
-	return;
+    level = (mpz_t*) malloc(m*sizeof(mpz_t));
+    assert(level);
+
+    // leaves: pairs of 32-bit factors fit in a limb
+    for (int i=0; i<m; ++i) {
+	unsigned long x = args->ps[2*i] - args->offset;
+	if (2*i+1 < n) x *= args->ps[2*i+1] - args->offset;
+	mpz_init_set_ui(level[i], x);
     }
 
+    // multiply adjacent nodes in place until one is left
+    for (int size = m; size > 1; size = (size+1)/2) {
+	for (int i=0; 2*i < size; ++i) {
+	    if (2*i+1 < size) mpz_mul(level[i], level[2*i], level[2*i+1]);
+	    else mpz_swap(level[i], level[2*i]);
+	}
+    }
+
+    mpz_swap(args->r, level[0]);
+
+    for (int i=0; i<m; ++i) mpz_clear(level[i]);
+    free(level);
+    return NULL;
+}
+
+// below this many primes a thread costs more than the product tree of \phi
+#define PARALLEL_TREE_THRESHOLD 256
+
+// construct m2^k where m is the product of the nprimes primes stored in ps
+// ps must have space for nprimes primes and k is set to the exponent of 2
+static int constructmPowerFactors(mpz_t q, mpz_t b, uint32_t* ps, const int nprimes, const unsigned long N, unsigned long* kp) {
+
+    mp_bitcnt_t k;
+    pthread_t phiThread;
+    bool threaded = false;
+
     if (get32bprimes(ps, nprimes) != 0) {
 	fprintf(stderr, "Error with prime generations\n");
-	return;
+	return 1;
     }
 
-    mpz_set_ui(q, 1);
+    struct productTreeArgs qArgs = { q, ps, nprimes, 0 };
+    struct productTreeArgs phiArgs = { b, ps, nprimes, 1 };
 
-    for (int i =0; i<nprimes; ++i) {
-	mpz_mul_ui(q, q, (unsigned long)(ps[i]));
+    // \phi(m) = prod (p_i -1) is computed at the same time as m, on another thread
+    if (b && nprimes >= PARALLEL_TREE_THRESHOLD)
+	threaded = pthread_create(&phiThread, NULL, productTree, &phiArgs) == 0;
+
+    productTree(&qArgs); // q = m
+
+    if (b) {
+	if (threaded) pthread_join(phiThread, NULL);
+	else productTree(&phiArgs); // b = \phi(m)
+    }
+
+    if (mpz_sizeinbase(q, 2) >= N) {
+	fprintf(stderr, "ERROR the product of %d primes has more than %lu bits\n", nprimes, N);
+	return 1;
     }
 
     k = N - mpz_sizeinbase(q, 2);
@@ -242,11 +442,6 @@ void constructmPower(mpz_t q, mpz_t b, const int nprimes, const unsigned long N)
     // hence b = [1 + (2-(k-1)%2)*\phi(q)]/3 = [1 + (1+k%2)*\phi(q)]/3
 
     if (b) {
-	// compute \phi(q)
-	mpz_set_ui(b, 1);
-	for (int i=0; i<nprimes; ++i) {
-	    mpz_mul_ui(b, b, (unsigned long)(ps[i]-1));
-	} // b = \phi(m)
 	mpz_mul_2exp(b, b, k-1); // b = \phi(m2^k)
 
 	mpz_mul_ui(b, b, 1+(k%2));
@@ -256,6 +451,21 @@ void constructmPower(mpz_t q, mpz_t b, const int nprimes, const unsigned long N)
 	mpz_divexact_ui(b, b, 3);
     }
 
+    if (kp) *kp = k;
+    return 0;
+}
+
+void constructmPower(mpz_t q, mpz_t b, const int nprimes, const unsigned long N) {
+
+    uint32_t* ps = malloc(nprimes*sizeof(uint32_t));
+
+    if (ps == NULL){
+	fprintf(stderr, "ERRROR initialising temporary primes\n");
+	return;
+    }
+
+    constructmPowerFactors(q, b, ps, nprimes, N, NULL);
+
     free(ps);
 }
 
@@ -318,13 +528,11 @@ void constructSafePrime(mpz_t p, mpz_t b, const unsigned long N) {
 // assuming secpar is not crazt high, we just compute a random number of secpar bits and find the next prime
 // use this as the basis for q
 // MUST ENSURE p=2 mod 3 otherwise cubing is not invertible in ZZ_q^*
-void constructPrimePower(mpz_t q, mpz_t b, const unsigned long secpar, const unsigned long N){
+// construct q = p^k and set p and k accordingly
+static void constructPrimePowerFactors(mpz_t q, mpz_t b, mpz_t p, unsigned long* kp, const unsigned long secpar, const unsigned long N){
 
-    mpz_t p;
     unsigned long k;
 
-    mpz_init(p);
-
     // get a random number of exactly secpar bits
     findOpensslPrime(p, secpar, false); // gets random prime of secpar bits congruent to 2 modulo 3
 
@@ -356,5 +564,129 @@ void constructPrimePower(mpz_t q, mpz_t b, const unsigned long secpar, const uns
 	mpz_divexact_ui(b, b, 3);
     }
 
+    if (kp) *kp = k;
+}
+
+void constructPrimePower(mpz_t q, mpz_t b, const unsigned long secpar, const unsigned long N){
+
+    mpz_t p;
+
+    mpz_init(p);
+    constructPrimePowerFactors(q, b, p, NULL, secpar, N);
     mpz_clear(p);
 }
+
+void initModulus(struct modulus* mod) {
+    mpz_inits(mod->q, mod->b, mod->p, mod->p2, NULL);
+    mod->primes = NULL;
+    mod->pairs = NULL;
+    mod->nprimes = 0;
+    mod->k = 0;
+}
+
+void clearModulus(struct modulus* mod) {
+    mpz_clears(mod->q, mod->b, mod->p, mod->p2, NULL);
+    free(mod->primes);
+    free(mod->pairs);
+    mod->primes = NULL;
+    mod->pairs = NULL;
+    mod->nprimes = 0;
+}
+
+// whether constructSafePrime has a fixed prime of size N
+static bool fixedSafePrime(const unsigned long N) {
+    return N == 5000l || (N % 10000l == 0 && N >= 10000l && N <= 100000l);
+}
+
+// construct q = p p2 with p and p2 distinct safe primes = 2 mod 3 and b the inverse of 3 mod (p-1)(p2-1)
+// small primes come from OpenSSL, otherwise we take two fixed primes of different sizes adding up to N,
+// as balanced as possible
+static int constructRSAFactors(mpz_t q, mpz_t b, mpz_t p, mpz_t p2, const unsigned long N) {
+    unsigned long a;
+
+    if (N/2 < 3500l) {
+	findOpensslPrime(p, N/2, true);
+	do findOpensslPrime(p2, N - N/2, true); while (mpz_cmp(p, p2) == 0);
+    } else {
+	for (a = N/2; a > 0 && !(fixedSafePrime(a) && fixedSafePrime(N-a) && 2*a != N); --a);
+	if (a == 0) {
+	    fprintf(stderr, "constructing a product of two safe primes of total size %lu is not supported\n", N);
+	    return 1;
+	}
+	constructSafePrime(p, NULL, a);
+	constructSafePrime(p2, NULL, N-a);
+    }
+
+    mpz_mul(q, p, p2);
+
+    if (b) {
+	mpz_sub_ui(b, p, 1);
+	mpz_mul(b, b, p2);
+	mpz_sub(b, b, p);
+	mpz_add_ui(b, b, 1); // (p-1)(p2-1)
+
+	// p = p2 = 2 mod 3, so \phi(q) = 1 mod 3 and b = (1 + 2\phi(q))/3
+	mpz_mul_2exp(b, b, 1);
+	mpz_add_ui(b, b, 1);
+	mpz_divexact_ui(b, b, 3);
+    }
+
+    return 0;
+}
+
+int constructModulus(struct modulus* mod, const enum modulusType type, const unsigned long N, const unsigned long secpar, const int nprimes) {
+
+    mod->type = type;
+    mod->N = N;
+
+    switch (type) {
+    case MODULUS_SAFE_PRIME:
+	constructSafePrime(mod->q, mod->b, N);
+	mpz_set(mod->p, mod->q);
+	mod->k = 1;
+	break;
+    case MODULUS_PRIME_POWER:
+	constructPrimePowerFactors(mod->q, mod->b, mod->p, &mod->k, secpar, N);
+	break;
+    case MODULUS_M_POWER:
+	if (mod->nprimes != nprimes) {
+	    mod->primes = realloc(mod->primes, nprimes*sizeof(uint32_t));
+	    mod->pairs = realloc(mod->pairs, (nprimes+1)/2*sizeof(uint64_t));
+	    if (mod->primes == NULL || mod->pairs == NULL) {
+		fprintf(stderr, "ERRROR initialising temporary primes\n");
+		mod->nprimes = 0;
+		return 1;
+	    }
+	    mod->nprimes = nprimes;
+	}
+	if (constructmPowerFactors(mod->q, mod->b, mod->primes, nprimes, N, &mod->k) != 0) return 1;
+	// two 32-bit primes per 64-bit divisor halves the remainders of isUnitModulo
+	for (int i = 0; i < nprimes; i += 2) {
+	    mod->pairs[i/2] = (uint64_t) mod->primes[i] * (i+1 < nprimes ? mod->primes[i+1] : 1);
+	}
+	break;
+    case MODULUS_RSA:
+	mod->k = 1;
+	return constructRSAFactors(mod->q, mod->b, mod->p, mod->p2, N);
+    }
+    return 0;
+}
+
+bool isUnitModulo(const struct modulus* mod, const mpz_t c) {
+    switch (mod->type) {
+    case MODULUS_SAFE_PRIME:
+    case MODULUS_PRIME_POWER:
+	return !mpz_divisible_p(c, mod->p);
+    case MODULUS_RSA:
+	return !mpz_divisible_p(c, mod->p) && !mpz_divisible_p(c, mod->p2);
+    case MODULUS_M_POWER:
+	if (mpz_even_p(c)) return false;
+	for (int i = 0; i < mod->nprimes; i += 2) {
+	    // c mod p_i p_{i+1}, then the two 32-bit remainders
+	    const uint64_t r = mpz_fdiv_ui(c, mod->pairs[i/2]);
+	    if (r % mod->primes[i] == 0 || (i+1 < mod->nprimes && r % mod->primes[i+1] == 0)) return false;
+	}
+	return true;
+    }
+    return false;
+}
@@ -3,8 +3,19 @@
 
 #include <stdbool.h> // for bool
 #include <stdio.h>
+#include <stdint.h>
 #include <gmp.h>
 
+// where the 32-bit primes for m2^k moduli are taken from
+enum primeSource {
+    PRIMES_FROM_DB, // random entries of the prime database (default)
+    PRIMES_FROM_MR // random candidates tested with Miller-Rabin, no database needed
+};
+
+void setPrimeSource(const enum primeSource source);
+
+enum primeSource getPrimeSource();
+
 void clearPrimesDB();
 
 int loadPrimesDB();
@@ -19,6 +30,41 @@ void constructPrimePower(mpz_t q, mpz_t b, const unsigned long secpar, const uns
 // construct modulo m2^k with m consisting of a product of distinct 32-bit nprimes
 void constructmPower(mpz_t q, mpz_t b, const int nprimes,  const unsigned long N);
 
+// the kinds of moduli we can construct
+enum modulusType {
+    MODULUS_SAFE_PRIME, // q = p safe prime
+    MODULUS_PRIME_POWER, // q = p^k
+    MODULUS_M_POWER, // q = m2^k with m a product of distinct 32-bit primes
+    MODULUS_RSA // q = p p2 with p, p2 distinct safe primes of about N/2 bits
+};
+
+// a modulus together with its trapdoor (b and the factorization)
+struct modulus {
+    enum modulusType type;
+    unsigned long N; // size requested
+    mpz_t q; // the modulus
+    mpz_t b; // inverse of 3 mod \phi(q)
+    mpz_t p; // the prime for MODULUS_SAFE_PRIME and MODULUS_PRIME_POWER, the first one for MODULUS_RSA
+    mpz_t p2; // the second prime for MODULUS_RSA
+    unsigned long k; // the exponent of p (MODULUS_PRIME_POWER) or 2 (MODULUS_M_POWER)
+    uint32_t* primes; // the primes dividing m, sorted (MODULUS_M_POWER)
+    uint64_t* pairs; // products of consecutive pairs of primes, (nprimes+1)/2 of them (MODULUS_M_POWER)
+    int nprimes;
+};
+
+void initModulus(struct modulus* mod);
+
+void clearModulus(struct modulus* mod);
+
+// construct a modulus of the given type and size N, keeping its factorization
+// secpar is used for MODULUS_PRIME_POWER and nprimes for MODULUS_M_POWER
+// returns 0 on success
+int constructModulus(struct modulus* mod, const enum modulusType type, const unsigned long N, const unsigned long secpar, const int nprimes);
+
+// whether c is in ZZ^*_q, using the factorization instead of a gcd with q:
+// a division by the prime(s) or, for m2^k, the parity and one remainder per pair of 32-bit primes
+bool isUnitModulo(const struct modulus* mod, const mpz_t c);
+
 // returns a random prime of Nbits bits, if safe is set, a safe prime is returned
 void findOpensslPrime(mpz_t p, const unsigned long Nbits, const bool safe);
 
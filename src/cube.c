@@ -0,0 +1,69 @@
+#include "cube.h"
+
+#include <stdlib.h>
+
+// drop the zero high limbs
+#define MPN_NORMALIZE_LIMBS(p, n) while ((n) > 0 && (p)[(n)-1] == 0) --(n)
+
+// scratch space for cube, grown as needed and kept between calls
+static _Thread_local mp_limb_t* scratch = NULL;
+static _Thread_local mp_size_t scratchSize = 0;
+
+void cube(mpz_t r, const mpz_t m, const mpz_t q) {
+    const mp_size_t n = mpz_size(q), mn = mpz_size(m);
+    const mp_limb_t* const qp = mpz_limbs_read(q);
+    mp_limb_t *tp, *xp, *dp, *rp;
+    mp_size_t tn, xn;
+    mpz_t t;
+
+    if (mn == 0) {
+	mpz_set_ui(r, 0);
+	return;
+    }
+
+    // product | m^2 mod q | quotient
+    if (scratchSize < 4*mn + 2*n) {
+	free(scratch);
+	scratchSize = 4*mn + 2*n;
+	scratch = malloc(scratchSize*sizeof(mp_limb_t));
+	if (!scratch) { // fall back to GMP
+	    scratchSize = 0;
+	    mpz_init(t);
+	    mpz_powm_ui(t, m, 3, q);
+	    mpz_swap(r, t);
+	    mpz_clear(t);
+	    return;
+	}
+    }
+    tp = scratch;
+    xp = tp + 2*mn + n;
+    dp = xp + n;
+
+    // reducing the square first keeps both the multiplication and the division n by n
+    mpn_sqr(tp, mpz_limbs_read(m), mn);
+    tn = 2*mn;
+    if (tn >= n) {
+	mpn_tdiv_qr(dp, xp, 0, tp, tn, qp, n);
+	xn = n;
+    } else {
+	mpn_copyi(xp, tp, tn);
+	xn = tn;
+    }
+    MPN_NORMALIZE_LIMBS(xp, xn);
+    if (xn == 0) {
+	mpz_set_ui(r, 0);
+	return;
+    }
+
+    if (xn >= mn) mpn_mul(tp, xp, xn, mpz_limbs_read(m), mn);
+    else mpn_mul(tp, mpz_limbs_read(m), mn, xp, xn);
+    tn = xn + mn;
+
+    rp = mpz_limbs_write(r, n);
+    if (tn >= n) mpn_tdiv_qr(dp, rp, 0, tp, tn, qp, n);
+    else {
+	mpn_zero(rp, n);
+	mpn_copyi(rp, tp, tn);
+    }
+    mpz_limbs_finish(r, n);
+}
@@ -0,0 +1,16 @@
+#ifndef CUBE_H
+#define CUBE_H
+
+#include <gmp.h>
+
+// Cubing is the hot path of puzzle creation, so it gets its own functions rather than mpz_powm_ui
+// (which dispatches through GMP's generic exponentiation).
+
+// r = m^3 mod q with one square and one multiplication, each followed by a division
+// (reducing once after the multiplication would need a 2n by n multiplication and a 3n by n division, which cost more)
+// r may be m; m must be non-negative
+void cube(mpz_t r, const mpz_t m, const mpz_t q);
+
+// with a Montgomery context, montCube in montgomery.h cubes without leaving Montgomery form
+
+#endif
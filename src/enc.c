@@ -1,6 +1,7 @@
 #include "enc.h"
 
 #include <openssl/evp.h>
+#include <stdlib.h>
 #include <string.h> // memcpy
 //#define NDEBUG
 #include <assert.h>
@@ -23,7 +24,7 @@ int initialiseOpenSSL() {
     }
 
     aes256ofb = EVP_CIPHER_fetch(NULL, "AES-256-OFB", NULL); // fetch any implementation for the default library context
-    if (aes256 == NULL) { // something failed
+    if (aes256ofb == NULL) { // something failed
 	fprintf(stderr, "AES-OFB fetch failed\n");
 	return -1; // exit
     }
@@ -41,8 +42,9 @@ int streamCipher(mpz_t c, const mpz_t m, const mpz_t M, const uint8_t *key, cons
     const int bufferSize = nLimbs * 8;
     mp_limb_t* cptr;
     mpz_t temp;
-    uint8_t * buffer;
+    uint8_t * buffer = NULL;
     bool ok;
+    int err = -1;
     int t = 1; // set to 1 so we can check endianess
     bool lendian = ((uint8_t*)&t)[0] & 1; // check if int is stored LSB first or MSB
     assert(lendian); // no need to handle big endian as all my machines are little endian
@@ -52,7 +54,7 @@ int streamCipher(mpz_t c, const mpz_t m, const mpz_t M, const uint8_t *key, cons
     if (ctx == NULL) {
 	if (initialiseOpenSSL() != 0){
 	    fprintf(stderr, "Initialisation failed\n");
-	    return -1;
+	    goto free;
 	}
     }
 
@@ -60,12 +62,13 @@ int streamCipher(mpz_t c, const mpz_t m, const mpz_t M, const uint8_t *key, cons
     // the first 16 bytes (128-bits) of the key are the IV!
     if (1 != EVP_EncryptInit_ex2(ctx, aes256ofb, key+16 , key, NULL)){ // the null is params
 	fprintf(stderr, "Failed to init context\n");
-	return -1;
+	goto free;
     }
     EVP_CIPHER_CTX_set_padding(ctx, 0); // disable padding
 
 
     buffer = (uint8_t*) malloc(nLimbs*sizeof(uint64_t));
+    if (!buffer) goto free;
 
     // to encrypt m, we first copy it to cptr
     mpz_set(c, m);
@@ -84,8 +87,7 @@ int streamCipher(mpz_t c, const mpz_t m, const mpz_t M, const uint8_t *key, cons
 	// otherwise the first byte of the last limb is the top-most byte!
 	if (!EVP_EncryptUpdate(ctx, ((uint8_t*)cptr), &t, buffer, nbytes)) {
 	    fprintf(stderr, "Enc failed\n");
-	    free(buffer);
-	    return -1;
+	    goto free;
 	}
 	assert(t==nbytes);
 
@@ -105,13 +107,378 @@ int streamCipher(mpz_t c, const mpz_t m, const mpz_t M, const uint8_t *key, cons
     // FINALISE EVERYTHING
     if (!EVP_EncryptFinal_ex(ctx, ((uint8_t*)cptr), &t)){
 	fprintf(stderr, "Finalisation failed\n");
-	return -1;
+	goto free;
     }
     assert(t==0);
+    err = 0; // done!
 
+ free:
     free(buffer);
     mpz_clear(temp);
-    return 0; // done!
+    return err;
+}
+
+/************************************************************************************/
+// CIPHER SESSIONS
+
+// the limbs are encrypted as bytes in place, which gives the byte order of streamCipher only on little endian machines
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "cipher sessions need a little endian machine"
+#endif
+
+// iv = iv + blocks as a 128-bit big endian counter, as AES-CTR increments it
+static void addCounter(uint8_t* iv, uint64_t blocks) {
+    for (int i = 15; i >= 0 && blocks; --i) {
+	const uint64_t sum = iv[i] + (blocks & 0xff);
+	iv[i] = sum & 0xff;
+	blocks = (blocks >> 8) + (sum >> 8);
+    }
+}
+
+// part of the CTR keystream of the current batch, the blocks [part*nblocks/nparts, (part+1)*nblocks/nparts)
+static int ctrPart(struct cipherSession* session, EVP_CIPHER_CTX* ctx, const int part) {
+    const size_t first = part*session->nblocks/session->nparts;
+    const size_t last = (part+1)*session->nblocks/session->nparts;
+    uint8_t iv[16];
+    int len;
+
+    memcpy(iv, session->iv, 16);
+    addCounter(iv, session->startBlock + first);
+    if (1 != EVP_EncryptInit_ex2(ctx, NULL, NULL, iv, NULL)) return -1;
+    if (last > first && !EVP_EncryptUpdate(ctx, session->keystream + 16*first, &len, session->zeros, 16*(last - first))) return -1;
+    return 0;
+}
+
+static void* cipherWorker(void* arg) {
+    struct cipherWorker* const worker = (struct cipherWorker*) arg;
+    struct cipherSession* const session = worker->session;
+    unsigned long generation = 0;
+    int err;
+
+    pthread_mutex_lock(&session->lock);
+    while (true) {
+	while (session->generation == generation && !session->stop) pthread_cond_wait(&session->start, &session->lock);
+	if (session->stop) break;
+	generation = session->generation;
+	pthread_mutex_unlock(&session->lock);
+
+	err = worker->id < session->nparts ? ctrPart(session, worker->ctx, worker->id) : 0;
+
+	pthread_mutex_lock(&session->lock);
+	if (err) session->failed = true;
+	if (--session->pending == 0) pthread_cond_signal(&session->finished);
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    return NULL;
+}
+
+// the next len bytes of keystream, in *ks
+static int nextKeystream(struct cipherSession* session, const size_t len, const uint8_t** ks) {
+    const size_t skip = session->streamPos % 16;
+    int outl, err = 0;
+
+    if (session->mode == CIPHER_OFB) { // sequential, the stream continues in the context
+	if (!EVP_EncryptUpdate(session->ctx, session->keystream, &outl, session->zeros, len)) return -1;
+	*ks = session->keystream;
+	return 0;
+    }
+
+    // CTR blocks can be computed in any order: the batch is split in whole blocks between the threads
+    session->startBlock = session->streamPos / 16;
+    session->nblocks = (skip + len + 15)/16;
+    session->nparts = session->nblocks < (size_t) session->nThreads ? (int) session->nblocks : session->nThreads;
+
+    if (session->nparts > 1) {
+	pthread_mutex_lock(&session->lock);
+	session->pending = session->nThreads - 1;
+	session->failed = false;
+	++session->generation;
+	pthread_cond_broadcast(&session->start);
+	pthread_mutex_unlock(&session->lock);
+    }
+
+    err = ctrPart(session, session->ctx, 0);
+
+    if (session->nparts > 1) {
+	pthread_mutex_lock(&session->lock);
+	while (session->pending) pthread_cond_wait(&session->finished, &session->lock);
+	if (session->failed) err = -1;
+	pthread_mutex_unlock(&session->lock);
+    }
+
+    *ks = session->keystream + skip;
+    session->streamPos += len;
+    return err;
+}
+
+int cipherSessionInit(struct cipherSession* session, const enum cipherMode mode, const enum cipherEncoding encoding, const int nThreads) {
+    const char* name = mode == CIPHER_CTR ? "AES-256-CTR" : "AES-256-OFB";
+
+    memset(session, 0, sizeof(*session));
+    mpz_init(session->M);
+    session->mode = mode;
+    session->encoding = encoding;
+    session->nThreads = 1;
+
+    session->ctx = EVP_CIPHER_CTX_new();
+    session->cipher = EVP_CIPHER_fetch(NULL, name, NULL);
+    if (!session->ctx || !session->cipher) {
+	fprintf(stderr, "ERROR creating the %s context of the cipher session\n", name);
+	cipherSessionClear(session);
+	return -1;
+    }
+
+    // only CTR splits its keystream, each worker with its own context
+    if (mode != CIPHER_CTR || nThreads <= 1) return 0;
+
+    session->workers = calloc(nThreads - 1, sizeof(struct cipherWorker));
+    if (!session->workers) {
+	cipherSessionClear(session);
+	return -1;
+    }
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->start, NULL);
+    pthread_cond_init(&session->finished, NULL);
+    session->hasThreads = true;
+
+    for (int i = 1; i < nThreads; ++i) {
+	struct cipherWorker* worker = session->workers + i - 1;
+	worker->session = session;
+	worker->id = i;
+	worker->ctx = EVP_CIPHER_CTX_new();
+	if (!worker->ctx || pthread_create(&worker->thread, NULL, cipherWorker, worker) != 0) {
+	    if (worker->ctx) EVP_CIPHER_CTX_free(worker->ctx);
+	    worker->ctx = NULL;
+	    break;
+	}
+	++session->nThreads;
+    }
+
+    if (session->nThreads != nThreads) {
+	fprintf(stderr, "ERROR starting the threads of the cipher session\n");
+	cipherSessionClear(session);
+	return -1;
+    }
+    return 0;
+}
+
+void cipherSessionClear(struct cipherSession* session) {
+    if (session->hasThreads) {
+	pthread_mutex_lock(&session->lock);
+	session->stop = true;
+	pthread_cond_broadcast(&session->start);
+	pthread_mutex_unlock(&session->lock);
+	for (int i = 1; i < session->nThreads; ++i) {
+	    pthread_join(session->workers[i-1].thread, NULL);
+	    EVP_CIPHER_CTX_free(session->workers[i-1].ctx);
+	}
+	pthread_mutex_destroy(&session->lock);
+	pthread_cond_destroy(&session->start);
+	pthread_cond_destroy(&session->finished);
+    }
+    free(session->workers);
+    if (session->ctx) EVP_CIPHER_CTX_free(session->ctx);
+    if (session->cipher) EVP_CIPHER_free(session->cipher);
+    free(session->zeros);
+    free(session->keystream);
+    free(session->wide);
+    mpz_clear(session->M);
+    memset(session, 0, sizeof(*session));
+}
+
+int cipherSessionSetModulus(struct cipherSession* session, const struct modulus* mod) {
+    const size_t N = mpz_sizeinbase(mod->q, 2);
+    const size_t nbytes = (N+7)/8;
+    const mp_size_t nLimbs = mpz_size(mod->q);
+    const mp_size_t wideLimbs = nLimbs + CIPHER_WIDE_EXTRA_LIMBS;
+    const mp_size_t wideSize = wideLimbs + nLimbs + mpn_sec_div_r_itch(wideLimbs, nLimbs);
+    size_t size = CIPHER_SESSION_BATCH*nbytes;
+
+    if (session->encoding == CIPHER_WIDE) {
+	if (mod->type == MODULUS_M_POWER) {
+	    fprintf(stderr, "ERROR the wide encoding does not give units modulo m2^k\n");
+	    return -1;
+	}
+	if (wideLimbs*sizeof(mp_limb_t) > size) size = wideLimbs*sizeof(mp_limb_t);
+	if (wideSize > session->wideSize) {
+	    free(session->wide);
+	    session->wide = malloc(wideSize*sizeof(mp_limb_t));
+	    session->wideSize = session->wide ? wideSize : 0;
+	    if (!session->wide) {
+		fprintf(stderr, "ERROR allocating the buffers of the cipher session\n");
+		return -1;
+	    }
+	}
+    }
+    // CTR batches start up to 15 bytes into a block and are computed in whole blocks
+    size = 16*((size + 15 + 15)/16);
+
+    mpz_set(session->M, mod->q);
+    session->mod = mod;
+    session->m2k = mod->type == MODULUS_M_POWER;
+    session->nLimbs = nLimbs;
+    session->nbytes = nbytes;
+    session->topMask = 0xff >> (nbytes*8 - N);
+
+    // the buffers only grow, so moduli of the same size reuse them
+    if (size > session->bufferSize) {
+	free(session->zeros);
+	free(session->keystream);
+	session->zeros = calloc(size, 1);
+	session->keystream = malloc(size);
+	session->bufferSize = session->zeros && session->keystream ? size : 0;
+	if (!session->bufferSize) {
+	    fprintf(stderr, "ERROR allocating the buffers of the cipher session\n");
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+int cipherSessionSetKey(struct cipherSession* session, const uint8_t* key) {
+    bool ok;
+
+    // the first 16 bytes (128-bits) of the key are the IV, as in streamCipher
+    ok = 1 == EVP_EncryptInit_ex2(session->ctx, session->cipher, key+16, key, NULL);
+    for (int i = 1; ok && i < session->nThreads; ++i) ok = 1 == EVP_EncryptInit_ex2(session->workers[i-1].ctx, session->cipher, key+16, key, NULL);
+    if (!ok) {
+	fprintf(stderr, "ERROR setting the key of the cipher session\n");
+	session->hasKey = false;
+	return -1;
+    }
+    EVP_CIPHER_CTX_set_padding(session->ctx, 0);
+    memcpy(session->iv, key, sizeof(session->iv));
+    session->hasKey = true;
+    session->freshIV = true;
+    return 0;
+}
+
+// rp ^= the nbytes bytes at ks, rp little endian
+static inline void xorBytes(mp_ptr rp, const uint8_t* ks, const size_t nbytes) {
+    const size_t nwords = nbytes/8;
+    uint8_t* const bytes = (uint8_t*) rp;
+    uint64_t w;
+
+    for (size_t i = 0; i < nwords; ++i) {
+	memcpy(&w, ks + 8*i, 8);
+	rp[i] ^= w;
+    }
+    for (size_t i = 8*nwords; i < nbytes; ++i) bytes[i] ^= ks[i];
+}
+
+// restart the keystream from the IV (CTR sets the counter of every batch itself)
+static int restartKeystream(struct cipherSession* session) {
+    if (session->mode == CIPHER_OFB && !session->freshIV && 1 != EVP_EncryptInit_ex2(session->ctx, NULL, NULL, session->iv, NULL)) {
+	fprintf(stderr, "ERROR resetting the IV of the cipher session\n");
+	return -1;
+    }
+    session->freshIV = false;
+    session->streamPos = 0;
+    return 0;
+}
+
+// the wide keystream reduced mod M in constant time, in the first limbs of the returned buffer, or NULL on failure
+static mp_limb_t* wideKeystream(struct cipherSession* session) {
+    const mp_size_t nLimbs = session->nLimbs;
+    const mp_size_t wideLimbs = nLimbs + CIPHER_WIDE_EXTRA_LIMBS;
+    mp_limb_t* const rp = session->wide;
+    const uint8_t* ks = NULL;
+
+    if (restartKeystream(session) != 0 || nextKeystream(session, wideLimbs*sizeof(mp_limb_t), &ks) != 0) {
+	fprintf(stderr, "ERROR encrypting in the cipher session\n");
+	return NULL;
+    }
+    memcpy(rp, ks, wideLimbs*sizeof(mp_limb_t));
+    mpn_sec_div_r(rp, wideLimbs, mpz_limbs_read(session->M), nLimbs, rp + wideLimbs + nLimbs);
+    return rp;
+}
+
+// c = m + k mod M for m, k < M, without branching on the values
+static int wideEncrypt(struct cipherSession* session, mpz_t c, const mpz_t m) {
+    const mp_size_t nLimbs = session->nLimbs;
+    const mp_size_t mLimbs = mpz_size(m);
+    mp_limb_t *kp, *cptr, *tp, cy, bw;
+
+    if (!(kp = wideKeystream(session))) return -1;
+    tp = kp + nLimbs + CIPHER_WIDE_EXTRA_LIMBS;
+
+    cptr = mpz_limbs_modify(c, nLimbs);
+    if (c != m) mpn_copyi(cptr, mpz_limbs_read(m), mLimbs);
+    mpn_zero(cptr + mLimbs, nLimbs - mLimbs);
+
+    // subtract M if the sum overflowed or is at least M
+    cy = mpn_add_n(cptr, cptr, kp, nLimbs);
+    bw = mpn_sub_n(tp, cptr, mpz_limbs_read(session->M), nLimbs);
+    mpn_cnd_swap(cy | (bw ^ 1), cptr, tp, nLimbs);
+    mpz_limbs_finish(c, nLimbs);
+
+    ++session->attempts;
+    ++session->calls;
+    return 0;
+}
+
+int cipherSessionDecrypt(struct cipherSession* session, mpz_t m, const mpz_t c) {
+    const mp_size_t nLimbs = session->nLimbs;
+    const mp_size_t cLimbs = mpz_size(c);
+    mp_limb_t *kp, *mptr;
+
+    if (session->encoding != CIPHER_WIDE || !session->hasKey || !session->bufferSize) return -1;
+    if (!(kp = wideKeystream(session))) return -1;
+
+    mptr = mpz_limbs_modify(m, nLimbs);
+    if (m != c) mpn_copyi(mptr, mpz_limbs_read(c), cLimbs);
+    mpn_zero(mptr + cLimbs, nLimbs - cLimbs);
+
+    // add M back if the difference is negative
+    mpn_cnd_add_n(mpn_sub_n(mptr, mptr, kp, nLimbs), mptr, mptr, mpz_limbs_read(session->M), nLimbs);
+    mpz_limbs_finish(m, nLimbs);
+    return 0;
+}
+
+int cipherSessionEncrypt(struct cipherSession* session, mpz_t c, const mpz_t m) {
+    const size_t nbytes = session->nbytes;
+    const mp_size_t nLimbs = session->nLimbs;
+    const mp_size_t mLimbs = mpz_size(m);
+    const uint8_t* ks = NULL;
+    int available = 0;
+    mp_limb_t* cptr;
+    bool ok;
+
+    if (!session->hasKey || !session->bufferSize) return -1;
+    if (session->encoding == CIPHER_WIDE) return wideEncrypt(session, c, m);
+
+    // the same stream as streamCipher, from the IV
+    if (restartKeystream(session) != 0) return -1;
+
+    // encrypt in place in the limbs of c
+    cptr = mpz_limbs_modify(c, nLimbs);
+    if (c != m) mpn_copyi(cptr, mpz_limbs_read(m), mLimbs);
+    mpn_zero(cptr + mLimbs, nLimbs - mLimbs);
+
+    do {
+	// the keystream does not depend on the plaintext, so the one of CIPHER_SESSION_BATCH attempts
+	// is produced at once
+	if (available == 0) {
+	    if (nextKeystream(session, CIPHER_SESSION_BATCH*nbytes, &ks) != 0) {
+		fprintf(stderr, "ERROR encrypting in the cipher session\n");
+		return -1;
+	    }
+	    available = CIPHER_SESSION_BATCH;
+	}
+
+	xorBytes(cptr, ks, nbytes);
+	((uint8_t*) cptr)[nbytes-1] &= session->topMask;
+	ks += nbytes;
+	--available;
+	++session->attempts;
+
+	mpz_limbs_finish(c, nLimbs);
+	ok = mpz_cmp(c, session->M) < 0 && (!session->m2k || isUnitModulo(session->mod, c));
+    } while (!ok);
+
+    ++session->calls;
+    return 0;
 }
 
 
@@ -6,8 +6,109 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <openssl/evp.h>
+#include <pthread.h>
+
+#include "constructPrimes.h"
+
 int streamCipher(mpz_t res, const mpz_t m, const mpz_t M, const uint8_t *key, const bool m2k);
 
+// A cipher session gives the same ciphertexts as streamCipher without its per-call setup.
+// The session keeps its AES context, so that a new key costs one key schedule and a new message
+// only resets the IV, and its buffers are allocated when the modulus grows, so that encryptions do not allocate.
+// The keystream does not depend on the plaintext, so the keystream of CIPHER_SESSION_BATCH cycle-walk
+// attempts is produced at once and xored straight into the limbs of the ciphertext.
+// In CTR mode the blocks of the keystream are independent: OpenSSL computes several of them at once in the
+// AES-NI/VAES pipelines, and with several threads the batch is split between them, each with its own context.
+// CTR ciphertexts differ from those of streamCipher, which uses OFB.
+// With the wide encoding the ciphertext is m + (K mod M) mod M instead, for a keystream K with
+// CIPHER_WIDE_EXTRA_LIMBS more limbs than M: K mod M is within 2^-128 of uniform, so there are no retries,
+// every message costs the same AES blocks, and the reduction and addition run in constant time.
+// The ciphertexts of m2^k moduli would not always be units, so the wide encoding is only for the other moduli.
+
+// cycle-walk attempts whose keystream is produced at once
+// a random value is below M with probability above 1/2 (and odd with probability 1/2 for m2^k moduli)
+#define CIPHER_SESSION_BATCH 4
+
+// extra limbs of the wide keystream, the statistical distance of K mod M from uniform is below 2^-(64 extra limbs)
+#define CIPHER_WIDE_EXTRA_LIMBS 2
+
+enum cipherMode {
+    CIPHER_OFB, // as streamCipher
+    CIPHER_CTR
+};
+
+enum cipherEncoding {
+    CIPHER_CYCLE_WALK, // xor and retry until the ciphertext is in range, as streamCipher
+    CIPHER_WIDE // add a keystream reduced mod M
+};
+
+struct cipherWorker {
+    struct cipherSession* session;
+    int id;
+    pthread_t thread;
+    EVP_CIPHER_CTX* ctx;
+};
+
+struct cipherSession {
+    enum cipherMode mode;
+    enum cipherEncoding encoding;
+    EVP_CIPHER_CTX* ctx;
+    EVP_CIPHER* cipher;
+    uint8_t iv[16];
+    bool hasKey;
+    bool freshIV; // no encryption since the key was set
+
+    mpz_t M;
+    const struct modulus* mod;
+    bool m2k; // ciphertexts must be units modulo M, checked with the factorization in mod
+    mp_size_t nLimbs;
+    size_t nbytes; // bytes of M
+    uint8_t topMask; // bits of the top byte below the size of M
+
+    uint8_t* zeros; // encrypted into keystream
+    uint8_t* keystream;
+    size_t bufferSize;
+    mp_limb_t* wide; // CIPHER_WIDE, the keystream as limbs, the difference with M and the scratch of the division
+    mp_size_t wideSize;
+
+    // CTR threads, the calling thread computes the first part of every batch
+    int nThreads;
+    bool hasThreads;
+    struct cipherWorker* workers; // nThreads-1 workers
+    pthread_mutex_t lock;
+    pthread_cond_t start, finished;
+    unsigned long generation; // incremented to start a batch
+    int pending; // workers still computing the batch
+    bool stop, failed;
+    uint64_t streamPos; // bytes of keystream used since the IV
+    uint64_t startBlock; // first block of the batch
+    size_t nblocks;
+    int nparts;
+
+    unsigned long calls, attempts;
+};
+
+// all return 0 on success and -1 on failure
+// nThreads only matters for CTR
+int cipherSessionInit(struct cipherSession* session, const enum cipherMode mode, const enum cipherEncoding encoding, const int nThreads);
+
+void cipherSessionClear(struct cipherSession* session);
+
+// encrypt modulo mod->q, with m2k set for MODULUS_M_POWER; mod is kept until the next call and must outlive
+// the encryptions; fails for m2^k moduli with CIPHER_WIDE
+int cipherSessionSetModulus(struct cipherSession* session, const struct modulus* mod);
+
+// key holds the IV (16 bytes) followed by the key (32 bytes), as for streamCipher
+int cipherSessionSetKey(struct cipherSession* session, const uint8_t* key);
+
+// c = the encryption of m, equal to streamCipher(c, m, mod->q, key, m2k) in OFB mode; c may be m
+// with CIPHER_WIDE, m must be below M
+int cipherSessionEncrypt(struct cipherSession* session, mpz_t c, const mpz_t m);
+
+// m = the decryption of c, only for CIPHER_WIDE
+int cipherSessionDecrypt(struct cipherSession* session, mpz_t m, const mpz_t c);
+
 void cleanOpenSSL();
 
 int initialiseOpenSSL();
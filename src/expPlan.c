@@ -0,0 +1,89 @@
+#include "expPlan.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// left to right sliding windows of at most w bits, each starting and ending with a 1
+// if plan is not NULL its arrays are filled, the number of windows and squarings are returned in any case
+static long recode(const mpz_t e, const int w, struct expPlan* plan, mp_bitcnt_t* squarings) {
+    long i = mpz_sizeinbase(e, 2) - 1, j, nwindows = 0;
+    mp_bitcnt_t sq = 0;
+    uint32_t val;
+
+    *squarings = 0;
+    while (i >= 0) {
+	if (!mpz_tstbit(e, i)) {
+	    ++sq;
+	    --i;
+	    continue;
+	}
+
+	j = i - w + 1 < 0 ? 0 : i - w + 1;
+	while (!mpz_tstbit(e, j)) ++j;
+	if (nwindows) sq += i - j + 1; // the first window initialises the result
+	for (val = 0; i >= j; --i) val = (val << 1) | mpz_tstbit(e, i);
+
+	if (plan) {
+	    plan->idx[nwindows] = val >> 1;
+	    plan->nsq[nwindows] = sq;
+	}
+	*squarings += sq;
+	sq = 0;
+	++nwindows;
+    }
+
+    if (plan) plan->tail = sq;
+    *squarings += sq;
+    return nwindows;
+}
+
+// table: b^2 and the odd powers up to b^(2^w - 1); then one multiplication per window but the first
+static unsigned long cost(const int w, const long nwindows, const mp_bitcnt_t squarings) {
+    const unsigned long nentries = 1ul << (w-1);
+    return EXP_PLAN_SQR_COST*(squarings + 1) + EXP_PLAN_MUL_COST*(nentries - 1 + nwindows - 1);
+}
+
+int expPlanInit(struct expPlan* plan, const mpz_t e) {
+    unsigned long best = 0, c;
+    mp_bitcnt_t squarings;
+    long nwindows;
+
+    memset(plan, 0, sizeof(*plan));
+    mpz_init_set(plan->e, e);
+    plan->w = 1;
+    plan->nentries = 1;
+    if (mpz_sgn(e) < 0) {
+	expPlanClear(plan);
+	return 1;
+    }
+    if (mpz_sgn(e) == 0) return 0;
+
+    // windows longer than the exponent only make the table bigger
+    // the cost decreases until the table dominates, so we stop at the first increase
+    for (int w = 1; w <= EXP_PLAN_MAX_WINDOW && (mp_bitcnt_t)w <= mpz_sizeinbase(e, 2); ++w) {
+	nwindows = recode(e, w, NULL, &squarings);
+	c = cost(w, nwindows, squarings);
+	if (w > 1 && c >= best) break;
+	best = c;
+	plan->w = w;
+    }
+    plan->nentries = 1 << (plan->w - 1);
+
+    plan->nwindows = recode(e, plan->w, NULL, &squarings);
+    plan->idx = malloc(plan->nwindows*sizeof(uint32_t));
+    plan->nsq = malloc(plan->nwindows*sizeof(mp_bitcnt_t));
+    if (!plan->idx || !plan->nsq) {
+	expPlanClear(plan);
+	return 1;
+    }
+    recode(e, plan->w, plan, &squarings);
+
+    return 0;
+}
+
+void expPlanClear(struct expPlan* plan) {
+    free(plan->idx);
+    free(plan->nsq);
+    mpz_clear(plan->e);
+    memset(plan, 0, sizeof(*plan));
+}
@@ -0,0 +1,39 @@
+#ifndef EXP_PLAN_H
+#define EXP_PLAN_H
+
+#include <gmp.h>
+#include <stdint.h>
+
+// A fixed exponent recoded once in sliding windows, so that exponentiations to the same e (e.g. the cube root
+// exponent b of a modulus) do not scan its bits again for every base.
+// The window size is the one minimising the cost of the table plus the multiplications and squarings
+// of the recoding, which is computed exactly for every window size rather than read from a table of limits.
+// An exponentiation with a plan is
+//    x = table[idx[0]]
+//    for every window i > 0: x = x^(2^nsq[i]) table[idx[i]]
+//    x = x^(2^tail)
+// where table[j] = b^(2j+1) for j < nentries.
+
+// the largest window considered, 2^11 table entries
+#define EXP_PLAN_MAX_WINDOW 12
+
+// relative costs of a multiplication and of a squaring
+#define EXP_PLAN_MUL_COST 4
+#define EXP_PLAN_SQR_COST 3
+
+struct expPlan {
+    mpz_t e; // the exponent, for the callers falling back to mpz_powm
+    int w; // window size
+    int nentries; // entries of the table
+    long nwindows;
+    uint32_t* idx; // table entry multiplied by each window
+    mp_bitcnt_t* nsq; // squarings before each window, nsq[0] = 0
+    mp_bitcnt_t tail; // squarings after the last window
+};
+
+// returns 0 on success, and then the plan must be cleared; e = 0 gives a plan with no windows
+int expPlanInit(struct expPlan* plan, const mpz_t e);
+
+void expPlanClear(struct expPlan* plan);
+
+#endif
@@ -0,0 +1,222 @@
+#include "factory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rand.h"
+
+#define IDLE_SLEEP_NS 100000 // how long a thread sleeps when there is nothing to do
+
+static void idleSleep() {
+    const struct timespec t = { 0, IDLE_SLEEP_NS };
+    nanosleep(&t, NULL);
+}
+
+/************************************************************************************/
+// LOCK-FREE QUEUE
+// each cell has a sequence number which tells whether it is ready to be written (sequence == pos)
+// or read (sequence == pos+1) by the thread which claimed position pos
+
+int initQueue(struct mpmcQueue* queue, const size_t capacity) {
+    queue->cells = malloc(capacity*sizeof(*queue->cells));
+    if (!queue->cells) return 1;
+
+    for (size_t i = 0; i < capacity; ++i) atomic_init(&queue->cells[i].sequence, i);
+    queue->mask = capacity - 1;
+    atomic_init(&queue->enqueuePos, 0);
+    atomic_init(&queue->dequeuePos, 0);
+    return 0;
+}
+
+void clearQueue(struct mpmcQueue* queue) {
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+bool enqueue(struct mpmcQueue* queue, void* data) {
+    struct mpmcCell* cell;
+    size_t pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+
+    for (;;) {
+	cell = queue->cells + (pos & queue->mask);
+	const size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+	const long diff = (long)seq - (long)pos;
+	if (diff == 0) { // free cell, try to claim it
+	    if (atomic_compare_exchange_weak_explicit(&queue->enqueuePos, &pos, pos+1, memory_order_relaxed, memory_order_relaxed)) break;
+	} else if (diff < 0) return false; // full
+	else pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed); // someone else claimed it
+    }
+
+    cell->data = data;
+    atomic_store_explicit(&cell->sequence, pos+1, memory_order_release);
+    return true;
+}
+
+bool dequeue(struct mpmcQueue* queue, void** data) {
+    struct mpmcCell* cell;
+    size_t pos = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+
+    for (;;) {
+	cell = queue->cells + (pos & queue->mask);
+	const size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+	const long diff = (long)seq - (long)(pos+1);
+	if (diff == 0) {
+	    if (atomic_compare_exchange_weak_explicit(&queue->dequeuePos, &pos, pos+1, memory_order_relaxed, memory_order_relaxed)) break;
+	} else if (diff < 0) return false; // empty
+	else pos = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+    }
+
+    *data = cell->data;
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release); // ready for the next lap
+    return true;
+}
+
+size_t queueDepth(struct mpmcQueue* queue) {
+    const size_t in = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+    const size_t out = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+    return in > out ? in - out : 0;
+}
+
+
+/************************************************************************************/
+// FACTORY
+
+struct workerArgs {
+    struct modulusFactory* factory;
+    uint64_t seed;
+};
+
+static void* factoryWorker(void* arg) {
+    struct workerArgs args = *(struct workerArgs*) arg;
+    struct modulusFactory* const factory = args.factory;
+    void* mod;
+
+    free(arg);
+    setSeed(args.seed); // the state of xorshf64 is per thread, so each worker needs its own seed
+
+    while (atomic_load(&factory->running)) {
+	if (!dequeue(&factory->free, &mod)) { // the ready queue is full
+	    idleSleep();
+	    continue;
+	}
+
+	if (constructModulus((struct modulus*) mod, factory->type, factory->N, factory->secpar, factory->nprimes) != 0) {
+	    fprintf(stderr, "ERROR modulus construction failed in the factory\n");
+	    enqueue(&factory->free, mod);
+	    idleSleep();
+	    continue;
+	}
+
+	enqueue(&factory->ready, mod); // cannot fail: at most capacity moduli are around
+	atomic_fetch_add(&factory->produced, 1);
+    }
+
+    return NULL;
+}
+
+int startFactory(struct modulusFactory* factory, const enum modulusType type, const unsigned long N, const unsigned long secpar,
+		 const int nprimes, const size_t capacity, const int nWorkers) {
+
+    size_t cap = 1;
+    while (cap < capacity) cap <<= 1;
+
+    factory->type = type;
+    factory->N = N;
+    factory->secpar = secpar;
+    factory->nprimes = nprimes;
+    factory->capacity = cap;
+    factory->nWorkers = 0;
+    atomic_init(&factory->running, true);
+    atomic_init(&factory->produced, 0);
+    atomic_init(&factory->consumed, 0);
+
+    // the database must be loaded before the workers race to do it
+    if (type == MODULUS_M_POWER && getPrimeSource() == PRIMES_FROM_DB && loadPrimesDB() != 0) return 1;
+
+    factory->pool = malloc(cap*sizeof(struct modulus));
+    factory->workers = malloc(nWorkers*sizeof(pthread_t));
+    factory->ready.cells = factory->free.cells = NULL;
+    if (!factory->pool || !factory->workers || initQueue(&factory->ready, cap) || initQueue(&factory->free, cap)) {
+	fprintf(stderr, "ERROR failed to allocate the modulus factory\n");
+	// the moduli of the pool are not initialised yet
+	free(factory->pool);
+	free(factory->workers);
+	clearQueue(&factory->ready);
+	clearQueue(&factory->free);
+	factory->pool = NULL;
+	factory->workers = NULL;
+	return 1;
+    }
+
+    for (size_t i = 0; i < cap; ++i) {
+	initModulus(factory->pool + i);
+	enqueue(&factory->free, factory->pool + i);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &factory->start);
+
+    for (int i = 0; i < nWorkers; ++i) {
+	struct workerArgs* args = malloc(sizeof(*args));
+	if (!args) break;
+	args->factory = factory;
+	args->seed = xorshf64() | 1; // xorshift needs a non-zero state
+	if (pthread_create(factory->workers + i, NULL, factoryWorker, args) != 0) {
+	    free(args);
+	    break;
+	}
+	++factory->nWorkers;
+    }
+
+    if (factory->nWorkers == 0) {
+	fprintf(stderr, "ERROR failed to start the modulus factory\n");
+	stopFactory(factory);
+	return 1;
+    }
+
+    return 0;
+}
+
+void stopFactory(struct modulusFactory* factory) {
+    atomic_store(&factory->running, false);
+    for (int i = 0; i < factory->nWorkers; ++i) pthread_join(factory->workers[i], NULL);
+
+    for (size_t i = 0; i < factory->capacity; ++i) clearModulus(factory->pool + i);
+
+    free(factory->pool);
+    free(factory->workers);
+    clearQueue(&factory->ready);
+    clearQueue(&factory->free);
+    factory->pool = NULL;
+    factory->workers = NULL;
+    factory->nWorkers = 0;
+}
+
+struct modulus* popModulus(struct modulusFactory* factory) {
+    void* mod;
+    if (!dequeue(&factory->ready, &mod)) return NULL;
+    atomic_fetch_add_explicit(&factory->consumed, 1, memory_order_relaxed);
+    return (struct modulus*) mod;
+}
+
+struct modulus* waitModulus(struct modulusFactory* factory) {
+    struct modulus* mod;
+    while (!(mod = popModulus(factory))) idleSleep();
+    return mod;
+}
+
+void recycleModulus(struct modulusFactory* factory, struct modulus* mod) {
+    enqueue(&factory->free, mod);
+}
+
+void getFactoryStats(struct modulusFactory* factory, struct factoryStats* stats) {
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - factory->start.tv_sec) + (now.tv_nsec - factory->start.tv_nsec)/1e9;
+
+    stats->produced = atomic_load(&factory->produced);
+    stats->consumed = atomic_load(&factory->consumed);
+    stats->refillRate = elapsed > 0 ? stats->produced / elapsed : 0.0;
+    stats->depth = queueDepth(&factory->ready);
+}
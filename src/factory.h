@@ -0,0 +1,86 @@
+#ifndef FACTORY_H
+#define FACTORY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "constructPrimes.h"
+
+// A pool of worker threads constructing moduli in the background.
+// Moduli are handed over through a bounded lock-free queue, so a consumer gets a ready modulus in O(1).
+// When done with it, the consumer gives it back with recycleModulus and a worker will reuse its memory.
+
+// bounded multi-producer multi-consumer queue of pointers (Vyukov's algorithm)
+// capacity must be a power of 2
+struct mpmcQueue {
+    struct mpmcCell {
+	atomic_size_t sequence;
+	void* data;
+    } *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueuePos; // on its own cache line to avoid false sharing
+    _Alignas(64) atomic_size_t dequeuePos;
+};
+
+int initQueue(struct mpmcQueue* queue, const size_t capacity);
+
+void clearQueue(struct mpmcQueue* queue);
+
+// both return false if the queue is full/empty
+bool enqueue(struct mpmcQueue* queue, void* data);
+
+bool dequeue(struct mpmcQueue* queue, void** data);
+
+// number of elements in the queue (approximate if other threads are using it)
+size_t queueDepth(struct mpmcQueue* queue);
+
+struct modulusFactory {
+    // what to construct
+    enum modulusType type;
+    unsigned long N;
+    unsigned long secpar;
+    int nprimes;
+
+    struct modulus* pool; // all the moduli owned by the factory
+    size_t capacity;
+    struct mpmcQueue ready; // constructed moduli
+    struct mpmcQueue free; // moduli to be (re)constructed
+
+    pthread_t* workers;
+    int nWorkers;
+    atomic_bool running;
+    atomic_ulong produced;
+    atomic_ulong consumed;
+    struct timespec start;
+};
+
+struct factoryStats {
+    unsigned long produced; // moduli constructed so far
+    unsigned long consumed; // moduli popped so far
+    double refillRate; // moduli constructed per second
+    size_t depth; // moduli ready in the queue
+};
+
+// start nWorkers threads keeping up to capacity moduli ready
+// capacity is rounded up to a power of 2
+int startFactory(struct modulusFactory* factory, const enum modulusType type, const unsigned long N, const unsigned long secpar,
+		 const int nprimes, const size_t capacity, const int nWorkers);
+
+// stops the workers and frees all moduli; moduli still held by consumers become invalid
+void stopFactory(struct modulusFactory* factory);
+
+// returns a constructed modulus or NULL if none is ready
+struct modulus* popModulus(struct modulusFactory* factory);
+
+// like popModulus but waits until a modulus is ready
+struct modulus* waitModulus(struct modulusFactory* factory);
+
+// gives back a modulus obtained from popModulus/waitModulus
+void recycleModulus(struct modulusFactory* factory, struct modulus* mod);
+
+void getFactoryStats(struct modulusFactory* factory, struct factoryStats* stats);
+
+#endif
@@ -2,46 +2,303 @@
 
 #include <openssl/evp.h>
 #include <assert.h>
+#include <openssl/opensslv.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h> // memcpy
 
 static EVP_MD* sha256 = NULL;
-static EVP_MD_CTX* ctx = NULL;
+static EVP_MD* shake256 = NULL;
 
-int initialiseHashing() {
-    ctx = EVP_MD_CTX_new();
-    if (ctx == NULL){ // failed
-	fprintf(stderr, "SHA3-256 context creation failed\n");
-	return -1;
-    }
+// bytes squeezed at once for hashToGroup without EVP_DigestSqueeze, in elements of the size of M
+#define HASH_TO_GROUP_BATCH 4
 
+int initialiseHashing() {
     sha256 = EVP_MD_fetch(NULL, "SHA3-256", NULL); // fetch any implementation for the default library context
     if (sha256 == NULL) { // something failed
 	fprintf(stderr, "SHA3-256 fetch failed\n");
 	return -1; // exit
     }
 
+    shake256 = EVP_MD_fetch(NULL, "SHAKE256", NULL);
+    if (shake256 == NULL) {
+	fprintf(stderr, "SHAKE256 fetch failed\n");
+	return -1;
+    }
+
     return 0;
 }
 
 void cleanHashing() {
     if (sha256) EVP_MD_free(sha256);
-    if (ctx)EVP_MD_CTX_free(ctx);
+    if (shake256) EVP_MD_free(shake256);
     sha256 = NULL;
-    ctx = NULL;
+    shake256 = NULL;
 }
 
 size_t hash(uint8_t* digest, const mpz_t input){
     unsigned int digestLength;
 
-    if (digest == NULL) { // allocate memory
-	digest = (uint8_t*) malloc(32*sizeof(uint8_t)); // allocate 256 bits
-	assert(digest);
+    if (digest == NULL) {
+	fprintf(stderr, "ERROR hashing without a digest\n");
+	return 0;
     }
 
     // hash mpz_size(input)*8 bytes of inputs and save them in digest
     // digestLength will be the number of bytes of the hashed value (should be 32)
-    // use sha256 with default implementation
+    // use sha256 with default implementation, EVP_Digest uses a context of its own
     EVP_Digest(mpz_limbs_read(input), mpz_size(input)*8, digest, &digestLength, sha256, NULL);
-    assert(digestLength == 32);
+    assert(digestLength == HASH_DIGEST_BYTES);
+
+    return digestLength;
+}
+
+// absorb the canonical encoding of x, width bytes little endian, straight from its limbs
+// returns 0 on success, -1 if x does not fit
+static int absorbCanonical(EVP_MD_CTX* ctx, const mpz_t x, const size_t width) {
+    static const uint8_t zeros[64] = { 0 };
+    const size_t size = mpz_size(x)*sizeof(mp_limb_t);
+    size_t bytes = size < width ? size : width;
+    bool ok = true;
+
+    if (mpz_sgn(x) < 0 || mpz_sizeinbase(x, 256) > width) return -1;
+
+    // on a little endian host the limbs are already the encoding, the bytes above width are zeros
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (size_t i = 0; ok && i < bytes; i += sizeof(mp_limb_t)) {
+	const uint64_t w = __builtin_bswap64(mpz_getlimbn(x, i/sizeof(mp_limb_t)));
+	ok = EVP_DigestUpdate(ctx, &w, bytes - i < sizeof(w) ? bytes - i : sizeof(w));
+    }
+#else
+    ok = EVP_DigestUpdate(ctx, mpz_limbs_read(x), bytes);
+#endif
+    for (; ok && bytes < width; bytes += sizeof(zeros)) {
+	ok = EVP_DigestUpdate(ctx, zeros, width - bytes < sizeof(zeros) ? width - bytes : sizeof(zeros));
+    }
+    return ok ? 0 : -1;
+}
 
+size_t hashCanonical(uint8_t* digest, const mpz_t x, const mpz_t M) {
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    unsigned int digestLength = 0;
+
+    if (digest == NULL || ctx == NULL || !EVP_DigestInit_ex(ctx, sha256, NULL)
+	|| absorbCanonical(ctx, x, (mpz_sizeinbase(M, 2) + 7)/8) != 0 || !EVP_DigestFinal_ex(ctx, digest, &digestLength)) {
+	fprintf(stderr, "ERROR hashing the canonical encoding\n");
+	digestLength = 0;
+    }
+
+    EVP_MD_CTX_free(ctx);
     return digestLength;
 }
+
+// the output of a SHAKE256 context read in pieces
+// with OpenSSL 3.3 and later the context is squeezed as we go, before that the whole output is recomputed with
+// EVP_DigestFinalXOF from a copy of the absorbed context, twice as long every time it runs out, as the
+// outputs of an XOF are prefixes of each other
+struct xofStream {
+    EVP_MD_CTX* ctx;
+#if !OPENSSL_VERSION_PREREQ(3, 3)
+    EVP_MD_CTX* absorbed;
+    uint8_t* out;
+    size_t len, pos;
+#endif
+};
+
+static int xofRead(struct xofStream* xof, uint8_t* dst, const size_t n) {
+#if OPENSSL_VERSION_PREREQ(3, 3)
+    return EVP_DigestSqueeze(xof->ctx, dst, n) == 1 ? 0 : -1;
+#else
+    if (xof->pos + n > xof->len) {
+	size_t len = xof->len ? 2*xof->len : HASH_TO_GROUP_BATCH*n;
+	uint8_t* out;
+
+	if (len < xof->pos + n) len = xof->pos + n;
+	out = realloc(xof->out, len);
+	if (!out) return -1;
+	xof->out = out;
+	if (!EVP_MD_CTX_copy_ex(xof->ctx, xof->absorbed) || !EVP_DigestFinalXOF(xof->ctx, xof->out, len)) return -1;
+	xof->len = len;
+    }
+    memcpy(dst, xof->out + xof->pos, n);
+    xof->pos += n;
+    return 0;
+#endif
+}
+
+int hashToGroup(mpz_t r, const mpz_t x, const struct modulus* mod) {
+    const size_t N = mpz_sizeinbase(mod->q, 2);
+    const size_t nbytes = (N+7)/8;
+    const mp_size_t nLimbs = mpz_size(mod->q);
+    const bool m2k = mod->type == MODULUS_M_POWER;
+    struct xofStream xof;
+    EVP_MD_CTX* absorbed = EVP_MD_CTX_new();
+    uint8_t* rp;
+    bool ok = false;
+    int err = -1;
+
+    memset(&xof, 0, sizeof(xof));
+    if (!absorbed || !EVP_DigestInit_ex(absorbed, shake256, NULL) || absorbCanonical(absorbed, x, nbytes) != 0) {
+	fprintf(stderr, "ERROR absorbing the element to hash to the group\n");
+	goto free;
+    }
+#if OPENSSL_VERSION_PREREQ(3, 3)
+    xof.ctx = absorbed;
+    absorbed = NULL;
+#else
+    xof.absorbed = absorbed;
+    absorbed = NULL;
+    if (!(xof.ctx = EVP_MD_CTX_new())) goto free;
+#endif
+
+    do {
+	rp = (uint8_t*) mpz_limbs_write(r, nLimbs);
+	memset(rp + nbytes, 0, nLimbs*sizeof(mp_limb_t) - nbytes);
+	if (xofRead(&xof, rp, nbytes) != 0) {
+	    fprintf(stderr, "ERROR squeezing the hash to the group\n");
+	    goto free;
+	}
+	rp[nbytes-1] &= 0xff >> (nbytes*8 - N);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (mp_size_t i = 0; i < nLimbs; ++i) ((mp_limb_t*) rp)[i] = __builtin_bswap64(((mp_limb_t*) rp)[i]);
+#endif
+	mpz_limbs_finish(r, nLimbs);
+	ok = mpz_cmp(r, mod->q) < 0 && (!m2k || isUnitModulo(mod, r));
+    } while (!ok);
+    err = 0;
+
+ free:
+    EVP_MD_CTX_free(absorbed);
+    EVP_MD_CTX_free(xof.ctx);
+#if !OPENSSL_VERSION_PREREQ(3, 3)
+    EVP_MD_CTX_free(xof.absorbed);
+    free(xof.out);
+#endif
+    return err;
+}
+
+#if HASH_WAYS > 1
+
+// the lanes are loaded from the bytes of the limbs as little endian words
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "multi-buffer hashing needs a little endian machine"
+#endif
+
+// one 64-bit word of the Keccak state for each of HASH_WAYS messages, the compiler maps the operations
+// to AVX2 or AVX-512 instructions
+typedef uint64_t lanes __attribute__((vector_size(8*HASH_WAYS)));
+
+// bytes absorbed per permutation by SHA3-256, 17 words
+#define KECCAK_RATE 136
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static const uint64_t roundConstants[24] = {
+    0x0000000000000001, 0x0000000000008082, 0x800000000000808a, 0x8000000080008000,
+    0x000000000000808b, 0x0000000080000001, 0x8000000080008081, 0x8000000000008009,
+    0x000000000000008a, 0x0000000000000088, 0x0000000080008009, 0x000000008000000a,
+    0x000000008000808b, 0x800000000000008b, 0x8000000000008089, 0x8000000000008003,
+    0x8000000000008002, 0x8000000000000080, 0x000000000000800a, 0x800000008000000a,
+    0x8000000080008081, 0x8000000000008080, 0x0000000080000001, 0x8000000080008008
+};
+
+// rotations of rho along the path of pi starting at word 1
+static const int rotations[24] = { 1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 2, 14, 27, 41, 56, 8, 25, 43, 62, 18, 39, 61, 20, 44 };
+static const int piWords[24] = { 10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4, 15, 23, 19, 13, 12, 2, 20, 14, 22, 9, 6, 1 };
+
+// Keccak-f[1600] on HASH_WAYS states at once
+static void keccakF(lanes st[25]) {
+    lanes bc[5], t;
+
+    for (int r = 0; r < 24; ++r) {
+	// theta
+	for (int i = 0; i < 5; ++i) bc[i] = st[i] ^ st[i+5] ^ st[i+10] ^ st[i+15] ^ st[i+20];
+	for (int i = 0; i < 5; ++i) {
+	    t = bc[(i+4)%5] ^ ROTL(bc[(i+1)%5], 1);
+	    for (int j = 0; j < 25; j += 5) st[j+i] ^= t;
+	}
+
+	// rho and pi
+	t = st[1];
+	for (int i = 0; i < 24; ++i) {
+	    const int j = piWords[i];
+	    bc[0] = st[j];
+	    st[j] = ROTL(t, rotations[i]);
+	    t = bc[0];
+	}
+
+	// chi
+	for (int j = 0; j < 25; j += 5) {
+	    for (int i = 0; i < 5; ++i) bc[i] = st[j+i];
+	    for (int i = 0; i < 5; ++i) st[j+i] ^= ~bc[(i+1)%5] & bc[(i+2)%5];
+	}
+
+	// iota
+	st[0] ^= roundConstants[r];
+    }
+}
+
+// SHA3-256 of count <= HASH_WAYS elements, one per lane
+// all lanes are permuted as many times as the longest element needs, the digest of a shorter one is taken
+// after its last block and the permutations after that are ignored
+static void hashLanes(uint8_t* digests, mpz_t* inputs, const int count) {
+    lanes st[25];
+    size_t len[HASH_WAYS], nblocks[HASH_WAYS], maxBlocks = 0;
+    uint8_t block[KECCAK_RATE];
+    uint64_t w;
+
+    memset(st, 0, sizeof(st));
+    for (int l = 0; l < count; ++l) {
+	len[l] = mpz_size(inputs[l])*sizeof(mp_limb_t);
+	nblocks[l] = len[l]/KECCAK_RATE + 1; // the last block holds the padding
+	if (nblocks[l] > maxBlocks) maxBlocks = nblocks[l];
+    }
+
+    for (size_t b = 0; b < maxBlocks; ++b) {
+	for (int l = 0; l < count; ++l) {
+	    const uint8_t* src = (const uint8_t*) mpz_limbs_read(inputs[l]) + b*KECCAK_RATE;
+
+	    if (b >= nblocks[l]) continue;
+	    if (b == nblocks[l] - 1) { // the rest of the element with the SHA3 padding 0x06 ... 0x80
+		const size_t rest = len[l] - b*KECCAK_RATE;
+		memset(block, 0, KECCAK_RATE);
+		memcpy(block, src, rest);
+		block[rest] ^= 0x06;
+		block[KECCAK_RATE-1] ^= 0x80;
+		src = block;
+	    }
+	    for (int i = 0; i < KECCAK_RATE/8; ++i) {
+		memcpy(&w, src + 8*i, 8);
+		st[i][l] ^= w;
+	    }
+	}
+
+	keccakF(st);
+
+	for (int l = 0; l < count; ++l) {
+	    if (b != nblocks[l] - 1) continue;
+	    for (int i = 0; i < HASH_DIGEST_BYTES/8; ++i) {
+		w = st[i][l];
+		memcpy(digests + l*HASH_DIGEST_BYTES + 8*i, &w, 8);
+	    }
+	}
+    }
+}
+
+int hashBatch(uint8_t* digests, mpz_t* inputs, const size_t n) {
+    for (size_t i = 0; i < n; i += HASH_WAYS) {
+	hashLanes(digests + i*HASH_DIGEST_BYTES, inputs + i, n - i < HASH_WAYS ? n - i : HASH_WAYS);
+    }
+    return 0;
+}
+
+#else
+
+int hashBatch(uint8_t* digests, mpz_t* inputs, const size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+	if (hash(digests + i*HASH_DIGEST_BYTES, inputs[i]) != HASH_DIGEST_BYTES) return -1;
+    }
+    return 0;
+}
+
+#endif
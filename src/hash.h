@@ -2,13 +2,47 @@
 #define HASH_H
 
 #include <gmp.h>
+#include <stddef.h>
 #include <stdint.h>
 
-// hashes input and save the results inside digest
-// returns the number of bytes of digest used
-// if digest is NULL, then memory will be allocated
+#include "constructPrimes.h"
+
+// SHA3-256 of the limbs of group elements
+// hash and hashBatch keep no state besides the fetched digest, so they can be called from several threads
+// once initialiseHashing has been called
+
+#define HASH_DIGEST_BYTES 32
+
+// elements hashed at once by hashBatch, one per lane of the vector registers: 8 lanes with AVX-512,
+// 4 with AVX2 and 1 otherwise, in which case hashBatch hashes the elements one at a time with OpenSSL
+#if defined(__AVX512F__)
+#define HASH_WAYS 8
+#elif defined(__AVX2__)
+#define HASH_WAYS 4
+#else
+#define HASH_WAYS 1
+#endif
+
+// hashes input and save the results inside digest, which must hold HASH_DIGEST_BYTES bytes
+// returns the number of bytes of digest used, 0 if digest is NULL
 size_t hash(uint8_t* digest, const mpz_t input);
 
+// hashes the n elements of inputs as hash does, the digest of inputs[i] is saved at digests + i*HASH_DIGEST_BYTES
+// HASH_WAYS elements are hashed together with the Keccak-f permutations of all of them in the same registers
+// returns 0 on success
+int hashBatch(uint8_t* digests, mpz_t* inputs, const size_t n);
+
+// SHA3-256 of the canonical encoding of 0 <= x < 256^width, with width the bytes of M: width bytes little endian,
+// so the digest depends neither on the limbs allocated for x nor on the host; the limbs are hashed in place
+// returns the number of bytes of digest used, 0 if x does not fit
+size_t hashCanonical(uint8_t* digest, const mpz_t x, const mpz_t M);
+
+// r = an element of ZZ_q for q = mod->q from the SHAKE256 stream of the canonical encoding of x:
+// the bytes of q are squeezed into the limbs of r and its bits above those of q cleared until r < q and,
+// for m2^k moduli, r is a unit, as the cycle walking of streamCipher
+// returns 0 on success
+int hashToGroup(mpz_t r, const mpz_t x, const struct modulus* mod);
+
 int initialiseHashing();
 
 void cleanHashing();
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h> // convert strings to int/longs
 #include <string.h> // to parse strings
+#include <unistd.h> // to count the cores
 
 
 #include "constructPrimes.h"
@@ -15,6 +16,7 @@
 #include "hash.h"
 
 #define DEFAULTITERS 100
+#define DEFAULTWORKERS 1
 #define STRINGIFY(x) STRINGIFY2(x) // we need all this bloatware to make it work
 #define STRINGIFY2(x) #x
 #define BOOLSTR(bool) bool ? "yes" : "no"
@@ -31,8 +33,16 @@ static struct argp_option options[] = {
     { "securityParam", 's', "secpar", 0, "If non-zero, this specifies the bit-size of the based used for moduli using prime powers or product of primes powers" },
     { "numberPrimes", 'k', "nprimes", 0, "If non-zero, this specifies the number of primes to use for m2^k moduli" },
     { "primesize", 'p', "pSize", 0, "Specify the (approximate) size in bits for the modolus to use (default: test all valid sizes)" },
-    { 0, 0, 0, 0, "Select one or more of the following 5 if you don't want to test all methods:", 1}, // this is a header for the next group
+    { "workers", 'w', "nWorkers", 0, "Number of threads constructing moduli in the background for the encryption tests, 0 constructs them synchronously (default: " STRINGIFY(DEFAULTWORKERS) ")" },
+    { "batch", -3, "size", 0, "When testing cubing, also cube and take cube roots of batches of this many messages at once" },
+    { "modulus", -4, "safe|power|mpower|rsa", 0, "Modulus for the cubing and hashing tests: a safe prime, a prime power (needs -s), m2^k (needs -k) or a product of two safe primes (default: mpower with -k, power with -s, safe otherwise)" },
+    { "threads", -5, "nThreads", 0, "When testing cubing, also time squaring chains with every squaring split across this many threads; when testing encryption, also split the CTR keystream across them" },
+    { "jobs", -6, "FILE|count", 0, "Also solve the jobs of FILE, or count random jobs per modulus size, on a work-stealing pool of threads" },
+    { "poolThreads", -7, "nThreads", 0, "Number of threads of the work-stealing pool solving the --jobs (default: one per core)" },
+    { "primesource", -2, "db|mr", 0, "Take the 32-bit primes of m2^k moduli from the prime database (db) or from random candidates tested with Miller-Rabin (mr) (default: db)" },
+    { 0, 0, 0, 0, "Select one or more of the following if you don't want to test all methods:", 1}, // this is a header for the next group
     { "cubing", 'c', 0, 0, "Test the cubing/cube root performance"},
+    { "proofs", 'v', 0, 0, "Test the Wesolowski proofs of squaring chains and their verification"},
     { "encryption", 'e', 0, 0, "Test the stream cipher encryption performance"},
     { "hashing", 'x', 0, 0, "Test the hashing performance"},
     { "moduli", 'm', 0, 0, "Test the performance of prime power modulo creations" },
@@ -48,7 +58,17 @@ struct input {
     unsigned long pSize;
     unsigned int nprimes;
     unsigned long secpar;
+    int nWorkers;
+    int batch;
+    int nThreads;
+    int poolThreads;
+    char* jobFile;
+    long njobs;
+    enum primeSource primeSource;
+    enum modulusType modulus;
+    bool modulusSet;
     bool cubing;
+    bool proofs;
     bool enc;
     bool hashing;
     bool moduli;
@@ -93,6 +113,75 @@ error_t parser_fun(int key, char *arg, struct argp_state *state) {
 	input->pSize = strtoul(arg, (char**) NULL, 10);
 	break;
     }
+    case 'w': { // handle number of factory workers
+	if (arg == 0) { // no value is given
+	    argp_error(state, "If --workers is specified, then a number must follow");
+	    return EINVAL;
+	}
+	input->nWorkers = strtol(arg, (char**) NULL, 10);
+	if (input->nWorkers < 0) {
+	    argp_error(state, "--workers cannot be negative");
+	    return EINVAL;
+	}
+	break;
+    }
+    case -3: { // handle batch size
+	input->batch = strtol(arg, (char**) NULL, 10);
+	if (input->batch < 0) {
+	    argp_error(state, "--batch cannot be negative");
+	    return EINVAL;
+	}
+	break;
+    }
+    case -5: { // handle threads of the parallel squaring
+	input->nThreads = strtol(arg, (char**) NULL, 10);
+	if (input->nThreads < 0) {
+	    argp_error(state, "--threads cannot be negative");
+	    return EINVAL;
+	}
+	break;
+    }
+    case -7: { // handle threads of the job pool
+	input->poolThreads = strtol(arg, (char**) NULL, 10);
+	if (input->poolThreads < 0) {
+	    argp_error(state, "--poolThreads cannot be negative");
+	    return EINVAL;
+	}
+	break;
+    }
+    case -6: { // handle jobs for the scheduler
+	char* end;
+	input->njobs = strtol(arg, &end, 10);
+	if (*end != '\0') { // not a number, so a job file
+	    input->njobs = 0;
+	    input->jobFile = arg;
+	} else if (input->njobs <= 0) {
+	    argp_error(state, "--jobs must be a file or a positive number");
+	    return EINVAL;
+	}
+	break;
+    }
+    case -4: { // handle type of modulus
+	if (strcmp(arg, "safe") == 0) input->modulus = MODULUS_SAFE_PRIME;
+	else if (strcmp(arg, "power") == 0) input->modulus = MODULUS_PRIME_POWER;
+	else if (strcmp(arg, "mpower") == 0) input->modulus = MODULUS_M_POWER;
+	else if (strcmp(arg, "rsa") == 0) input->modulus = MODULUS_RSA;
+	else {
+	    argp_error(state, "--modulus must be one of safe, power, mpower or rsa");
+	    return EINVAL;
+	}
+	input->modulusSet = true;
+	break;
+    }
+    case -2: { // handle source of 32-bit primes
+	if (strcmp(arg, "db") == 0) input->primeSource = PRIMES_FROM_DB;
+	else if (strcmp(arg, "mr") == 0) input->primeSource = PRIMES_FROM_MR;
+	else {
+	    argp_error(state, "--primesource must be either db or mr");
+	    return EINVAL;
+	}
+	break;
+    }
     case 'm': { // handle test of moduli
 	input->moduli = true;
 	break;
@@ -101,6 +190,10 @@ error_t parser_fun(int key, char *arg, struct argp_state *state) {
 	input->cubing = true;
 	break;
     }
+    case 'v': { // handle proofs
+	input->proofs = true;
+	break;
+    }
     case 'e': { // handle encryption
 	input->enc = true;
 	break;
@@ -125,9 +218,22 @@ error_t parser_fun(int key, char *arg, struct argp_state *state) {
 	    argp_error(state, "No output file specified");
 	    return EINVAL;
 	}
-	if (!(input->cubing || input->enc || input->moduli || input->hashing)) { // no specific test set
+	if (!input->modulusSet) { // the modulus follows -k and -s
+	    if (input->nprimes) input->modulus = MODULUS_M_POWER;
+	    else if (input->secpar) input->modulus = MODULUS_PRIME_POWER;
+	    else input->modulus = MODULUS_SAFE_PRIME;
+	}
+	if (input->modulus == MODULUS_M_POWER && input->nprimes == 0) {
+	    argp_error(state, "--modulus=mpower needs --numberPrimes");
+	    return EINVAL;
+	}
+	if (input->modulus == MODULUS_PRIME_POWER && input->secpar == 0) {
+	    argp_error(state, "--modulus=power needs --securityParam");
+	    return EINVAL;
+	}
+	if (!(input->cubing || input->proofs || input->enc || input->moduli || input->hashing)) { // no specific test set
 	    // set all tests to true
-	    input->cubing = input->enc = input->moduli = input->hashing = true;
+	    input->cubing = input->proofs = input->enc = input->moduli = input->hashing = true;
 	}
     }
     default:
@@ -142,7 +248,7 @@ static struct argp argp_struct = { options, parser_fun, args_doc , doc };
 void printReceivedInput(struct input input) {
     printf("Output test results to file: %s\n", input.filename);
     printf("Testing %lu iterations of:\n", input.nIters);
-    printf("modulo: %s\ncubing: %s\nstream encryption: %s\nhashing: %s\n", BOOLSTR(input.moduli), BOOLSTR(input.cubing), BOOLSTR(input.enc), BOOLSTR(input.hashing));
+    printf("modulo: %s\ncubing: %s\nproofs: %s\nstream encryption: %s\nhashing: %s\n", BOOLSTR(input.moduli), BOOLSTR(input.cubing), BOOLSTR(input.proofs), BOOLSTR(input.enc), BOOLSTR(input.hashing));
 
     printf("Prime sizes selected: ");
     if (input.pSize) printf("%lu\n", input.pSize);
@@ -150,12 +256,19 @@ void printReceivedInput(struct input input) {
 	for (int i=0; i < numAvailablePrimes; ++i) printf("%lu ", availablePrimeSizes[i]);
 	printf("\n");
     }
-    if (input.nprimes)
-	printf("Using product of prime powers with %lu 32-bit primes\n", input.nprimes);
-    else if (input.secpar)
+    switch (input.modulus) {
+    case MODULUS_M_POWER:
+	printf("Using product of prime powers with %u 32-bit primes from %s\n", input.nprimes, input.primeSource == PRIMES_FROM_MR ? "Miller-Rabin" : "the database");
+	break;
+    case MODULUS_PRIME_POWER:
 	printf("Using prime powers with security parameter %lu\n", input.secpar);
-    else
+	break;
+    case MODULUS_RSA:
+	printf("Using products of two safe primes\n");
+	break;
+    default:
 	printf("Using safe primes\n");
+    }
 }
 
 // ENTRYPOINT
@@ -164,7 +277,7 @@ int main(int argc, char **argv) {
     assert(GMP_NUMB_BITS == 64);
 
     // create object to encapsulate all inputs
-    struct input input = { .nIters = DEFAULTITERS };  // we give a default value of 30 to nIters; everything else deafaults to 0 (NULL, false)
+    struct input input = { .nIters = DEFAULTITERS, .nWorkers = DEFAULTWORKERS };  // we give a default value of 30 to nIters; everything else deafaults to 0 (NULL, false)
 
     error_t errorcode = argp_parse(&argp_struct, argc, argv, 0, NULL, &input); // first 0 are the optional flags. the NULL is for unparsed argumets
 
@@ -188,6 +301,10 @@ int main(int argc, char **argv) {
     // tell use what we are going to do
     printReceivedInput(input);
 
+    setPrimeSource(input.primeSource);
+
+    const int nJobThreads = input.poolThreads > 0 ? input.poolThreads : sysconf(_SC_NPROCESSORS_ONLN);
+
     // OPEN OUTPUT FILE
     FILE* fileptr = NULL;
     if (strcmp(input.filename, "stdout") == 0) fileptr=stdout;
@@ -205,14 +322,20 @@ int main(int argc, char **argv) {
     fflush(fileptr);
 
     // ACTUALLY DO THE TESTS
-    mpz_t q, b;
+    struct modulus mod; // q and b, with the factorization for the trapdoor
     unsigned long N; // bitsize of q
 
-    mpz_inits(q, b, NULL);
+    initModulus(&mod);
 
     // initialise xorshf64
     //    setSeed(rand());
 
+    if (input.jobFile) { // the jobs have their own moduli
+	testTimesJobs(input.jobFile, 0, 0, nJobThreads, fileptr);
+	fflush(fileptr);
+	printf("Tested the jobs of %s\n", input.jobFile);
+    }
+
     for(unsigned long i=0; i < nPrimes; ++i) {
 
 	if (input.moduli){
@@ -222,34 +345,51 @@ int main(int argc, char **argv) {
 	}
 
 	// compute modulo and exponent for the cubing
-	if (input.nprimes)
-	    constructmPower(q, b, input.nprimes, primeSizes[i]);
-	else if (input.secpar)
-	    constructPrimePower(q, b, input.secpar, primeSizes[i]);
-	else constructSafePrime(q, b, primeSizes[i]);
+	if (constructModulus(&mod, input.modulus, primeSizes[i], input.secpar, input.nprimes) != 0) {
+	    fprintf(fileptr, "Failed to construct a modulus of size %lu\n", primeSizes[i]);
+	    continue;
+	}
 
-	N = mpz_sizeinbase(q, 2);
+	N = mpz_sizeinbase(mod.q, 2);
 	printf("Using a prime with exactly %lu bits\n", N);
 
 
 	if (input.cubing) { // test repeated squarings
-	    testTimesSq(q, b, N, input.nIters, fileptr);
+	    testTimesSq(&mod, input.nThreads, input.nIters, fileptr);
 	    fflush(fileptr);
 	    printf("Tested cubing\n");
+
+	    if (input.batch) {
+		testTimesBatch(mod.q, mod.b, N, input.batch, input.nIters, fileptr);
+		fflush(fileptr);
+		printf("Tested batch cubing\n");
+	    }
+	}
+
+	if (input.njobs) { // solve random puzzles on all cores
+	    testTimesJobs(NULL, input.njobs, primeSizes[i], nJobThreads, fileptr);
+	    fflush(fileptr);
+	    printf("Tested %ld jobs\n", input.njobs);
+	}
+
+	if (input.proofs) { // test proofs of the squaring chain
+	    testTimesProof(mod.q, mod.b, input.nIters, fileptr);
+	    fflush(fileptr);
+	    printf("Tested proofs\n");
 	}
 
-	if (input.enc) { // test AES256-OFB ecnryptions
+	if (input.enc) { // test AES256-OFB and AES256-CTR ecnryptions
 	    if (!(input.secpar || input.nprimes)) {
 		fprintf(stderr, "Cannot test encryption without an modulo that can be generated quickly\n");
 	    } else {
-		testTimesEnc(primeSizes[i], input.nprimes, input.secpar, input.nIters, fileptr);
+		testTimesEnc(primeSizes[i], input.nprimes, input.secpar, input.nWorkers, input.nThreads, input.nIters, fileptr);
 		fflush(fileptr);
-		printf("Tested AES256-OFB encryption\n");
+		printf("Tested AES256-OFB and AES256-CTR encryption\n");
 	    }
 	}
 
 	if (input.hashing) {
-	    testTimesHash(q, input.nIters, fileptr);
+	    testTimesHash(&mod, input.nIters, fileptr);
 	    fflush(fileptr);
 	    printf("Testing hahsing\n");
 	}
@@ -260,7 +400,7 @@ int main(int argc, char **argv) {
     for(int i=0; i<50; ++i) fprintf(fileptr, "=");
     fclose(fileptr);
 
-    mpz_clears(q, b, NULL);
+    clearModulus(&mod);
     cleanOpenSSL();
     cleanHashing();
     clearRandomness();
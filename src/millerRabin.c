@@ -0,0 +1,148 @@
+#include "millerRabin.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rand.h"
+#include "simd.h"
+
+// We test MR_LANES candidates at once with Montgomery arithmetic modulo n < 2^32 and R = 2^32.
+// Every lane holds a value below 2^33 in a 64-bit word and all products are 32x32 bits,
+// so a Montgomery multiplication is three vpmuludq on AVX2 / AVX-512.
+// Everything is branch-free so that all lanes follow the same path.
+
+#define NVEC (MR_LANES/VLANES)
+#define LOOP_VEC for (int v = 0; v < NVEC; ++v)
+
+// a*b/R mod n, with a,b < n
+// ninv = -n^{-1} mod R
+static inline vec_t montMul32(const vec_t a, const vec_t b, const vec_t n, const vec_t ninv) {
+    const vec_t t = vmul32(a, b);
+    const vec_t m = vmul32(t, ninv); // only the low 32 bits matter
+    const vec_t mn = vmul32(m, n);
+    // t + mn = 0 mod R, so the low halves generate a carry iff the low half of t is non-zero
+    const vec_t carry = vandnot(veq(vand(t, vset1(0xffffffffu)), vset1(0)), vset1(1));
+    const vec_t u = vadd(vadd(vshr(t, 32), vshr(mn, 32)), carry); // u < 2n
+    return vsub(u, vandnot(vgt(n, u), n)); // subtract n unless n > u
+}
+
+// checks the base a for all lanes and clears isPrime on the lanes where a is a witness of compositeness
+static void mrRound(const uint32_t a, const vec_t* n, const vec_t* ninv, const vec_t* r2,
+		    const vec_t* d, const vec_t* s, vec_t* isPrime) {
+    vec_t one[NVEC], minusOne[NVEC], base[NVEC], x[NVEC], y, bit, active, done[NVEC], ok[NVEC];
+
+    LOOP_VEC {
+	one[v] = vsub(vset1(1ull << 32), n[v]); // R mod n, as n > 2^31
+	minusOne[v] = vsub(n[v], one[v]);
+	base[v] = montMul32(vset1(a), r2[v], n[v], ninv[v]); // a R mod n
+	x[v] = one[v];
+    }
+
+    // x = a^d with left-to-right binary exponentiation
+    for (int i = 31; i >= 0; --i) {
+	LOOP_VEC {
+	    x[v] = montMul32(x[v], x[v], n[v], ninv[v]);
+	    y = montMul32(x[v], base[v], n[v], ninv[v]);
+	    bit = veq(vand(vshr(d[v], i), vset1(1)), vset1(1));
+	    x[v] = vselect(bit, y, x[v]);
+	}
+    }
+
+    LOOP_VEC {
+	ok[v] = vor(veq(x[v], one[v]), veq(x[v], minusOne[v]));
+	done[v] = ok[v];
+    }
+
+    // square up to s-1 times looking for -1
+    for (uint32_t j = 1; j < 32; ++j) {
+	LOOP_VEC {
+	    x[v] = montMul32(x[v], x[v], n[v], ninv[v]);
+	    active = vandnot(done[v], vgt(s[v], vset1(j)));
+	    ok[v] = vor(ok[v], vand(active, veq(x[v], minusOne[v])));
+	    done[v] = vor(done[v], vand(active, vor(veq(x[v], minusOne[v]), veq(x[v], one[v])))); // reaching 1 first means composite
+	}
+    }
+
+    LOOP_VEC isPrime[v] = vand(isPrime[v], ok[v]);
+}
+
+// test exactly MR_LANES candidates with the given bases
+static void millerRabinLanes(const uint32_t* candidates, bool* isPrime, const uint32_t* bases, const int nbases) {
+    uint32_t ninv[MR_LANES], r2[MR_LANES], d[MR_LANES], s[MR_LANES];
+    vec_t vn[NVEC], vninv[NVEC], vr2[NVEC], vd[NVEC], vs[NVEC], res[NVEC];
+
+    for (int l = 0; l < MR_LANES; ++l) {
+	const uint32_t n = candidates[l];
+
+	// Newton iteration for n^{-1} mod 2^32: each step doubles the correct bits (n is its own inverse mod 8)
+	uint32_t inv = n;
+	for (int i = 0; i < 4; ++i) inv *= 2 - n*inv;
+	ninv[l] = -inv;
+
+	r2[l] = (uint64_t)(-n) * (-n) % n; // R^2 mod n = (R mod n)^2 mod n
+
+	s[l] = __builtin_ctz(n-1);
+	d[l] = (n-1) >> s[l];
+    }
+
+    LOOP_VEC {
+	vn[v] = vload(candidates + v*VLANES);
+	vninv[v] = vload(ninv + v*VLANES);
+	vr2[v] = vload(r2 + v*VLANES);
+	vd[v] = vload(d + v*VLANES);
+	vs[v] = vload(s + v*VLANES);
+	res[v] = vset1(-1);
+    }
+
+    for (int i = 0; i < nbases; ++i) mrRound(bases[i], vn, vninv, vr2, vd, vs, res);
+
+    LOOP_VEC for (int l = 0; l < VLANES; ++l) isPrime[v*VLANES + l] = vtest(res[v], l);
+}
+
+static const uint32_t allBases[3] = {2, 7, 61};
+
+// cheap filter before Miller-Rabin: candidates are already 5 mod 6
+static inline bool noSmallFactor(const uint32_t n) {
+    return n%5 && n%7 && n%11 && n%13 && n%17 && n%19 && n%23 && n%29 && n%31 && n%37 && n%41 && n%43 && n%47
+	&& n%53 && n%59 && n%61 && n%67 && n%71 && n%73 && n%79 && n%83 && n%89 && n%97;
+}
+
+// almost all composites are caught by the base 2, so only the candidates surviving it are tested with 7 and 61
+int sample32bprimes(uint32_t* primes, const int numprimes) {
+    uint32_t candidates[MR_LANES], strong[2*MR_LANES];
+    bool isPrime[MR_LANES];
+    int found = 0, nc, ns = 0, nt;
+    uint64_t r;
+
+    while (found < numprimes) {
+	// fill a batch with random candidates in (2^31, 2^32) which are 5 mod 6 (i.e. odd and 2 mod 3)
+	nc = 0;
+	while (nc < MR_LANES) {
+	    r = xorshf64();
+	    for (int half = 0; half < 2 && nc < MR_LANES; ++half, r >>= 32) {
+		uint32_t c = (uint32_t)r | (1u<<31);
+		c = c - c%6 + 5;
+		if (c < (1u<<31)) continue; // wrapped around 2^32
+		if (noSmallFactor(c)) candidates[nc++] = c;
+	    }
+	}
+
+	millerRabinLanes(candidates, isPrime, allBases, 1);
+	for (int l = 0; l < MR_LANES; ++l) if (isPrime[l]) strong[ns++] = candidates[l];
+
+	// wait for a full batch, unless we already have enough survivors
+	if (ns < MR_LANES && ns < numprimes - found) continue;
+	nt = ns < MR_LANES ? ns : MR_LANES;
+	for (int l = nt; l < MR_LANES; ++l) strong[l] = strong[0]; // padding
+
+	millerRabinLanes(strong, isPrime, allBases+1, 2);
+
+	for (int l = 0; l < nt && found < numprimes; ++l) if (isPrime[l]) primes[found++] = strong[l];
+
+	// keep the survivors we did not test yet
+	ns -= nt;
+	memmove(strong, strong+nt, ns*sizeof(*strong));
+    }
+
+    return 0;
+}
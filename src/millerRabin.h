@@ -0,0 +1,14 @@
+#ifndef MILLER_RABIN_H
+#define MILLER_RABIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// number of candidates tested together with deterministic Miller-Rabin, bases 2, 7 and 61 (exact for n < 4759123141)
+#define MR_LANES 16
+
+// fills primes with numprimes random primes in (2^31, 2^32) which are 2 mod 3 (not necessarily distinct)
+// this does not need the prime database
+int sample32bprimes(uint32_t* primes, const int numprimes);
+
+#endif
@@ -0,0 +1,218 @@
+#include "montgomery.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// limbs rounded up to a multiple of a cache line
+#define ALIGNED_LIMBS(n) (((n) + 7) & ~(mp_size_t)7)
+
+int montInit(struct montCtx* ctx, const mpz_t m) {
+    const mp_size_t n = mpz_size(m);
+    mp_size_t mipSize, offset;
+    mp_limb_t* tp;
+    mpz_t t;
+
+    if (mpz_even_p(m) || mpz_cmp_ui(m, 3) < 0) return 1;
+
+    ctx->n = n;
+    if (n < MONT_REDC_1_TO_REDC_2_THRESHOLD) ctx->kernel = MONT_REDC_1;
+    else if (n < MONT_REDC_2_TO_REDC_N_THRESHOLD) ctx->kernel = MONT_REDC_2;
+    else ctx->kernel = MONT_REDC_N;
+    mipSize = ctx->kernel == MONT_REDC_N ? n : 2;
+
+    // mp | mip | one | r2 | xp | yp | tp (2n)
+    offset = 5*ALIGNED_LIMBS(n) + ALIGNED_LIMBS(mipSize);
+    ctx->memory = aligned_alloc(64, (offset + ALIGNED_LIMBS(2*n))*sizeof(mp_limb_t));
+    if (!ctx->memory) return 1;
+
+    ctx->mp = (mp_limb_t*) ctx->memory;
+    ctx->mip = ctx->mp + ALIGNED_LIMBS(n);
+    ctx->one = ctx->mip + ALIGNED_LIMBS(mipSize);
+    ctx->r2 = ctx->one + ALIGNED_LIMBS(n);
+    ctx->xp = ctx->r2 + ALIGNED_LIMBS(n);
+    ctx->yp = ctx->xp + ALIGNED_LIMBS(n);
+    ctx->tp = ctx->yp + ALIGNED_LIMBS(n);
+    ctx->table = NULL;
+    ctx->tableSize = 0;
+
+    mpn_copyi(ctx->mp, mpz_limbs_read(m), n);
+
+    // the inverse is computed once here rather than on every exponentiation
+    tp = malloc(mpn_binvert_itch(n)*sizeof(mp_limb_t));
+    if (!tp) {
+	free(ctx->memory);
+	return 1;
+    }
+    mpn_binvert(ctx->mip, ctx->mp, ctx->kernel == MONT_REDC_1 ? 1 : mipSize, tp);
+    free(tp);
+    if (ctx->kernel == MONT_REDC_1) ctx->mip[0] = -ctx->mip[0];
+    else if (ctx->kernel == MONT_REDC_2) {
+	ctx->mip[0] = -ctx->mip[0];
+	ctx->mip[1] = ~ctx->mip[1];
+    }
+
+    // R mod m and R^2 mod m
+    mpz_init(t);
+    mpz_setbit(t, 64*n);
+    mpz_mod(t, t, m);
+    mpn_zero(ctx->one, n);
+    mpn_copyi(ctx->one, mpz_limbs_read(t), mpz_size(t));
+    mpz_mul(t, t, t);
+    mpz_mod(t, t, m);
+    mpn_zero(ctx->r2, n);
+    mpn_copyi(ctx->r2, mpz_limbs_read(t), mpz_size(t));
+    mpz_clear(t);
+
+    return 0;
+}
+
+void montClear(struct montCtx* ctx) {
+    free(ctx->memory);
+    free(ctx->table);
+    ctx->memory = NULL;
+    ctx->table = NULL;
+    ctx->tableSize = 0;
+}
+
+// rp = up / R mod m, with up of 2n limbs (destroyed)
+static inline void montReduce(struct montCtx* ctx, mp_ptr rp, mp_ptr up) {
+    switch (ctx->kernel) {
+    case MONT_REDC_1:
+	if (mpn_redc_1(rp, up, ctx->mp, ctx->n, ctx->mip[0])) mpn_sub_n(rp, rp, ctx->mp, ctx->n);
+	break;
+    case MONT_REDC_2:
+	if (mpn_redc_2(rp, up, ctx->mp, ctx->n, ctx->mip)) mpn_sub_n(rp, rp, ctx->mp, ctx->n);
+	break;
+    default:
+	mpn_redc_n(rp, up, ctx->mp, ctx->n, ctx->mip);
+    }
+}
+
+void montMul(struct montCtx* ctx, mp_ptr rp, mp_srcptr ap, mp_srcptr bp) {
+    mpn_mul_n(ctx->tp, ap, bp, ctx->n);
+    montReduce(ctx, rp, ctx->tp);
+}
+
+void montSqr(struct montCtx* ctx, mp_ptr rp, mp_srcptr ap) {
+    mpn_sqr(ctx->tp, ap, ctx->n);
+    montReduce(ctx, rp, ctx->tp);
+}
+
+void montCube(struct montCtx* ctx, mp_ptr rp, mp_srcptr ap) {
+    mp_limb_t* const yp = ctx->yp; // the square cannot overwrite ap, as rp may be ap
+
+    mpn_sqr(ctx->tp, ap, ctx->n);
+    montReduce(ctx, yp, ctx->tp);
+    mpn_mul_n(ctx->tp, yp, ap, ctx->n);
+    montReduce(ctx, rp, ctx->tp);
+}
+
+// rp = a mod m as n limbs
+static void montLoad(struct montCtx* ctx, mp_ptr rp, const mpz_t a) {
+    const mp_size_t n = ctx->n;
+    mpz_t t, m;
+
+    mpn_zero(rp, n);
+    if ((mp_size_t) mpz_size(a) > n) { // this is rare, so we don't mind the allocation
+	mpz_init(t);
+	mpz_mod(t, a, mpz_roinit_n(m, ctx->mp, n));
+	mpn_copyi(rp, mpz_limbs_read(t), mpz_size(t));
+	mpz_clear(t);
+    } else mpn_copyi(rp, mpz_limbs_read(a), mpz_size(a));
+}
+
+void montToMont(struct montCtx* ctx, mp_ptr rp, const mpz_t a) {
+    montLoad(ctx, rp, a);
+    montMul(ctx, rp, rp, ctx->r2);
+}
+
+void montFromMont(struct montCtx* ctx, mpz_t r, mp_srcptr ap) {
+    const mp_size_t n = ctx->n;
+    mp_limb_t* rp;
+
+    mpn_copyi(ctx->tp, ap, n);
+    mpn_zero(ctx->tp + n, n);
+
+    rp = mpz_limbs_write(r, n);
+    montReduce(ctx, rp, ctx->tp);
+    if (mpn_cmp(rp, ctx->mp, n) >= 0) mpn_sub_n(rp, rp, ctx->mp, n);
+    mpz_limbs_finish(r, n);
+}
+
+// the reduction is chosen once outside the loop, so the loop body is only a squaring and a REDC
+#define SQR_LOOP(reduce) for (; nsq; --nsq) { mpn_sqr(tp, xp, n); reduce; }
+
+void montSqrChain(struct montCtx* ctx, mpz_t r, const mpz_t b, mp_bitcnt_t nsq) {
+    const mp_size_t n = ctx->n;
+    mp_limb_t* const xp = ctx->xp;
+    mp_limb_t* const tp = ctx->tp;
+    const mp_limb_t* const mp = ctx->mp;
+    const mp_limb_t* const mip = ctx->mip;
+
+    montToMont(ctx, xp, b);
+
+    switch (ctx->kernel) {
+    case MONT_REDC_1:
+	SQR_LOOP(if (mpn_redc_1(xp, tp, mp, n, mip[0])) mpn_sub_n(xp, xp, mp, n));
+	break;
+    case MONT_REDC_2:
+	SQR_LOOP(if (mpn_redc_2(xp, tp, mp, n, mip)) mpn_sub_n(xp, xp, mp, n));
+	break;
+    default:
+	SQR_LOOP(mpn_redc_n(xp, tp, mp, n, mip));
+    }
+
+    montFromMont(ctx, r, xp);
+}
+
+void montPowmPlan(struct montCtx* ctx, mpz_t r, const mpz_t b, const struct expPlan* plan) {
+    const mp_size_t n = ctx->n;
+    const int nentries = plan->nentries;
+    mp_limb_t* const xp = ctx->xp;
+    mp_limb_t *table, *b2;
+    mp_bitcnt_t s;
+
+    if (plan->nwindows == 0) {
+	mpz_set_ui(r, 1);
+	return;
+    }
+
+    // table[i] = b^(2i+1), followed by b^2
+    if (ctx->tableSize < nentries + 1) {
+	free(ctx->table);
+	ctx->table = malloc((nentries + 1)*n*sizeof(mp_limb_t));
+	ctx->tableSize = ctx->table ? nentries + 1 : 0;
+	if (!ctx->table) { // fall back to GMP
+	    mpz_t m;
+	    mpz_powm(r, b, plan->e, mpz_roinit_n(m, ctx->mp, n));
+	    return;
+	}
+    }
+    table = ctx->table;
+    b2 = table + nentries*n;
+
+    montToMont(ctx, table, b);
+    montSqr(ctx, b2, table);
+    for (long i = 1; i < nentries; ++i) montMul(ctx, table + i*n, table + (i-1)*n, b2);
+
+    mpn_copyi(xp, table + plan->idx[0]*n, n);
+    for (long i = 1; i < plan->nwindows; ++i) {
+	for (s = plan->nsq[i]; s; --s) montSqr(ctx, xp, xp);
+	montMul(ctx, xp, xp, table + plan->idx[i]*n);
+    }
+    for (s = plan->tail; s; --s) montSqr(ctx, xp, xp);
+
+    montFromMont(ctx, r, xp);
+}
+
+void montPowm(struct montCtx* ctx, mpz_t r, const mpz_t b, const mpz_t e) {
+    struct expPlan plan;
+
+    if (expPlanInit(&plan, e) != 0) { // fall back to GMP
+	mpz_t m;
+	mpz_powm(r, b, e, mpz_roinit_n(m, ctx->mp, ctx->n));
+	return;
+    }
+    montPowmPlan(ctx, r, b, &plan);
+    expPlanClear(&plan);
+}
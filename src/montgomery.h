@@ -0,0 +1,74 @@
+#ifndef MONTGOMERY_H
+#define MONTGOMERY_H
+
+#include <gmp.h>
+
+#include "expPlan.h"
+
+// Montgomery arithmetic modulo an odd m of n limbs, with R = 2^(64n).
+// A context caches everything that depends only on the modulus (the inverse of m, the choice of REDC,
+// R mod m, R^2 mod m and the scratch space), so it is set up once per modulus and reused by every
+// squaring chain, cube and cube root.
+// The scratch space makes a context usable by one thread at a time.
+
+// the size (in limbs) where we switch REDC variant
+// these are the values of GMP on recent x86-64 cores, they can be overridden at compile time
+#ifndef MONT_REDC_1_TO_REDC_2_THRESHOLD
+#define MONT_REDC_1_TO_REDC_2_THRESHOLD 32
+#endif
+#ifndef MONT_REDC_2_TO_REDC_N_THRESHOLD
+#define MONT_REDC_2_TO_REDC_N_THRESHOLD 60
+#endif
+
+enum montKernel {
+    MONT_REDC_1, // limb by limb
+    MONT_REDC_2, // two limbs at a time
+    MONT_REDC_N // with a full n-limb inverse and multiplications
+};
+
+struct montCtx {
+    mp_size_t n; // limbs of the modulus
+    enum montKernel kernel;
+    mp_limb_t* mp; // the modulus
+    mp_limb_t* mip; // -1/m mod 2^64 (REDC_1), -1/m mod 2^128 (REDC_2) or 1/m mod R (REDC_N)
+    mp_limb_t* one; // R mod m, i.e. 1 in Montgomery form
+    mp_limb_t* r2; // R^2 mod m, to move into Montgomery form
+    mp_limb_t* xp; // n limbs holding the running value of montSqrChain and montPowm
+    mp_limb_t* yp; // n more limbs for temporary values
+    mp_limb_t* tp; // 2n limbs of scratch space
+    mp_limb_t* table; // precomputed powers for montPowm, allocated on first use
+    int tableSize; // number of entries in table
+    void* memory; // single 64-byte aligned block holding all the above but table
+};
+
+// returns 0 on success, 1 if m is even or smaller than 3
+int montInit(struct montCtx* ctx, const mpz_t m);
+
+void montClear(struct montCtx* ctx);
+
+// rp = a R mod m, with rp of n limbs
+void montToMont(struct montCtx* ctx, mp_ptr rp, const mpz_t a);
+
+// r = a / R mod m, fully reduced
+void montFromMont(struct montCtx* ctx, mpz_t r, mp_srcptr ap);
+
+// rp = ap bp / R mod m; all operands have n limbs and may overlap
+// results are below 2^(64n) but not necessarily below m
+void montMul(struct montCtx* ctx, mp_ptr rp, mp_srcptr ap, mp_srcptr bp);
+
+void montSqr(struct montCtx* ctx, mp_ptr rp, mp_srcptr ap);
+
+// rp = ap^3 / R^2 mod m, i.e. the cube of a number in Montgomery form stays in Montgomery form
+// rp may be ap, but neither can be yp
+void montCube(struct montCtx* ctx, mp_ptr rp, mp_srcptr ap);
+
+// r = b^(2^nsq) mod m, the same as mpn_powm_2exp without its setup
+void montSqrChain(struct montCtx* ctx, mpz_t r, const mpz_t b, const mp_bitcnt_t nsq);
+
+// r = b^e mod m, with the sliding windows of plan, which can be reused for any base
+void montPowmPlan(struct montCtx* ctx, mpz_t r, const mpz_t b, const struct expPlan* plan);
+
+// r = b^e mod m, recoding e for this call only
+void montPowm(struct montCtx* ctx, mpz_t r, const mpz_t b, const mpz_t e);
+
+#endif
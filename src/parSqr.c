@@ -0,0 +1,281 @@
+#define _GNU_SOURCE // for pthread_setaffinity_np
+#include "parSqr.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// busy waits before yielding the core, in case there are more threads than cores
+#define PAR_SQR_SPINS 4096
+
+struct parWorkerArgs {
+    struct parSqr* ctx;
+    int id;
+};
+
+static inline void spinWait(int* spins) {
+    if (++*spins < PAR_SQR_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+    } else sched_yield();
+}
+
+// thread id computes the tasks id, id + nThreads, ...
+static void runTasks(struct parSqr* ctx, const int id) {
+    for (int t = id; t < ctx->ntasks; t += ctx->nThreads) {
+	const struct parTask* task = ctx->tasks + t;
+	if (task->ap == task->bp && task->an == task->bn) mpn_sqr(task->rp, task->ap, task->an);
+	else if (task->an >= task->bn) mpn_mul(task->rp, task->ap, task->an, task->bp, task->bn);
+	else mpn_mul(task->rp, task->bp, task->bn, task->ap, task->an);
+    }
+}
+
+static void* parWorker(void* arg) {
+    struct parWorkerArgs args = *(struct parWorkerArgs*) arg;
+    struct parSqr* const ctx = args.ctx;
+    unsigned long generation = 0, g;
+    int spins;
+
+    free(arg);
+
+    while (true) {
+	spins = 0;
+	while ((g = atomic_load_explicit(&ctx->generation, memory_order_acquire)) == generation) spinWait(&spins);
+	generation = g;
+	if (atomic_load(&ctx->stop)) break;
+
+	runTasks(ctx, args.id);
+	atomic_fetch_add_explicit(&ctx->done, 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+// run the tasks on all threads and wait for all of them
+static void runStep(struct parSqr* ctx) {
+    int spins = 0;
+
+    atomic_store_explicit(&ctx->done, 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ctx->generation, 1, memory_order_release);
+    runTasks(ctx, 0);
+    while (atomic_load_explicit(&ctx->done, memory_order_acquire) < ctx->nThreads - 1) spinWait(&spins);
+}
+
+// the number of pieces for a squaring, so that the k(k+1)/2 products keep all threads busy
+static int sqrPieces(const int nThreads, const mp_size_t n) {
+    int k = 1;
+    while (k*(k+1)/2 < nThreads && k < PAR_SQR_MAX_PIECES && k < n) ++k;
+    return k;
+}
+
+// the number of pieces for a product, one per thread
+static int mulPieces(const int nThreads, const mp_size_t n) {
+    return nThreads < n ? nThreads : n;
+}
+
+// tp = xp^2 with 2n limbs
+static void parSquare(struct parSqr* ctx, mp_ptr tp, mp_srcptr xp) {
+    const mp_size_t n = ctx->n;
+    const int k = sqrPieces(ctx->nThreads, n);
+    const mp_size_t h = (n + k - 1)/k;
+    mp_size_t len[PAR_SQR_MAX_PIECES];
+    mp_limb_t* const sp = ctx->sp;
+    int t = 0, pieces = 0;
+
+    for (mp_size_t off = 0; off < n; off += h) len[pieces++] = n - off < h ? n - off : h;
+
+    // cross products x_i x_j first, as they are the most expensive, then the squares straight into tp
+    for (int i = 0; i < pieces; ++i) {
+	for (int j = i+1; j < pieces; ++j, ++t) {
+	    ctx->tasks[t] = (struct parTask) { ctx->buffers + t*ctx->bufferSize, xp + i*h, xp + j*h, len[i], len[j] };
+	}
+    }
+    for (int i = 0; i < pieces; ++i, ++t) {
+	ctx->tasks[t] = (struct parTask) { tp + 2*i*h, xp + i*h, xp + i*h, len[i], len[i] };
+    }
+    ctx->ntasks = t;
+    runStep(ctx);
+
+    if (pieces == 1) return;
+
+    // x^2 = sum x_i^2 B^2ih + 2 sum x_i x_j B^(i+j)h
+    mpn_zero(sp, 2*n);
+    t = 0;
+    for (int i = 0; i < pieces; ++i) {
+	for (int j = i+1; j < pieces; ++j, ++t) {
+	    const mp_size_t off = (i+j)*h;
+	    mpn_add(sp + off, sp + off, 2*n - off, ctx->buffers + t*ctx->bufferSize, len[i] + len[j]);
+	}
+    }
+    mpn_lshift(sp, sp, 2*n, 1);
+    mpn_add_n(tp, tp, sp, 2*n);
+}
+
+// rp = ap bp with an + n limbs or, if low is set, rp = ap bp mod B^an with an = n
+// the pieces of ap are multiplied by the whole bp (or only the limbs below B^an) on different threads
+static void parMul(struct parSqr* ctx, mp_ptr rp, mp_srcptr ap, const mp_size_t an, mp_srcptr bp, const bool low) {
+    const mp_size_t n = ctx->n;
+    const int k = mulPieces(ctx->nThreads, an);
+    const mp_size_t h = (an + k - 1)/k, rn = low ? an : an + n;
+    int pieces = 0;
+
+    for (mp_size_t off = 0; off < an; off += h, ++pieces) {
+	const mp_size_t len = an - off < h ? an - off : h;
+	ctx->tasks[pieces] = (struct parTask) { ctx->buffers + pieces*ctx->bufferSize, ap + off, bp, len, low ? an - off : n };
+    }
+    ctx->ntasks = pieces;
+    runStep(ctx);
+
+    mpn_zero(rp, rn);
+    for (int i = 0; i < pieces; ++i) {
+	const mp_size_t off = i*h;
+	const struct parTask* task = ctx->tasks + i;
+	mpn_add(rp + off, rp + off, rn - off, task->rp, low ? an - off : task->an + task->bn);
+    }
+}
+
+// xp = tp / R mod m, tp < m^2 of 2n limbs
+static void montReduce(struct parSqr* ctx, mp_ptr xp, mp_srcptr tp) {
+    const mp_size_t n = ctx->n;
+    mp_limb_t* const qp = ctx->qp;
+    mp_limb_t* const sp = ctx->sp;
+    mp_limb_t cy;
+
+    // q = t m' mod R, so that t + q m = 0 mod R
+    parMul(ctx, qp, tp, n, ctx->mip, true);
+    parMul(ctx, sp, qp, n, ctx->mp, false);
+    cy = mpn_add_n(sp, sp, tp, 2*n);
+
+    if (cy || mpn_cmp(sp + n, ctx->mp, n) >= 0) mpn_sub_n(xp, sp + n, ctx->mp, n);
+    else mpn_copyi(xp, sp + n, n);
+}
+
+int parSqrInit(struct parSqr* ctx, const mpz_t m, const int nThreads) {
+    const mp_size_t n = mpz_size(m);
+    const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const int k = sqrPieces(nThreads, n), km = mulPieces(nThreads, n);
+    const mp_size_t hs = (n + k - 1)/k, hm = (n + km - 1)/km;
+    const int nbuffers = k*(k-1)/2 > km ? k*(k-1)/2 : km;
+    mpz_t t;
+
+    memset(ctx, 0, sizeof(*ctx));
+    if (mpz_even_p(m) || mpz_cmp_ui(m, 3) < 0 || nThreads < 1) return 1;
+    if (nThreads > ncpus) fprintf(stderr, "WARNING %d threads for the parallel squaring but only %ld cores\n", nThreads, ncpus);
+
+    ctx->n = n;
+    ctx->isSpecial = specialInit(&ctx->special, m) == 0;
+    ctx->bufferSize = 2*hs > hm + n ? 2*hs : hm + n;
+    ctx->tasks = malloc((k*(k+1)/2 > km ? k*(k+1)/2 : km)*sizeof(struct parTask));
+    ctx->buffers = malloc(nbuffers*ctx->bufferSize*sizeof(mp_limb_t));
+    ctx->mp = malloc(n*sizeof(mp_limb_t));
+    ctx->mip = malloc(n*sizeof(mp_limb_t));
+    ctx->xp = malloc(n*sizeof(mp_limb_t));
+    ctx->qp = malloc(n*sizeof(mp_limb_t));
+    ctx->tp = malloc(2*n*sizeof(mp_limb_t));
+    ctx->sp = malloc(2*n*sizeof(mp_limb_t));
+    ctx->threads = malloc(nThreads*sizeof(pthread_t));
+    if (!ctx->tasks || !ctx->buffers || !ctx->mp || !ctx->mip || !ctx->xp || !ctx->qp || !ctx->tp || !ctx->sp || !ctx->threads) {
+	fprintf(stderr, "ERROR allocating the parallel squaring\n");
+	parSqrClear(ctx);
+	return 1;
+    }
+
+    // m and -m^{-1} mod R
+    mpn_copyi(ctx->mp, mpz_limbs_read(m), n);
+    mpz_init_set_ui(t, 0);
+    mpz_setbit(t, n*GMP_NUMB_BITS);
+    mpz_invert(t, m, t);
+    mpn_zero(ctx->mip, n);
+    mpn_copyi(ctx->mip, mpz_limbs_read(t), mpz_size(t));
+    mpn_neg(ctx->mip, ctx->mip, n);
+    mpz_clear(t);
+
+    // the calling thread is thread 0
+    ctx->nThreads = 1;
+    atomic_init(&ctx->generation, 0);
+    atomic_init(&ctx->done, 0);
+    atomic_init(&ctx->stop, false);
+    for (int i = 1; i < nThreads; ++i) {
+	struct parWorkerArgs* args = malloc(sizeof(struct parWorkerArgs));
+	cpu_set_t set;
+
+	if (!args) break;
+	args->ctx = ctx;
+	args->id = i;
+	if (pthread_create(ctx->threads + i, NULL, parWorker, args) != 0) {
+	    free(args);
+	    break;
+	}
+	++ctx->nThreads;
+
+	// pin the workers to their own core, leaving core 0 to the calling thread (failures are harmless)
+	if (ncpus > 1) {
+	    CPU_ZERO(&set);
+	    CPU_SET(i % ncpus, &set);
+	    pthread_setaffinity_np(ctx->threads[i], sizeof(set), &set);
+	}
+    }
+
+    if (ctx->nThreads != nThreads) {
+	fprintf(stderr, "ERROR starting the threads of the parallel squaring\n");
+	parSqrClear(ctx);
+	return 1;
+    }
+
+    return 0;
+}
+
+void parSqrClear(struct parSqr* ctx) {
+    if (ctx->nThreads > 1) {
+	atomic_store(&ctx->stop, true);
+	atomic_fetch_add_explicit(&ctx->generation, 1, memory_order_release);
+	for (int i = 1; i < ctx->nThreads; ++i) pthread_join(ctx->threads[i], NULL);
+    }
+    if (ctx->isSpecial) specialClear(&ctx->special);
+    free(ctx->threads);
+    free(ctx->tasks);
+    free(ctx->buffers);
+    free(ctx->mp);
+    free(ctx->mip);
+    free(ctx->xp);
+    free(ctx->qp);
+    free(ctx->tp);
+    free(ctx->sp);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void parSqrChain(struct parSqr* ctx, mpz_t r, const mpz_t b, mp_bitcnt_t nsq) {
+    const mp_size_t n = ctx->n;
+    mpz_t t, m;
+
+    // x = b, or b R mod m in Montgomery form
+    mpz_init(t);
+    mpz_roinit_n(m, ctx->mp, n);
+    if (ctx->isSpecial) mpz_mod(t, b, m);
+    else {
+	mpz_mul_2exp(t, b, n*GMP_NUMB_BITS);
+	mpz_mod(t, t, m);
+    }
+    mpn_zero(ctx->xp, n);
+    mpn_copyi(ctx->xp, mpz_limbs_read(t), mpz_size(t));
+    mpz_clear(t);
+
+    for (; nsq; --nsq) {
+	parSquare(ctx, ctx->tp, ctx->xp);
+	if (ctx->isSpecial) specialReduce(&ctx->special, ctx->xp, ctx->tp);
+	else montReduce(ctx, ctx->xp, ctx->tp);
+    }
+
+    // out of Montgomery form with a reduction of x
+    if (!ctx->isSpecial) {
+	mpn_copyi(ctx->tp, ctx->xp, n);
+	mpn_zero(ctx->tp + n, n);
+	montReduce(ctx, ctx->xp, ctx->tp);
+    }
+
+    mpn_copyi(mpz_limbs_write(r, n), ctx->xp, n);
+    mpz_limbs_finish(r, n);
+}
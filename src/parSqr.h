@@ -0,0 +1,57 @@
+#ifndef PAR_SQR_H
+#define PAR_SQR_H
+
+#include <gmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "specialMod.h"
+
+// Squaring chains where every single squaring is split across threads.
+// The chain is sequential, but at 50k-100k bits one squaring is big enough to share:
+//  - x is cut in k pieces x_i and the k(k+1)/2 products x_i^2 and x_i x_j are computed by different threads,
+//    then added together by the calling thread (a linear cost)
+//  - for moduli k2^e-1 the reduction of specialMod is linear, so it runs on the calling thread
+//  - otherwise the Montgomery reduction needs q = t m' mod R and q m, and both products are split in the same way
+// The workers are created once, pinned to a core each and wait for work on a spin barrier,
+// so that handing over a product costs far less than a thread creation or a condition variable.
+// The calling thread takes its share of every product, so nThreads counts it.
+
+// the most pieces a squaring is cut in
+#define PAR_SQR_MAX_PIECES 8
+
+// a product rp = ap bp (or a square if ap == bp and an == bn)
+struct parTask {
+    mp_ptr rp;
+    mp_srcptr ap, bp;
+    mp_size_t an, bn;
+};
+
+struct parSqr {
+    int nThreads;
+    pthread_t* threads;
+    struct parTask* tasks; // the products of the current step
+    int ntasks;
+    _Alignas(64) atomic_ulong generation; // incremented by the calling thread to start a step
+    _Alignas(64) atomic_int done; // workers finished with the current step
+    atomic_bool stop;
+
+    mp_size_t n; // limbs of m
+    bool isSpecial; // whether we use specialMod or Montgomery
+    struct specialMod special;
+    mp_limb_t *mp, *mip; // m and -m^{-1} mod R for Montgomery
+    mp_limb_t *xp, *tp, *qp, *sp; // running value, 2n limbs for products, n for q and 2n for sums
+    mp_limb_t* buffers; // the products of the pieces
+    mp_size_t bufferSize; // limbs per piece product
+};
+
+// returns 0 on success, 1 if m is even or the threads cannot be started
+int parSqrInit(struct parSqr* ctx, const mpz_t m, const int nThreads);
+
+void parSqrClear(struct parSqr* ctx);
+
+// r = b^(2^nsq) mod m
+void parSqrChain(struct parSqr* ctx, mpz_t r, const mpz_t b, const mp_bitcnt_t nsq);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef PRIMES_DB_H
+#define PRIMES_DB_H
+
+#include <stdint.h>
+
+// On-disk format of the compact prime database (bestprimes.gap)
+//
+// [header][gap stream, zero-padded to a multiple of 8 bytes][block index]
+//
+// Primes are split in blocks of blockSize consecutive primes.
+// The index stores, for each block, its first prime and the offset of its gaps in the gap stream.
+// The other blockSize-1 primes of the block are stored as the gaps to the previous prime divided by gapUnit.
+// A gap is encoded in one byte if it fits, otherwise as a zero byte followed by 2 bytes (little endian).
+// So the i-th prime can be recovered by decoding at most blockSize-1 gaps.
+// All integers are stored little endian.
+
+#define PRIMES_DB_MAGIC "TCPRMGAP"
+#define PRIMES_DB_VERSION 1
+#define PRIMES_DB_BLOCK 64 // default number of primes per block
+
+struct primesDBHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t blockSize; // number of primes per block
+    uint32_t gapUnit; // all gaps are multiples of this
+    uint32_t residue; // all primes are residue mod 3 (0 if there is no such filter)
+    uint32_t bits; // all primes are in (2^(bits-1), 2^bits)
+    uint32_t reserved;
+    uint64_t nprimes; // number of primes stored
+    uint64_t nblocks; // number of entries in the block index
+    uint64_t gapsBytes; // bytes used by the gap stream (excluding padding)
+    uint64_t indexOffset; // offset of the block index from the start of the file
+};
+
+struct primesDBBlock {
+    uint32_t first; // first prime of the block
+    uint32_t offset; // offset of the gaps of the block from the start of the gap stream
+};
+
+// encodes gap (already divided by gapUnit) into out and returns the number of bytes used
+// gap must be non-zero and below 2^16
+static inline int primesDBPutGap(uint8_t* out, const uint32_t gap) {
+    if (gap < 256) {
+	out[0] = gap;
+	return 1;
+    }
+    out[0] = 0; // escape
+    out[1] = gap & 0xff;
+    out[2] = gap >> 8;
+    return 3;
+}
+
+// decodes the gap at *in (still divided by gapUnit) and moves *in past it
+static inline uint32_t primesDBGetGap(const uint8_t** in) {
+    const uint8_t* p = *in;
+    if (p[0]) {
+	*in = p+1;
+	return p[0];
+    }
+    *in = p+3;
+    return p[1] | ((uint32_t)p[2] << 8);
+}
+
+#endif
@@ -1,35 +1,130 @@
 #include "rand.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <stdio.h>
 
+#include <openssl/evp.h>
+
+#include "constructPrimes.h"
+
 // intial seed for xorshft
 #define INITIAL_SEED 88172645463325252l
 
+// keystream bytes produced at once for randomUnits
+#define RAND_BULK_BYTES (64*1024)
+
 // GMP random staet
 static gmp_randstate_t *randomState = NULL;
+static mpz_t gcdTemp;
+static bool hasGcdTemp = false;
+
+// AES-256-CTR keystream of randomUnits, bulkPos bytes of bulkLen used
+static EVP_CIPHER_CTX* bulkCtx = NULL;
+static uint8_t* bulk = NULL;
+static size_t bulkSize = 0, bulkLen = 0, bulkPos = 0;
 
 
-static uint64_t xorshfstate = INITIAL_SEED;
-static uint64_t currentRandomWord, randomBitsUsed=64;
+// per thread, so that threads constructing moduli in parallel do not race on it
+// (each thread should call setSeed with its own seed)
+static _Thread_local uint64_t xorshfstate = INITIAL_SEED;
+static _Thread_local uint64_t currentRandomWord, randomBitsUsed=64;
 
 void randomMessage(mpz_t m, const mpz_t q) {
     if (randomState == NULL) {
 	randomState = (gmp_randstate_t*) malloc(sizeof(gmp_randstate_t));
 	gmp_randinit_default(*randomState);
     }
-
-    mpz_t temp;
-    mpz_init(temp);
+    if (!hasGcdTemp) {
+	mpz_init(gcdTemp);
+	hasGcdTemp = true;
+    }
 
     do {
 	mpz_urandomm(m, *randomState, q); // random message in the range 0 ... q
-	mpz_gcd(temp, m, q); // temp <- gcd(m,q)
-    } while (mpz_cmp_ui(temp, 1) != 0); // temp != 1 <-> m not in ZZ^*_q
+	mpz_gcd(gcdTemp, m, q); // gcdTemp <- gcd(m,q)
+    } while (mpz_cmp_ui(gcdTemp, 1) != 0); // gcdTemp != 1 <-> m not in ZZ^*_q
+}
 
-    mpz_clear(temp);
+// the next len bytes of the bulk keystream, keying it on first use
+static const uint8_t* bulkBytes(const size_t len) {
+    if (bulkCtx == NULL) {
+	uint64_t key[6]; // 32 bytes of key and 16 of IV
+	for (int i = 0; i < 6; ++i) key[i] = xorshf64();
+	bulkCtx = EVP_CIPHER_CTX_new();
+	if (!bulkCtx || 1 != EVP_EncryptInit_ex2(bulkCtx, EVP_aes_256_ctr(), (uint8_t*) key, (uint8_t*) (key + 4), NULL)) {
+	    fprintf(stderr, "ERROR keying the random generator\n");
+	    EVP_CIPHER_CTX_free(bulkCtx);
+	    bulkCtx = NULL;
+	    return NULL;
+	}
+    }
+
+    if (bulkPos + len > bulkLen) {
+	const size_t size = len > RAND_BULK_BYTES ? len : RAND_BULK_BYTES;
+	int outl;
+
+	if (size > bulkSize) {
+	    free(bulk);
+	    bulk = malloc(size);
+	    bulkSize = bulk ? size : 0;
+	    if (!bulk) return NULL;
+	}
+	// the keystream is the encryption of zeros, in place
+	memset(bulk, 0, size);
+	if (!EVP_EncryptUpdate(bulkCtx, bulk, &outl, bulk, size)) {
+	    fprintf(stderr, "ERROR generating random bytes\n");
+	    return NULL;
+	}
+	bulkLen = size;
+	bulkPos = 0;
+    }
+
+    bulkPos += len;
+    return bulk + bulkPos - len;
+}
+
+// whether 0 <= r < q is a unit: only 0 is not for a safe prime, the factorization tells for the others
+static inline bool isUnitBelow(const struct modulus* mod, const mpz_t r) {
+    return mod->type == MODULUS_SAFE_PRIME ? mpz_sgn(r) != 0 : isUnitModulo(mod, r);
+}
+
+// m = a random unit, candidates of the bits of q taken from the bulk keystream until one is below q and a unit
+static int sampleUnit(mpz_t m, const struct modulus* mod) {
+    const mp_size_t nLimbs = mpz_size(mod->q);
+    const mp_srcptr qp = mpz_limbs_read(mod->q);
+    const unsigned int topBits = mpz_sizeinbase(mod->q, 2) % GMP_NUMB_BITS;
+    const mp_limb_t topMask = topBits ? ((mp_limb_t) 1 << topBits) - 1 : ~(mp_limb_t) 0;
+    const uint8_t* bytes;
+    mp_ptr mp;
+
+    do {
+	do {
+	    if (!(bytes = bulkBytes(nLimbs*sizeof(mp_limb_t)))) return -1;
+	    mp = mpz_limbs_write(m, nLimbs);
+	    memcpy(mp, bytes, nLimbs*sizeof(mp_limb_t));
+	    mp[nLimbs-1] &= topMask;
+	} while (mpn_cmp(mp, qp, nLimbs) >= 0);
+	mpz_limbs_finish(m, nLimbs);
+    } while (!isUnitBelow(mod, m));
+
+    return 0;
+}
+
+void randomUnit(mpz_t m, const struct modulus* mod) {
+    if (sampleUnit(m, mod) != 0) fprintf(stderr, "ERROR sampling a random unit\n");
+}
+
+int randomUnits(mpz_t* m, const size_t n, const struct modulus* mod) {
+    for (size_t i = 0; i < n; ++i) {
+	if (sampleUnit(m[i], mod) != 0) {
+	    fprintf(stderr, "ERROR sampling random units\n");
+	    return -1;
+	}
+    }
+    return 0;
 }
 
 // frees any space allocated for randomness
@@ -39,6 +134,15 @@ void clearRandomness() {
 	free(randomState);
 	randomState = NULL;
     }
+    if (hasGcdTemp) {
+	mpz_clear(gcdTemp);
+	hasGcdTemp = false;
+    }
+    EVP_CIPHER_CTX_free(bulkCtx);
+    free(bulk);
+    bulkCtx = NULL;
+    bulk = NULL;
+    bulkSize = bulkLen = bulkPos = 0;
 }
 
 void setSeed(uint64_t seed) {
@@ -7,6 +7,20 @@
 // random function that returns a random message m in ZZ^*_q
 void randomMessage(mpz_t m, const mpz_t q);
 
+struct modulus;
+
+// the same for q = mod->q, testing membership with the factorization of mod instead of a gcd
+// the candidates come from the keystream of randomUnits
+void randomUnit(mpz_t m, const struct modulus* mod);
+
+// fills m[0..n) with random elements of ZZ^*_q for q = mod->q
+// the limbs are drawn straight from an AES-256-CTR keystream produced RAND_BULK_BYTES at a time, keyed with xorshf64
+// on first use (so setSeed makes it reproducible), and rejected if they are not below q or, depending on the
+// type of modulus, not a unit: for a safe prime only 0 is rejected
+// like randomMessage, it shares its state between threads
+// returns 0 on success
+int randomUnits(mpz_t* m, const size_t n, const struct modulus* mod);
+
 // frees any space allocated for randomness
 void clearRandomness();
 
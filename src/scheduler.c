@@ -0,0 +1,409 @@
+#define _GNU_SOURCE // for pthread_setaffinity_np and getline
+#include "scheduler.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rand.h"
+#include "timing.h"
+
+#define IDLE_SLEEP_NS 100000 // how long a thread sleeps when there is nothing to steal
+
+static void idleSleep() {
+    const struct timespec t = { 0, IDLE_SLEEP_NS };
+    nanosleep(&t, NULL);
+}
+
+/************************************************************************************/
+// JOBS
+
+int jobInitSquare(struct job* job, const mpz_t N, const mpz_t x, const uint64_t T) {
+    memset(job, 0, sizeof(*job));
+    if (mpz_cmp_ui(N, 1) <= 0) return 1;
+    job->type = JOB_SQUARE;
+    mpz_init_set(job->N, N);
+    mpz_init_set(job->x, x);
+    mpz_init(job->e);
+    mpz_init(job->result);
+    job->T = T;
+    job->lastThread = -1;
+    return 0;
+}
+
+int jobInitPowm(struct job* job, const mpz_t N, const mpz_t x, const mpz_t e) {
+    memset(job, 0, sizeof(*job));
+    if (mpz_cmp_ui(N, 1) <= 0 || mpz_sgn(e) < 0) return 1;
+    job->type = JOB_POWM;
+    mpz_init_set(job->N, N);
+    mpz_init_set(job->x, x);
+    mpz_init_set(job->e, e);
+    mpz_init(job->result);
+    job->lastThread = -1;
+    return 0;
+}
+
+// frees what the job needs only while running
+static void jobFinish(struct job* job) {
+    if (job->type == JOB_SQUARE && job->started) sqChainClear(&job->chain);
+    if (job->hasCtx) {
+	montClear(&job->ctx);
+	expPlanClear(&job->plan);
+	free(job->table);
+	job->table = NULL;
+	job->hasCtx = false;
+    }
+    job->done = true;
+}
+
+void jobClear(struct job* job) {
+    if (!job->done) jobFinish(job);
+    mpz_clears(job->N, job->x, job->e, job->result, NULL);
+    memset(job, 0, sizeof(*job));
+}
+
+// set up a powm: the table of plan in Montgomery form, or a single mpz_powm if N is even
+static void powmStart(struct job* job) {
+    const mp_size_t n = mpz_size(job->N);
+
+    if (montInit(&job->ctx, job->N) != 0) return;
+    if (expPlanInit(&job->plan, job->e) != 0) {
+	montClear(&job->ctx);
+	return;
+    }
+    job->table = malloc((job->plan.nentries + 1)*n*sizeof(mp_limb_t));
+    if (!job->table) {
+	expPlanClear(&job->plan);
+	montClear(&job->ctx);
+	return;
+    }
+    job->hasCtx = true;
+
+    if (job->plan.nwindows == 0) return;
+
+    // table[i] = x^(2i+1), followed by x^2, and xp = table[idx[0]] as in montPowmPlan
+    mp_limb_t* const x2 = job->table + job->plan.nentries*n;
+    montToMont(&job->ctx, job->table, job->x);
+    montSqr(&job->ctx, x2, job->table);
+    for (long i = 1; i < job->plan.nentries; ++i) montMul(&job->ctx, job->table + i*n, job->table + (i-1)*n, x2);
+    mpn_copyi(job->ctx.xp, job->table + job->plan.idx[0]*n, n);
+    job->window = 1;
+    job->work += job->plan.nentries;
+}
+
+// run the windows of the plan until about chunk squarings are done; returns the squarings and multiplications done
+static uint64_t powmChunk(struct job* job, const uint64_t chunk) {
+    const mp_size_t n = job->ctx.n;
+    const struct expPlan* plan = &job->plan;
+    mp_limb_t* const xp = job->ctx.xp;
+    uint64_t work = 0;
+
+    for (; job->window < plan->nwindows && work < chunk; ++job->window) {
+	for (mp_bitcnt_t s = plan->nsq[job->window]; s; --s) montSqr(&job->ctx, xp, xp);
+	montMul(&job->ctx, xp, xp, job->table + plan->idx[job->window]*n);
+	work += plan->nsq[job->window] + 1;
+    }
+
+    if (job->window == plan->nwindows) {
+	for (mp_bitcnt_t s = plan->tail; s; --s) montSqr(&job->ctx, xp, xp);
+	work += plan->tail;
+	montFromMont(&job->ctx, job->result, xp);
+	jobFinish(job);
+    }
+
+    return work;
+}
+
+// run the next chunk of a job; returns the squarings and multiplications done
+static uint64_t jobChunk(struct job* job, const uint64_t chunk) {
+    uint64_t work = 0;
+
+    if (job->type == JOB_SQUARE) {
+	if (!job->started && sqChainInit(&job->chain, job->N, job->x, job->T) != 0) {
+	    mpz_set_ui(job->result, 0);
+	    job->done = true;
+	    return 0;
+	}
+	job->started = true;
+	work = sqChainAdvance(&job->chain, chunk);
+	if (job->chain.iteration == job->T) {
+	    mpz_set(job->result, job->chain.x);
+	    jobFinish(job);
+	}
+    } else {
+	if (!job->started) {
+	    job->started = true;
+	    powmStart(job);
+	    if (!job->hasCtx) { // even N, all at once with GMP
+		mpz_powm(job->result, job->x, job->e, job->N);
+		jobFinish(job);
+		return mpz_sizeinbase(job->e, 2);
+	    }
+	    if (job->plan.nwindows == 0) {
+		mpz_set_ui(job->result, 1);
+		mpz_mod(job->result, job->result, job->N);
+		jobFinish(job);
+		return 0;
+	    }
+	}
+	work = powmChunk(job, chunk);
+    }
+
+    job->work += work;
+    return work;
+}
+
+long readJobs(struct job** jobs, const char* path) {
+    FILE* f = fopen(path, "r");
+    char* line = NULL;
+    size_t lineSize = 0;
+    long njobs = 0, capacity = 16, lineno = 0;
+    unsigned long T;
+    mpz_t N, x, e;
+
+    if (!f) {
+	fprintf(stderr, "ERROR cannot open the job file %s\n", path);
+	return -1;
+    }
+    *jobs = malloc(capacity*sizeof(struct job));
+    if (!*jobs) {
+	fclose(f);
+	return -1;
+    }
+    mpz_inits(N, x, e, NULL);
+
+    while (getline(&line, &lineSize, f) != -1) {
+	struct job* job;
+	char* start = line + strspn(line, " \t");
+
+	++lineno;
+	if (*start == '#' || *start == '\n' || *start == '\0') continue;
+
+	if (njobs == capacity) {
+	    struct job* more = realloc(*jobs, 2*capacity*sizeof(struct job));
+	    if (!more) {
+		fprintf(stderr, "ERROR cannot allocate memory for the jobs of %s\n", path);
+		for (long i = 0; i < njobs; ++i) jobClear(*jobs + i);
+		free(*jobs);
+		*jobs = NULL;
+		njobs = -1;
+		break;
+	    }
+	    *jobs = more;
+	    capacity *= 2;
+	}
+	job = *jobs + njobs;
+
+	if (gmp_sscanf(start, "square %Zx %Zx %lu", N, x, &T) == 3 && jobInitSquare(job, N, x, T) == 0) ++njobs;
+	else if (gmp_sscanf(start, "powm %Zx %Zx %Zx", N, x, e) == 3 && jobInitPowm(job, N, x, e) == 0) ++njobs;
+	else fprintf(stderr, "WARNING ignoring line %ld of the job file %s\n", lineno, path);
+    }
+
+    free(line);
+    mpz_clears(N, x, e, NULL);
+    fclose(f);
+    return njobs;
+}
+
+int generateJobs(struct job** jobs, const long njobs, const unsigned long bits, const uint64_t T) {
+    mpz_t bound, N, x, e;
+
+    if (bits < 3) {
+	*jobs = NULL;
+	return 1;
+    }
+    *jobs = malloc(njobs*sizeof(struct job));
+    if (!*jobs) return 1;
+    mpz_inits(bound, N, x, e, NULL);
+    mpz_setbit(bound, bits);
+
+    for (long i = 0; i < njobs; ++i) {
+	randomMessage(N, bound);
+	mpz_setbit(N, bits - 1);
+	mpz_setbit(N, 0);
+	randomMessage(x, N);
+	if (i % 4 == 3) {
+	    randomMessage(e, bound);
+	    jobInitPowm(*jobs + i, N, x, e);
+	} else jobInitSquare(*jobs + i, N, x, T/8 + xorshf64() % (T - T/8 + 1));
+    }
+
+    mpz_clears(bound, N, x, e, NULL);
+    return 0;
+}
+
+/************************************************************************************/
+// WORK-STEALING DEQUES
+
+static int dequeInit(struct jobDeque* deque, const long capacity) {
+    long cap = 1;
+    while (cap < capacity) cap <<= 1;
+    deque->jobs = malloc(cap*sizeof(*deque->jobs));
+    if (!deque->jobs) return 1;
+    deque->mask = cap - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return 0;
+}
+
+// only by the owner; never full, as the capacity is the number of jobs
+static void dequePush(struct jobDeque* deque, struct job* job) {
+    const long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    atomic_store_explicit(deque->jobs + (b & deque->mask), job, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+}
+
+// only by the owner; returns NULL if empty
+static struct job* dequePop(struct jobDeque* deque) {
+    const long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    struct job* job = NULL;
+    long t;
+
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t <= b) {
+	job = atomic_load_explicit(deque->jobs + (b & deque->mask), memory_order_relaxed);
+	if (t == b) { // the last job, race with the thieves for it
+	    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) job = NULL;
+	    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+	}
+    } else atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+
+    return job;
+}
+
+// by any thread; returns NULL if empty or if another thread took the job first
+static struct job* dequeSteal(struct jobDeque* deque) {
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    long b;
+    struct job* job;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b) return NULL;
+
+    job = atomic_load_explicit(deque->jobs + (t & deque->mask), memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) return NULL;
+    return job;
+}
+
+/************************************************************************************/
+// SCHEDULER
+
+// steal from the other threads, starting at a random one
+static struct job* stealJob(struct schedThread* self) {
+    struct scheduler* const sched = self->sched;
+    const int start = xorshf64() % sched->nThreads;
+
+    for (int i = 0; i < sched->nThreads; ++i) {
+	const int victim = (start + i) % sched->nThreads;
+	struct job* job;
+	if (victim == self->id) continue;
+	if ((job = dequeSteal(&sched->threads[victim].deque))) {
+	    ++self->steals;
+	    return job;
+	}
+    }
+    return NULL;
+}
+
+static void* schedWorker(void* arg) {
+    struct schedThread* const self = (struct schedThread*) arg;
+    struct scheduler* const sched = self->sched;
+    struct job* job;
+
+    setSeed(self->seed);
+
+    while (atomic_load_explicit(&sched->remaining, memory_order_acquire) > 0) {
+	if (!(job = dequePop(&self->deque)) && !(job = stealJob(self))) {
+	    idleSleep();
+	    continue;
+	}
+
+	const double start = wallTime();
+	if (job->lastThread >= 0 && job->lastThread != self->id) ++job->migrations;
+	job->lastThread = self->id;
+	self->work += jobChunk(job, sched->chunk);
+	self->busySeconds += wallTime() - start;
+
+	if (job->done) {
+	    ++self->completed;
+	    atomic_fetch_sub_explicit(&sched->remaining, 1, memory_order_release);
+	} else dequePush(&self->deque, job); // where idle threads can steal it
+    }
+
+    return NULL;
+}
+
+int schedRun(struct job* jobs, const long njobs, const int nThreads, const uint64_t chunk, struct schedStats* stats) {
+    const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct scheduler sched = { jobs, njobs, chunk ? chunk : SCHED_CHUNK, nThreads };
+    double start;
+    int started = 0, err = 0;
+
+    if (nThreads < 1) return 1;
+    sched.threads = calloc(nThreads, sizeof(struct schedThread));
+    if (!sched.threads) return 1;
+    atomic_init(&sched.remaining, 0);
+
+    for (int i = 0; i < nThreads; ++i) {
+	sched.threads[i].sched = &sched;
+	sched.threads[i].id = i;
+	sched.threads[i].seed = xorshf64() | 1; // xorshift needs a non-zero state
+	if (dequeInit(&sched.threads[i].deque, njobs) != 0) err = 1;
+    }
+    if (err) {
+	fprintf(stderr, "ERROR allocating the scheduler\n");
+	goto free;
+    }
+
+    // the jobs are dealt round-robin before the threads start
+    for (long j = 0; j < njobs; ++j) {
+	if (jobs[j].done) continue;
+	dequePush(&sched.threads[j % nThreads].deque, jobs + j);
+	atomic_fetch_add(&sched.remaining, 1);
+    }
+
+    start = wallTime();
+    for (; started < nThreads; ++started) {
+	cpu_set_t set;
+
+	if (pthread_create(&sched.threads[started].thread, NULL, schedWorker, sched.threads + started) != 0) break;
+	if (ncpus > 1) { // failures are harmless
+	    CPU_ZERO(&set);
+	    CPU_SET(started % ncpus, &set);
+	    pthread_setaffinity_np(sched.threads[started].thread, sizeof(set), &set);
+	}
+    }
+    if (started == 0) { // the deques are not run by anyone
+	fprintf(stderr, "ERROR starting the threads of the scheduler\n");
+	err = 1;
+	goto free;
+    }
+    for (int i = 0; i < started; ++i) pthread_join(sched.threads[i].thread, NULL);
+
+    if (stats) {
+	double rate = 0;
+	memset(stats, 0, sizeof(*stats));
+	stats->nThreads = started;
+	stats->njobs = njobs;
+	stats->seconds = wallTime() - start;
+	stats->puzzlesPerHour = stats->seconds > 0 ? 3600*njobs/stats->seconds : 0;
+	for (int i = 0; i < started; ++i) {
+	    if (sched.threads[i].busySeconds > 0) rate += sched.threads[i].work/sched.threads[i].busySeconds;
+	    stats->steals += sched.threads[i].steals;
+	}
+	stats->squaringsPerCore = rate/started;
+	for (long j = 0; j < njobs; ++j) stats->migrations += jobs[j].migrations;
+    }
+
+ free:
+    for (int i = 0; i < nThreads; ++i) free(sched.threads[i].deque.jobs);
+    free(sched.threads);
+    return err;
+}
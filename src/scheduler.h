@@ -0,0 +1,109 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <gmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "expPlan.h"
+#include "montgomery.h"
+#include "sqChain.h"
+
+// Many independent puzzles solved on a pool of threads with work stealing.
+// Every thread owns a deque of jobs (Chase-Lev): it pushes and pops at the bottom, while idle threads steal
+// from the top with a compare and swap, so threads only contend when one of them runs out of work.
+// A job runs a chunk of squarings at a time and goes back to the deque of its thread after each chunk,
+// where another thread may steal it: a long job does not keep the jobs queued behind it from idle cores.
+// The threads are pinned to a core each and a job is only set up (contexts and tables) when first run,
+// so its memory is allocated by the thread using it.
+
+// squarings per chunk, a few milliseconds at 2k bits
+#define SCHED_CHUNK 4096
+
+enum jobType {
+    JOB_SQUARE, // x^(2^T) mod N
+    JOB_POWM // x^e mod N, e.g. a cube root with e = b
+};
+
+struct job {
+    enum jobType type;
+    mpz_t N, x, e;
+    uint64_t T;
+    mpz_t result;
+    bool started, done;
+    uint64_t work; // squarings and multiplications done so far
+    int lastThread;
+    unsigned long migrations; // chunks run on a different thread than the previous one
+
+    // JOB_SQUARE
+    struct sqChain chain;
+
+    // JOB_POWM, the windows of plan are run a chunk at a time on a Montgomery context
+    bool hasCtx;
+    struct montCtx ctx;
+    struct expPlan plan;
+    mp_limb_t* table; // x^(2i+1) and x^2 in Montgomery form
+    long window; // next window of plan
+};
+
+// bounded Chase-Lev deque of jobs, capacity must be a power of 2
+struct jobDeque {
+    _Atomic(struct job*)* jobs;
+    long mask;
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+};
+
+struct schedThread {
+    struct scheduler* sched;
+    int id;
+    pthread_t thread;
+    struct jobDeque deque;
+    uint64_t seed; // for the choice of victims
+    uint64_t work; // squarings and multiplications run by the thread
+    double busySeconds;
+    unsigned long completed, steals;
+};
+
+struct scheduler {
+    struct job* jobs;
+    long njobs;
+    uint64_t chunk;
+    int nThreads;
+    struct schedThread* threads;
+    _Alignas(64) atomic_long remaining; // jobs not done yet
+};
+
+struct schedStats {
+    int nThreads;
+    long njobs;
+    double seconds; // wall-clock time of the run
+    double puzzlesPerHour;
+    double squaringsPerCore; // squarings per second of busy time, averaged over threads
+    unsigned long steals, migrations;
+};
+
+// return 0 on success
+int jobInitSquare(struct job* job, const mpz_t N, const mpz_t x, const uint64_t T);
+int jobInitPowm(struct job* job, const mpz_t N, const mpz_t x, const mpz_t e);
+void jobClear(struct job* job);
+
+// read the jobs of a file with one job per line, lines starting with # are ignored:
+//    square <N> <x> <T>
+//    powm <N> <x> <e>
+// with N, x and e in hexadecimal
+// returns the number of jobs in *jobs (to be cleared and freed by the caller), or -1 on error
+long readJobs(struct job** jobs, const char* path);
+
+// njobs random jobs on random odd moduli of bits bits: squarings with T between T/8 and T, and one in four
+// a powm with an exponent of bits bits, so that short and long jobs are mixed
+// returns 0 on success, and then the jobs must be cleared and freed
+int generateJobs(struct job** jobs, const long njobs, const unsigned long bits, const uint64_t T);
+
+// run all jobs to completion on nThreads threads, chunk squarings at a time; stats may be NULL
+// returns 0 on success
+int schedRun(struct job* jobs, const long njobs, const int nThreads, const uint64_t chunk, struct schedStats* stats);
+
+#endif
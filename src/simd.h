@@ -0,0 +1,66 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// A small abstraction over the vector instructions we use, so that the same code runs with AVX-512, AVX2 or none.
+// Each lane is a 64-bit word and vmul32 multiplies the low 32 bits of each lane.
+// Booleans are masks with all bits set (true) or zero (false).
+
+#include <stdint.h>
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define VLANES 8
+typedef __m512i vec_t;
+#define vset1(x) _mm512_set1_epi64(x)
+#define vload(p) _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*)(p)))
+#define vmul32(a, b) _mm512_mul_epu32(a, b)
+#define vadd(a, b) _mm512_add_epi64(a, b)
+#define vsub(a, b) _mm512_sub_epi64(a, b)
+#define vshr(a, k) _mm512_srli_epi64(a, k)
+#define vand(a, b) _mm512_and_si512(a, b)
+#define vor(a, b) _mm512_or_si512(a, b)
+#define vandnot(a, b) _mm512_andnot_si512(a, b) // ~a & b
+#define veq(a, b) _mm512_maskz_set1_epi64(_mm512_cmpeq_epu64_mask(a, b), -1)
+#define vgt(a, b) _mm512_maskz_set1_epi64(_mm512_cmpgt_epu64_mask(a, b), -1)
+#define vtest(m, l) (((uint64_t*)&(m))[l] != 0)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define VLANES 4
+typedef __m256i vec_t;
+#define vset1(x) _mm256_set1_epi64x(x)
+#define vload(p) _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(p)))
+#define vmul32(a, b) _mm256_mul_epu32(a, b)
+#define vadd(a, b) _mm256_add_epi64(a, b)
+#define vsub(a, b) _mm256_sub_epi64(a, b)
+#define vshr(a, k) _mm256_srli_epi64(a, k)
+#define vand(a, b) _mm256_and_si256(a, b)
+#define vor(a, b) _mm256_or_si256(a, b)
+#define vandnot(a, b) _mm256_andnot_si256(a, b)
+#define veq(a, b) _mm256_cmpeq_epi64(a, b)
+#define vgt(a, b) _mm256_cmpgt_epi64(a, b) // signed, but all our values are below 2^33
+#define vtest(m, l) (((uint64_t*)&(m))[l] != 0)
+#else
+#define VLANES 1
+typedef uint64_t vec_t;
+#define vset1(x) ((uint64_t)(x))
+#define vload(p) ((uint64_t)*(p))
+#define vmul32(a, b) ((uint64_t)(uint32_t)(a) * (uint32_t)(b))
+#define vadd(a, b) ((a) + (b))
+#define vsub(a, b) ((a) - (b))
+#define vshr(a, k) ((a) >> (k))
+#define vand(a, b) ((a) & (b))
+#define vor(a, b) ((a) | (b))
+#define vandnot(a, b) (~(a) & (b))
+#define veq(a, b) ((a) == (b) ? ~0ull : 0ull)
+#define vgt(a, b) ((a) > (b) ? ~0ull : 0ull)
+#define vtest(m, l) ((m) != 0)
+#endif
+
+#define vselect(m, a, b) vor(vand(m, a), vandnot(m, b)) // m ? a : b
+#if VLANES > 1
+#define vlane(v, l) (((uint64_t*)&(v))[l]) // the l-th word of v, as an lvalue
+#else
+#define vlane(v, l) (v)
+#endif
+
+#endif
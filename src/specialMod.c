@@ -0,0 +1,166 @@
+#include "specialMod.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// limbs rounded up to a multiple of a cache line
+#define ALIGNED_LIMBS(n) (((n) + 7) & ~(mp_size_t)7)
+
+int specialInit(struct specialMod* ctx, const mpz_t p) {
+    const mp_size_t n = mpz_size(p);
+    mpz_t t;
+
+    memset(ctx, 0, sizeof(*ctx));
+    if (mpz_even_p(p) || mpz_sgn(p) <= 0) return 1;
+
+    mpz_init(t);
+    mpz_add_ui(t, p, 1);
+    ctx->e = mpz_scan1(t, 0);
+    mpz_tdiv_q_2exp(t, t, ctx->e);
+    if (mpz_size(t) != 1 || ctx->e < GMP_NUMB_BITS) { // k must be a single limb smaller than 2^e
+	mpz_clear(t);
+	return 1;
+    }
+    ctx->k = mpz_getlimbn(t, 0);
+    mpz_clear(t);
+
+    // mp | xp | tp (2n) | hp (n+2)
+    ctx->n = n;
+    ctx->memory = aligned_alloc(64, (2*ALIGNED_LIMBS(n) + ALIGNED_LIMBS(2*n) + ALIGNED_LIMBS(n+2))*sizeof(mp_limb_t));
+    if (!ctx->memory) return 1;
+    ctx->mp = (mp_limb_t*) ctx->memory;
+    ctx->xp = ctx->mp + ALIGNED_LIMBS(n);
+    ctx->tp = ctx->xp + ALIGNED_LIMBS(n);
+    ctx->hp = ctx->tp + ALIGNED_LIMBS(2*n);
+
+    mpn_copyi(ctx->mp, mpz_limbs_read(p), n);
+    return 0;
+}
+
+void specialClear(struct specialMod* ctx) {
+    free(ctx->memory);
+    free(ctx->table);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void specialReduce(struct specialMod* ctx, mp_ptr rp, mp_ptr tp) {
+    const mp_size_t n = ctx->n, el = ctx->e / GMP_NUMB_BITS;
+    const unsigned eb = ctx->e % GMP_NUMB_BITS;
+    const mp_size_t hn = 2*n - el;
+    mp_limb_t* const hp = ctx->hp;
+    mp_limb_t r;
+    mp_size_t qn;
+
+    // H = tp >> e and then Q = H / k, r = H mod k
+    if (eb) mpn_rshift(hp, tp + el, hn, eb);
+    else mpn_copyi(hp, tp + el, hn);
+    r = mpn_divrem_1(hp, 0, hp, hn, ctx->k);
+
+    // keep L = tp mod 2^e in the low limbs of tp, which now holds the result (n+1 limbs)
+    if (eb) tp[el] &= (((mp_limb_t)1) << eb) - 1;
+    else tp[el] = 0;
+    if (n > el) mpn_zero(tp + el + 1, n - el);
+
+    // L + r 2^e
+    mpn_add_1(tp + el, tp + el, n + 1 - el, r << eb);
+    if (eb) mpn_add_1(tp + el + 1, tp + el + 1, n - el, r >> (GMP_NUMB_BITS - eb));
+
+    // + Q, which is smaller than p
+    qn = hn;
+    while (qn > 0 && hp[qn-1] == 0) --qn;
+    if (qn) mpn_add(tp, tp, n + 1, hp, qn);
+
+    // the sum is at most 2p+1
+    while (tp[n] || mpn_cmp(tp, ctx->mp, n) >= 0) tp[n] -= mpn_sub_n(tp, tp, ctx->mp, n);
+
+    mpn_copyi(rp, tp, n);
+}
+
+static inline void specialMul(struct specialMod* ctx, mp_ptr rp, mp_srcptr ap, mp_srcptr bp) {
+    mpn_mul_n(ctx->tp, ap, bp, ctx->n);
+    specialReduce(ctx, rp, ctx->tp);
+}
+
+static inline void specialSqr(struct specialMod* ctx, mp_ptr rp, mp_srcptr ap) {
+    mpn_sqr(ctx->tp, ap, ctx->n);
+    specialReduce(ctx, rp, ctx->tp);
+}
+
+// rp = a mod p as n limbs
+static void specialLoad(struct specialMod* ctx, mp_ptr rp, const mpz_t a) {
+    const mp_size_t n = ctx->n;
+    mpz_t t, p;
+
+    mpn_zero(rp, n);
+    if ((mp_size_t) mpz_size(a) > n || ((mp_size_t) mpz_size(a) == n && mpn_cmp(mpz_limbs_read(a), ctx->mp, n) >= 0)) {
+	mpz_init(t);
+	mpz_mod(t, a, mpz_roinit_n(p, ctx->mp, n));
+	mpn_copyi(rp, mpz_limbs_read(t), mpz_size(t));
+	mpz_clear(t);
+    } else mpn_copyi(rp, mpz_limbs_read(a), mpz_size(a));
+}
+
+static void specialStore(struct specialMod* ctx, mpz_t r, mp_srcptr ap) {
+    mpn_copyi(mpz_limbs_write(r, ctx->n), ap, ctx->n);
+    mpz_limbs_finish(r, ctx->n);
+}
+
+void specialSqrChain(struct specialMod* ctx, mpz_t r, const mpz_t b, mp_bitcnt_t nsq) {
+    mp_limb_t* const xp = ctx->xp;
+
+    specialLoad(ctx, xp, b);
+    for (; nsq; --nsq) specialSqr(ctx, xp, xp);
+    specialStore(ctx, r, xp);
+}
+
+void specialPowmPlan(struct specialMod* ctx, mpz_t r, const mpz_t b, const struct expPlan* plan) {
+    const mp_size_t n = ctx->n;
+    const int nentries = plan->nentries;
+    mp_limb_t* const xp = ctx->xp;
+    mp_limb_t *table, *b2;
+    mp_bitcnt_t s;
+
+    if (plan->nwindows == 0) {
+	mpz_set_ui(r, 1);
+	return;
+    }
+
+    // table[i] = b^(2i+1), followed by b^2
+    if (ctx->tableSize < nentries + 1) {
+	free(ctx->table);
+	ctx->table = malloc((nentries + 1)*n*sizeof(mp_limb_t));
+	ctx->tableSize = ctx->table ? nentries + 1 : 0;
+	if (!ctx->table) { // fall back to GMP
+	    mpz_t p;
+	    mpz_powm(r, b, plan->e, mpz_roinit_n(p, ctx->mp, n));
+	    return;
+	}
+    }
+    table = ctx->table;
+    b2 = table + nentries*n;
+
+    specialLoad(ctx, table, b);
+    specialSqr(ctx, b2, table);
+    for (long i = 1; i < nentries; ++i) specialMul(ctx, table + i*n, table + (i-1)*n, b2);
+
+    mpn_copyi(xp, table + plan->idx[0]*n, n);
+    for (long i = 1; i < plan->nwindows; ++i) {
+	for (s = plan->nsq[i]; s; --s) specialSqr(ctx, xp, xp);
+	specialMul(ctx, xp, xp, table + plan->idx[i]*n);
+    }
+    for (s = plan->tail; s; --s) specialSqr(ctx, xp, xp);
+
+    specialStore(ctx, r, xp);
+}
+
+void specialPowm(struct specialMod* ctx, mpz_t r, const mpz_t b, const mpz_t e) {
+    struct expPlan plan;
+
+    if (expPlanInit(&plan, e) != 0) { // fall back to GMP
+	mpz_t p;
+	mpz_powm(r, b, e, mpz_roinit_n(p, ctx->mp, ctx->n));
+	return;
+    }
+    specialPowmPlan(ctx, r, b, &plan);
+    expPlanClear(&plan);
+}
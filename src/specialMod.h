@@ -0,0 +1,45 @@
+#ifndef SPECIAL_MOD_H
+#define SPECIAL_MOD_H
+
+#include <gmp.h>
+
+#include "expPlan.h"
+
+// Arithmetic modulo primes p = k 2^e - 1 with k < 2^64, as our fixed safe primes.
+// As k 2^e = 1 mod p, writing x = H 2^e + L and H = Q k + r gives
+//    x = Q + r 2^e + L mod p
+// so a reduction is a shift, a division by the single limb k and two additions, all linear in the size of p,
+// rather than a Montgomery REDC which costs as much as a multiplication.
+// The scratch space makes a context usable by one thread at a time.
+
+struct specialMod {
+    mp_size_t n; // limbs of p
+    mp_bitcnt_t e; // p = k 2^e - 1
+    mp_limb_t k;
+    mp_limb_t* mp; // p
+    mp_limb_t* xp; // n limbs holding the running value
+    mp_limb_t* tp; // 2n limbs for products
+    mp_limb_t* hp; // n+1 limbs for H and then Q
+    mp_limb_t* table; // precomputed powers for specialPowm, allocated on first use
+    int tableSize;
+    void* memory;
+};
+
+// returns 0 on success, 1 if p is not of the form k 2^e - 1 with k < 2^64 and 2^e > k
+int specialInit(struct specialMod* ctx, const mpz_t p);
+
+void specialClear(struct specialMod* ctx);
+
+// rp = tp mod p, with tp < p^2 of 2n limbs (destroyed) and rp < p of n limbs
+void specialReduce(struct specialMod* ctx, mp_ptr rp, mp_ptr tp);
+
+// r = b^(2^nsq) mod p
+void specialSqrChain(struct specialMod* ctx, mpz_t r, const mpz_t b, const mp_bitcnt_t nsq);
+
+// r = b^e mod p, with the sliding windows of plan, which can be reused for any base
+void specialPowmPlan(struct specialMod* ctx, mpz_t r, const mpz_t b, const struct expPlan* plan);
+
+// r = b^e mod p, recoding e for this call only
+void specialPowm(struct specialMod* ctx, mpz_t r, const mpz_t b, const mpz_t e);
+
+#endif
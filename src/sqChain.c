@@ -0,0 +1,196 @@
+#include "sqChain.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // fsync
+
+#include "timing.h"
+
+#define CHECKPOINT_MAGIC 0x31544b4350534c54ull // "TLSPCKT1" in little endian
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+// header of a checkpoint, followed by nlimbs limbs and the checksum of everything before it
+struct checkpointHeader {
+    uint64_t magic;
+    uint64_t modulusId;
+    uint64_t iteration;
+    uint64_t total;
+    uint64_t nlimbs;
+};
+
+// FNV-1a, enough to tell moduli and corrupted files apart
+static uint64_t fnv(uint64_t h, const void* data, const size_t len) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < len; ++i) {
+	h ^= bytes[i];
+	h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static uint64_t modulusId(const mpz_t q) {
+    return fnv(FNV_OFFSET, mpz_limbs_read(q), mpz_size(q)*sizeof(mp_limb_t));
+}
+
+int sqChainInit(struct sqChain* chain, const mpz_t q, const mpz_t x0, const uint64_t total) {
+    memset(chain, 0, sizeof(*chain));
+    if (mpz_cmp_ui(q, 1) <= 0) return 1;
+
+    mpz_init_set(chain->q, q);
+    mpz_init(chain->x);
+    mpz_mod(chain->x, x0, q);
+    chain->modulusId = modulusId(q);
+    chain->total = total;
+
+    chain->isSpecial = specialInit(&chain->special, q) == 0;
+    if (!chain->isSpecial) chain->isMont = montInit(&chain->mont, q) == 0;
+
+    return 0;
+}
+
+void sqChainClear(struct sqChain* chain) {
+    if (chain->isSpecial) specialClear(&chain->special);
+    if (chain->isMont) montClear(&chain->mont);
+    mpz_clears(chain->q, chain->x, NULL);
+    memset(chain, 0, sizeof(*chain));
+}
+
+uint64_t sqChainAdvance(struct sqChain* chain, uint64_t nsq) {
+    const double start = wallTime();
+    double elapsed;
+
+    if (nsq > chain->total - chain->iteration) nsq = chain->total - chain->iteration;
+    if (nsq == 0) return 0;
+
+    // the kernels convert in and out of their representation once per chunk, which is negligible
+    if (chain->isSpecial) specialSqrChain(&chain->special, chain->x, chain->x, nsq);
+    else if (chain->isMont) montSqrChain(&chain->mont, chain->x, chain->x, nsq);
+    else {
+	for (uint64_t i = 0; i < nsq; ++i) {
+	    mpz_mul(chain->x, chain->x, chain->x);
+	    mpz_tdiv_r(chain->x, chain->x, chain->q);
+	}
+    }
+
+    chain->iteration += nsq;
+    elapsed = wallTime() - start;
+    chain->squaringSeconds += elapsed;
+    chain->rate = elapsed > 0 ? nsq/elapsed : 0;
+    return nsq;
+}
+
+int sqChainSave(struct sqChain* chain, const char* path) {
+    const double start = wallTime();
+    const size_t pathLen = strlen(path);
+    struct checkpointHeader header = { CHECKPOINT_MAGIC, chain->modulusId, chain->iteration, chain->total, mpz_size(chain->x) };
+    uint64_t checksum;
+    char* tmpPath;
+    FILE* f;
+    int err = 0;
+
+    tmpPath = malloc(pathLen + 5);
+    if (!tmpPath) return 1;
+    memcpy(tmpPath, path, pathLen);
+    memcpy(tmpPath + pathLen, ".tmp", 5);
+
+    checksum = fnv(FNV_OFFSET, &header, sizeof(header));
+    checksum = fnv(checksum, mpz_limbs_read(chain->x), header.nlimbs*sizeof(mp_limb_t));
+
+    f = fopen(tmpPath, "wb");
+    if (!f) {
+	fprintf(stderr, "ERROR cannot open the checkpoint %s\n", tmpPath);
+	free(tmpPath);
+	return 1;
+    }
+    if (fwrite(&header, sizeof(header), 1, f) != 1
+	|| fwrite(mpz_limbs_read(chain->x), sizeof(mp_limb_t), header.nlimbs, f) != header.nlimbs
+	|| fwrite(&checksum, sizeof(checksum), 1, f) != 1
+	|| fflush(f) != 0
+	|| fsync(fileno(f)) != 0) err = 1;
+    if (fclose(f) != 0) err = 1;
+
+    // the old checkpoint is replaced only by a complete new one
+    if (!err && rename(tmpPath, path) != 0) err = 1;
+    if (err) fprintf(stderr, "ERROR writing the checkpoint %s\n", path);
+
+    free(tmpPath);
+    chain->checkpointSeconds += wallTime() - start;
+    ++chain->checkpoints;
+    return err;
+}
+
+int sqChainLoad(struct sqChain* chain, const mpz_t q, const char* path) {
+    struct checkpointHeader header;
+    uint64_t checksum, expected;
+    mp_limb_t* xp;
+    FILE* f;
+
+    memset(chain, 0, sizeof(*chain));
+
+    f = fopen(path, "rb");
+    if (!f) {
+	fprintf(stderr, "ERROR cannot open the checkpoint %s\n", path);
+	return 1;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != CHECKPOINT_MAGIC) {
+	fprintf(stderr, "ERROR %s is not a checkpoint\n", path);
+	fclose(f);
+	return 1;
+    }
+    if (header.modulusId != modulusId(q) || header.nlimbs > mpz_size(q) || header.iteration > header.total) {
+	fprintf(stderr, "ERROR the checkpoint %s is for another modulus\n", path);
+	fclose(f);
+	return 1;
+    }
+
+    xp = malloc((header.nlimbs + 1)*sizeof(mp_limb_t));
+    if (!xp || fread(xp, sizeof(mp_limb_t), header.nlimbs, f) != header.nlimbs || fread(&checksum, sizeof(checksum), 1, f) != 1) {
+	fprintf(stderr, "ERROR reading the checkpoint %s\n", path);
+	free(xp);
+	fclose(f);
+	return 1;
+    }
+    fclose(f);
+
+    expected = fnv(FNV_OFFSET, &header, sizeof(header));
+    expected = fnv(expected, xp, header.nlimbs*sizeof(mp_limb_t));
+    if (checksum != expected) {
+	fprintf(stderr, "ERROR the checkpoint %s is corrupted\n", path);
+	free(xp);
+	return 1;
+    }
+
+    if (sqChainInit(chain, q, q, header.total) != 0) { // x is set below
+	free(xp);
+	return 1;
+    }
+    mpn_copyi(mpz_limbs_write(chain->x, header.nlimbs + 1), xp, header.nlimbs);
+    mpz_limbs_finish(chain->x, header.nlimbs);
+    chain->iteration = header.iteration;
+
+    free(xp);
+    return 0;
+}
+
+int sqChainRun(struct sqChain* chain, const uint64_t until, const uint64_t chunk, const char* path, const double ckptSeconds, FILE* progress) {
+    const uint64_t end = until < chain->total ? until : chain->total;
+    double lastCheckpoint = wallTime();
+
+    while (chain->iteration < end) {
+	const uint64_t left = end - chain->iteration;
+	sqChainAdvance(chain, chunk && chunk < left ? chunk : left);
+
+	if (chain->iteration < end && wallTime() - lastCheckpoint < ckptSeconds) continue;
+
+	if (path && sqChainSave(chain, path) != 0) return 1;
+	lastCheckpoint = wallTime();
+	if (progress) {
+	    fprintf(progress, "Squaring %lu of %lu (%.2f%%) at %.0f squarings/s\n", (unsigned long) chain->iteration,
+		    (unsigned long) chain->total, 100.0*chain->iteration/chain->total, chain->rate);
+	    fflush(progress);
+	}
+    }
+
+    return 0;
+}
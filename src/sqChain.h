@@ -0,0 +1,56 @@
+#ifndef SQ_CHAIN_H
+#define SQ_CHAIN_H
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "montgomery.h"
+#include "specialMod.h"
+
+// A squaring chain x^(2^total) mod q solved a chunk at a time, so that a solver can report its progress
+// and save its state to disk to resume after a crash.
+// The checkpoint is the modulus id (a hash of q), the iteration, the total and the residue limbs, followed by a
+// checksum. It is written to a temporary file, synced and renamed, so an interrupted write leaves the previous
+// checkpoint in place.
+// Chunks run on the reduction of specialMod for q = k2^e-1, on a Montgomery context for other odd q and
+// with plain mpz arithmetic for even q.
+
+// default time between checkpoints: a checkpoint is one write and an fsync of a few kB, milliseconds at worst,
+// so one a minute keeps their cost far below 1% of the solve
+#define SQ_CHAIN_CHECKPOINT_SECONDS 60.0
+
+struct sqChain {
+    mpz_t q;
+    mpz_t x; // x0^(2^iteration) mod q
+    uint64_t modulusId;
+    uint64_t iteration, total;
+    bool isSpecial, isMont;
+    struct specialMod special;
+    struct montCtx mont;
+    double rate; // squarings per second in the last chunk
+    double squaringSeconds, checkpointSeconds; // time spent in chunks and in checkpoints
+    unsigned long checkpoints;
+};
+
+// start the chain x0^(2^total) mod q from iteration 0; returns 0 on success
+int sqChainInit(struct sqChain* chain, const mpz_t q, const mpz_t x0, const uint64_t total);
+
+// start the chain from the checkpoint in path, which must have been written for the same q; returns 0 on success
+int sqChainLoad(struct sqChain* chain, const mpz_t q, const char* path);
+
+void sqChainClear(struct sqChain* chain);
+
+// advance the chain by nsq squarings, or fewer if it would go past total; returns the squarings done
+uint64_t sqChainAdvance(struct sqChain* chain, const uint64_t nsq);
+
+// write a checkpoint to path; returns 0 on success
+int sqChainSave(struct sqChain* chain, const char* path);
+
+// advance the chain to iteration until in chunks of chunk squarings
+// a checkpoint is written to path (if not NULL) every ckptSeconds seconds and at the end, and a progress
+// line is written to progress (if not NULL) with every checkpoint; returns 0 on success
+int sqChainRun(struct sqChain* chain, const uint64_t until, const uint64_t chunk, const char* path, const double ckptSeconds, FILE* progress);
+
+#endif
@@ -15,24 +15,57 @@
 #include "rand.h"
 #include "constructPrimes.h"
 #include "hash.h"
+#include "factory.h"
+#include "montgomery.h"
+#include "batch.h"
+#include "cube.h"
+#include "specialMod.h"
+#include "trapdoor.h"
+#include "parSqr.h"
+#include "sqChain.h"
+#include "wesolowski.h"
+#include "scheduler.h"
 
 
 #define TIMER_INIT(name, iters)  \
-    clock_t start_ ## name, end_ ## name; \
     unsigned long* const allTime_ ## name = (unsigned long*) malloc(iters*sizeof(unsigned long)); \
     double avgTime_ ## name, stdTime_ ## name; \
     const unsigned long nIters_ ## name = iters; \
     unsigned long current_iter_ ## name = 0l;
 
 #define TIMER_TIME(name, work, fp) { \
-    start_ ## name = clock();\
+    const clock_t start_ ## name = clock();\
     work; \
-    end_ ## name = clock();\
+    const clock_t end_ ## name = clock();\
     assert(current_iter_ ## name < nIters_ ## name); \
     allTime_ ## name[current_iter_ ## name] = end_ ## name - start_ ## name; \
     fprintf(fp, #name " took %.3fms\n", allTime_ ## name[current_iter_ ## name]/(double)CLOCKS_PER_SEC*1000.0); \
     ++current_iter_ ## name;}
 
+// as TIMER_TIME but measuring wall-clock time, for work spread over several threads or waiting on them
+// (clock() adds up the time of all threads); the elapsed time is stored in clock ticks as well
+#define TIMER_TIME_WALL(name, work, fp) { \
+    struct timespec wallStart_ ## name, wallEnd_ ## name; \
+    clock_gettime(CLOCK_MONOTONIC, &wallStart_ ## name); \
+    work; \
+    clock_gettime(CLOCK_MONOTONIC, &wallEnd_ ## name); \
+    assert(current_iter_ ## name < nIters_ ## name); \
+    allTime_ ## name[current_iter_ ## name] = ((wallEnd_ ## name.tv_sec - wallStart_ ## name.tv_sec)*1e9 + (wallEnd_ ## name.tv_nsec - wallStart_ ## name.tv_nsec)) * (CLOCKS_PER_SEC/1e9); \
+    fprintf(fp, #name " took %.3fms (wall-clock)\n", allTime_ ## name[current_iter_ ## name]/(double)CLOCKS_PER_SEC*1000.0); \
+    ++current_iter_ ## name;}
+
+// as TIMER_TIME but measuring the CPU time of the calling thread only, so that threads running in the background,
+// such as the workers of a modulus factory, are not counted
+#define TIMER_TIME_THREAD(name, work, fp) { \
+    struct timespec threadStart_ ## name, threadEnd_ ## name; \
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &threadStart_ ## name); \
+    work; \
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &threadEnd_ ## name); \
+    assert(current_iter_ ## name < nIters_ ## name); \
+    allTime_ ## name[current_iter_ ## name] = ((threadEnd_ ## name.tv_sec - threadStart_ ## name.tv_sec)*1e9 + (threadEnd_ ## name.tv_nsec - threadStart_ ## name.tv_nsec)) * (CLOCKS_PER_SEC/1e9); \
+    fprintf(fp, #name " took %.3fms\n", allTime_ ## name[current_iter_ ## name]/(double)CLOCKS_PER_SEC*1000.0); \
+    ++current_iter_ ## name;}
+
 #define TIMER_REPORT(name, fp) { \
     avgTime_ ## name = 0.0; \
     for (size_t i =0; i < nIters_ ## name; ++i) avgTime_ ## name += allTime_ ## name[i]; \
@@ -44,6 +77,40 @@
     fprintf(fp, "mean and std " #name " time %.9fms (%.9fms)\n", avgTime_ ## name/(double)CLOCKS_PER_SEC*1000.0, stdTime_ ## name/(double)CLOCKS_PER_SEC*1000.0); \
     free(allTime_ ## name); }
 
+// the time below which 99% of the iterations took, before the mean and std of TIMER_REPORT
+#define TIMER_REPORT_P99(name, fp) { \
+    qsort(allTime_ ## name, nIters_ ## name, sizeof(unsigned long), compareTicks); \
+    fprintf(fp, "p99 " #name " time %.9fms\n", allTime_ ## name[(99*nIters_ ## name + 99)/100 - 1]/(double)CLOCKS_PER_SEC*1000.0); \
+    TIMER_REPORT(name, fp); }
+
+// number of moduli the factory keeps ready in testTimesEnc
+#define FACTORY_CAPACITY 16
+
+// short squaring chains issued repeatedly with the same modulus in testTimesSq
+#define SHORT_CHAINS 1000
+#define SHORT_CHAIN_LENGTH 64
+
+// the chunked chain is cut in this many chunks, with a checkpoint after each and a resume halfway
+#define CHAIN_CHUNKS 16
+#define CHAIN_CHECKPOINT "sqChain.ckpt"
+
+// the CTR session is checked against a contiguous keystream with moduli of this size, 255 bytes, so that its
+// batches of CIPHER_SESSION_BATCH attempts start within blocks, and with its keystream split across threads
+#define CTR_CHECK_BITS 2040
+#define CTR_CHECK_MESSAGES 256
+#define CTR_CHECK_THREADS 2
+
+// elements hashed at once in testTimesHash
+#define HASH_BATCH_SIZE 256
+
+// jobs of testTimesJobs checked again with mpz_powm
+#define SCHED_CHECKED_JOBS 4
+
+
+static int compareTicks(const void* a, const void* b) {
+    const unsigned long x = *(const unsigned long*) a, y = *(const unsigned long*) b;
+    return (x > y) - (x < y);
+}
 
 // little helper to write a line of equal sings
 void writelineSep(FILE * const fileptr) {
@@ -73,7 +140,7 @@ void testModuloConstruction(const unsigned long N, const unsigned int nprimes, c
 	fprintf(fileptr, "We are constructing moduli m2^k and p^k with different securities\n");
     }
 
-    loadPrimesDB();
+    if (nprimes && getPrimeSource() == PRIMES_FROM_DB) loadPrimesDB();
 
     for (int i=0; i < nIters; ++i){
 	if (nprimes) TIMER_TIME(mPower, constructmPower(q, NULL, nprimes, N), fileptr);
@@ -93,7 +160,11 @@ void testModuloConstruction(const unsigned long N, const unsigned int nprimes, c
 // picks a random message m, computes m^3 mod p and then (m^3)^b mod p
 // prints out the time taken and stores the time as well
 // repeate for nIters and outputs means and std
-void testTimesSq(mpz_t p, const mpz_t b, const unsigned long N, const int nIters, FILE * const fileptr) {
+void testTimesSq(struct modulus* mod, const int nThreads, const int nIters, FILE * const fileptr) {
+
+    mpz_ptr p = mod->q;
+    mpz_srcptr b = mod->b;
+    const unsigned long N = mpz_sizeinbase(p, 2);
 
     writeTimestamp(fileptr);
     writeTimestamp(stdout);
@@ -101,11 +172,41 @@ void testTimesSq(mpz_t p, const mpz_t b, const unsigned long N, const int nIters
 
     // variable for timing
     TIMER_INIT(Cubing, nIters);
+    TIMER_INIT(CubingPlain, nIters);
+    TIMER_INIT(CubingCtx, nIters);
     TIMER_INIT(CubeRoot, nIters);
     TIMER_INIT(FastSqGMP, nIters);
+    TIMER_INIT(CtxSetup, 1);
+    TIMER_INIT(FastSqCtx, nIters);
+    TIMER_INIT(CubeRootCtx, nIters);
+    TIMER_INIT(PlanSetup, 1);
+    TIMER_INIT(CubeRootPlan, nIters);
+    TIMER_INIT(ShortChainsGMP, nIters);
+    TIMER_INIT(ShortChainsCtx, nIters);
+    TIMER_INIT(FastSqSpecial, nIters);
+    TIMER_INIT(ParSetup, 1);
+    TIMER_INIT(FastSqPar, nIters);
+    TIMER_INIT(ChunkedChain, nIters);
+    TIMER_INIT(CubeRootSpecial, nIters);
+    TIMER_INIT(TrapdoorSetup, 1);
+    TIMER_INIT(CubeRootCRT, nIters);
+    TIMER_INIT(CubeRootHensel, nIters);
+    TIMER_INIT(CubeRootGarner, nIters);
 
     // variables for the computation
-    mpz_t m, m2, c;
+    mpz_t m, m2, m3, c;
+    struct montCtx ctx;
+    struct specialMod special;
+    bool isSpecial, hasCtx;
+    struct trapdoor td;
+    struct expPlan plan;
+    bool hasPlan;
+    struct parSqr par;
+    bool hasPar = false;
+    bool hasTrapdoor;
+    struct sqChain chain;
+    double chainSeconds = 0, checkpointSeconds = 0;
+    unsigned long checkpoints = 0;
     const size_t nlimbs = mpz_size(p);
     mp_limb_t *mptr, *tptr;
     const mp_limb_t *cptr, *pptr;
@@ -115,6 +216,34 @@ void testTimesSq(mpz_t p, const mpz_t b, const unsigned long N, const int nIters
     mpz_init2(m, N+1);
     mpz_init2(m2, N+1);
     mpz_init2(c, N+1);
+    mpz_init2(m3, N+1);
+
+    // the Montgomery context is set up once for all the computations below, m2^k moduli are even and have none
+    TIMER_TIME(CtxSetup, hasCtx = montInit(&ctx, p) == 0, fileptr);
+
+    // primes k2^e-1 get a reduction with shifts and a division by k
+    isSpecial = specialInit(&special, p) == 0;
+    if (isSpecial) fprintf(fileptr, "The modulus is %lu*2^%lu - 1\n", (unsigned long) special.k, (unsigned long) special.e);
+    else fprintf(fileptr, "The modulus is not of the form k*2^e - 1 with a small k\n");
+
+    // m2^k, p^k and p p2 moduli take cube roots through their factorization
+    TIMER_TIME(TrapdoorSetup, hasTrapdoor = trapdoorInit(&td, mod) == 0, fileptr);
+    if (hasTrapdoor && td.type == MODULUS_M_POWER)
+	fprintf(fileptr, "Cube roots through the factorization in %d primes and 2^%lu\n", td.nprimes, (unsigned long) td.k);
+    else if (hasTrapdoor && td.type == MODULUS_PRIME_POWER)
+	fprintf(fileptr, "Cube roots mod p lifted to p^%lu in %d Newton steps\n", (unsigned long) td.k, td.nlifts);
+    else if (hasTrapdoor)
+	fprintf(fileptr, "Cube roots mod two safe primes of %lu and %lu bits\n", mpz_sizeinbase(td.p, 2), mpz_sizeinbase(td.p2, 2));
+
+    // b is recoded once for all the cube roots below
+    TIMER_TIME(PlanSetup, hasPlan = expPlanInit(&plan, b) == 0, fileptr);
+    if (hasPlan) fprintf(fileptr, "Exponent plan with windows of %d bits: %ld windows\n", plan.w, plan.nwindows);
+
+    // each squaring of the chain split across nThreads threads
+    if (nThreads > 1) {
+	TIMER_TIME(ParSetup, hasPar = parSqrInit(&par, p, nThreads) == 0, fileptr);
+	if (hasPar) fprintf(fileptr, "Parallel squaring on %d threads with the %s reduction\n", nThreads, par.isSpecial ? "special" : "Montgomery");
+    }
 
     const unsigned long nSquarings = mpz_sizeinbase(b, 2) - 1l;
     fprintf(fileptr, "Number of squarings: %lu\n", nSquarings);
@@ -130,7 +259,7 @@ void testTimesSq(mpz_t p, const mpz_t b, const unsigned long N, const int nIters
 
     for (int i=0; i < nIters; ++i){
 
-	randomMessage(m, p);
+	randomUnit(m, mod);
 
 	// quick tests
 	// m in Z^*_p
@@ -142,6 +271,18 @@ void testTimesSq(mpz_t p, const mpz_t b, const unsigned long N, const int nIters
 	// encryption
 	TIMER_TIME(Cubing, mpz_powm_ui(c, m, 3l, p), fileptr);
 
+	// the same with the dedicated functions
+	TIMER_TIME(CubingPlain, cube(m2, m, p), fileptr);
+	if (hasCtx) {
+	    montToMont(&ctx, ctx.xp, m); // messages kept in Montgomery form
+	    TIMER_TIME(CubingCtx, montCube(&ctx, ctx.xp, ctx.xp), fileptr);
+	    montFromMont(&ctx, m3, ctx.xp);
+	} else mpz_set(m3, m2);
+	if (mpz_cmp(m2, c) != 0 || mpz_cmp(m3, c) != 0) {
+	    fprintf(fileptr, "ERROR: cube is wrong!!!!\n");
+	    fprintf(stderr, "ERROR: cube failed\n");
+	}
+
         // decryption
 	TIMER_TIME(CubeRoot, mpz_powm(m2, c, b, p), fileptr);
 
@@ -151,52 +292,529 @@ void testTimesSq(mpz_t p, const mpz_t b, const unsigned long N, const int nIters
 	    fprintf(stderr, "ERROR: cube root failed\n");
         }
 
+	if (hasCtx) {
+	    TIMER_TIME(CubeRootCtx, montPowm(&ctx, m3, c, b), fileptr);
+	    if (mpz_cmp(m3, m2) != 0) {
+		fprintf(fileptr, "ERROR: cube root with the Montgomery context is wrong!!!!\n");
+		fprintf(stderr, "ERROR: cube root with the Montgomery context failed\n");
+	    }
+	}
+
+	if (hasCtx && hasPlan) {
+	    TIMER_TIME(CubeRootPlan, montPowmPlan(&ctx, m3, c, &plan), fileptr);
+	    if (mpz_cmp(m3, m2) != 0) {
+		fprintf(fileptr, "ERROR: cube root with the exponent plan is wrong!!!!\n");
+		fprintf(stderr, "ERROR: cube root with the exponent plan failed\n");
+	    }
+	}
+
+	if (hasTrapdoor) {
+	    if (td.type == MODULUS_M_POWER) {
+		TIMER_TIME(CubeRootCRT, trapdoorCubeRoot(&td, m3, c), fileptr);
+	    } else if (td.type == MODULUS_PRIME_POWER) {
+		TIMER_TIME(CubeRootHensel, trapdoorCubeRoot(&td, m3, c), fileptr);
+	    } else {
+		TIMER_TIME(CubeRootGarner, trapdoorCubeRoot(&td, m3, c), fileptr);
+	    }
+	    if (mpz_cmp(m3, m2) != 0) {
+		fprintf(fileptr, "ERROR: cube root with the trapdoor is wrong!!!!\n");
+		fprintf(stderr, "ERROR: cube root with the trapdoor failed\n");
+	    }
+	}
+
 	// try using the mpn_powm_2exp
 	mptr = mpz_limbs_modify(m, nlimbs);
 	cptr = mpz_limbs_read(c);
 	pptr = mpz_limbs_read(p);
 	TIMER_TIME(FastSqGMP, mpn_powm_2exp(mptr, cptr, mpz_size(c), nSquarings, pptr, nlimbs, tptr), fileptr);
+	mpz_limbs_finish(m, nlimbs);
+
+	// the same chain reusing the context
+	if (hasCtx) {
+	    TIMER_TIME(FastSqCtx, montSqrChain(&ctx, m3, c, nSquarings), fileptr);
+	    if (mpz_cmp(m3, m) != 0) {
+		fprintf(fileptr, "ERROR: squaring chain with the Montgomery context is wrong!!!!\n");
+		fprintf(stderr, "ERROR: squaring chain with the Montgomery context failed\n");
+	    }
+	}
+
+	if (isSpecial) {
+	    TIMER_TIME(FastSqSpecial, specialSqrChain(&special, m3, c, nSquarings), fileptr);
+	    if (mpz_cmp(m3, m) != 0) {
+		fprintf(fileptr, "ERROR: squaring chain with the special reduction is wrong!!!!\n");
+		fprintf(stderr, "ERROR: squaring chain with the special reduction failed\n");
+	    }
+
+	    if (hasPlan) {
+		TIMER_TIME(CubeRootSpecial, specialPowmPlan(&special, m3, c, &plan), fileptr);
+	    } else {
+		TIMER_TIME(CubeRootSpecial, specialPowm(&special, m3, c, b), fileptr);
+	    }
+	    if (mpz_cmp(m3, m2) != 0) {
+		fprintf(fileptr, "ERROR: cube root with the special reduction is wrong!!!!\n");
+		fprintf(stderr, "ERROR: cube root with the special reduction failed\n");
+	    }
+	}
+
+	if (hasPar) {
+	    TIMER_TIME_WALL(FastSqPar, parSqrChain(&par, m3, c, nSquarings), fileptr);
+	    if (mpz_cmp(m3, m) != 0) {
+		fprintf(fileptr, "ERROR: parallel squaring chain is wrong!!!!\n");
+		fprintf(stderr, "ERROR: parallel squaring chain failed\n");
+	    }
+	}
+
+	// the chain a chunk at a time as a solver would run it, stopped and resumed from its checkpoint halfway
+	// there is a checkpoint after every chunk, far more often than a solver needs, to bound their cost
+	TIMER_TIME_WALL(ChunkedChain, {
+		if (sqChainInit(&chain, p, c, nSquarings) == 0) {
+		    sqChainRun(&chain, nSquarings/2, nSquarings/CHAIN_CHUNKS, CHAIN_CHECKPOINT, 0, NULL);
+		    chainSeconds += chain.squaringSeconds;
+		    checkpointSeconds += chain.checkpointSeconds;
+		    checkpoints += chain.checkpoints;
+		    sqChainClear(&chain);
+		}
+		if (sqChainLoad(&chain, p, CHAIN_CHECKPOINT) == 0) {
+		    sqChainRun(&chain, nSquarings, nSquarings/CHAIN_CHUNKS, CHAIN_CHECKPOINT, 0, NULL);
+		    chainSeconds += chain.squaringSeconds;
+		    checkpointSeconds += chain.checkpointSeconds;
+		    checkpoints += chain.checkpoints;
+		    mpz_set(m3, chain.x);
+		    sqChainClear(&chain);
+		} else mpz_set_ui(m3, 0);
+	    }, fileptr);
+	if (mpz_cmp(m3, m) != 0) {
+	    fprintf(fileptr, "ERROR: chunked squaring chain is wrong!!!!\n");
+	    fprintf(stderr, "ERROR: chunked squaring chain failed\n");
+	}
+
+	// many short chains, where the setup of mpn_powm_2exp is not negligible
+	TIMER_TIME(ShortChainsGMP,
+		   for (int j = 0; j < SHORT_CHAINS; ++j) mpn_powm_2exp(mptr, cptr, mpz_size(c), SHORT_CHAIN_LENGTH, pptr, nlimbs, tptr),
+		   fileptr);
+	if (hasCtx) TIMER_TIME(ShortChainsCtx, for (int j = 0; j < SHORT_CHAINS; ++j) montSqrChain(&ctx, m3, c, SHORT_CHAIN_LENGTH), fileptr);
 
     }// end for loop
 
 
     TIMER_REPORT(Cubing, fileptr);
+    TIMER_REPORT(CubingPlain, fileptr);
     TIMER_REPORT(CubeRoot, fileptr);
     TIMER_REPORT(FastSqGMP, fileptr);
+    TIMER_REPORT(CtxSetup, fileptr);
+    TIMER_REPORT(ShortChainsGMP, fileptr);
+    if (hasCtx) {
+	TIMER_REPORT(CubingCtx, fileptr);
+	TIMER_REPORT(FastSqCtx, fileptr);
+	TIMER_REPORT(CubeRootCtx, fileptr);
+	TIMER_REPORT(ShortChainsCtx, fileptr);
+    } else {
+	free(allTime_CubingCtx);
+	free(allTime_FastSqCtx);
+	free(allTime_CubeRootCtx);
+	free(allTime_ShortChainsCtx);
+    }
+    if (isSpecial) {
+	TIMER_REPORT(FastSqSpecial, fileptr);
+	TIMER_REPORT(CubeRootSpecial, fileptr);
+    } else {
+	free(allTime_FastSqSpecial);
+	free(allTime_CubeRootSpecial);
+    }
+    if (hasPar) {
+	TIMER_REPORT(ParSetup, fileptr);
+	TIMER_REPORT(FastSqPar, fileptr);
+    } else {
+	free(allTime_ParSetup);
+	free(allTime_FastSqPar);
+    }
+    TIMER_REPORT(ChunkedChain, fileptr);
+    if (checkpoints && chainSeconds > 0) {
+	fprintf(fileptr, "Chunked chain: %.0f squarings/s, %lu checkpoints of %.3fms, %.4f%% of a solve with one every %.0fs\n",
+		nIters*(double) nSquarings/chainSeconds, checkpoints, 1000*checkpointSeconds/checkpoints,
+		100*checkpointSeconds/checkpoints/SQ_CHAIN_CHECKPOINT_SECONDS, SQ_CHAIN_CHECKPOINT_SECONDS);
+    }
+    if (hasPlan) {
+	TIMER_REPORT(PlanSetup, fileptr);
+    } else free(allTime_PlanSetup);
+    if (hasCtx && hasPlan) {
+	TIMER_REPORT(CubeRootPlan, fileptr);
+    } else free(allTime_CubeRootPlan);
+    if (hasTrapdoor) {
+	TIMER_REPORT(TrapdoorSetup, fileptr);
+    } else free(allTime_TrapdoorSetup);
+    if (hasTrapdoor && td.type == MODULUS_M_POWER) {
+	TIMER_REPORT(CubeRootCRT, fileptr);
+    } else free(allTime_CubeRootCRT);
+    if (hasTrapdoor && td.type == MODULUS_PRIME_POWER) {
+	TIMER_REPORT(CubeRootHensel, fileptr);
+    } else free(allTime_CubeRootHensel);
+    if (hasTrapdoor && td.type == MODULUS_RSA) {
+	TIMER_REPORT(CubeRootGarner, fileptr);
+    } else free(allTime_CubeRootGarner);
     fprintf(fileptr, "Number of squarings: %lu\n", nSquarings);
+    fprintf(fileptr, "Short chains: %d chains of %d squarings\n", SHORT_CHAINS, SHORT_CHAIN_LENGTH);
     fprintf(fileptr, "Tested cubing using a prime of %lu bits\n", N);
 
     writelineSep(fileptr);
 
+    remove(CHAIN_CHECKPOINT);
     free(tptr);
-    mpz_clears(m, m2, c, NULL);
+    if (hasCtx) montClear(&ctx);
+    if (isSpecial) specialClear(&special);
+    if (hasTrapdoor) trapdoorClear(&td);
+    if (hasPlan) expPlanClear(&plan);
+    if (hasPar) parSqrClear(&par);
+    mpz_clears(m, m2, m3, c, NULL);
     clearRandomness();
 }
 
-void testTimesEnc(const size_t N, const unsigned int nprimes, const size_t secpar, const int nIters, FILE * const fileptr) {
+void testTimesBatch(const mpz_t p, const mpz_t b, const unsigned long N, const int batchSize, const int nIters, FILE * const fileptr) {
 
     writeTimestamp(fileptr);
     writeTimestamp(stdout);
+    fprintf(fileptr, "Testing batches of %d messages using a prime of %lu bits (%d lanes of %d-bit digits)\n",
+	    batchSize, N, BATCH_LANES, BATCH_DIGIT_BITS);
+
+    TIMER_INIT(CubingLoop, nIters);
+    TIMER_INIT(CubingBatch, nIters);
+    TIMER_INIT(CubeRootLoop, nIters);
+    TIMER_INIT(CubeRootBatch, nIters);
+
+    struct batchCtx ctx;
+    mpz_t *m, *c, *r;
+
+    m = (mpz_t*) malloc(batchSize*sizeof(mpz_t));
+    c = (mpz_t*) malloc(batchSize*sizeof(mpz_t));
+    r = (mpz_t*) malloc(batchSize*sizeof(mpz_t));
+    assert(m && c && r);
+    for (int j = 0; j < batchSize; ++j) mpz_inits(m[j], c[j], r[j], NULL);
+
+    if (batchInit(&ctx, p) != 0) {
+	fprintf(stderr, "Failed to initialise the batch context\n");
+	fprintf(fileptr, "Failed to initialise the batch context\n");
+	goto free;
+    }
+    fprintf(fileptr, "Using %s\n", ctx.lanes ? "SIMD lanes" : "a loop with a Montgomery context");
+
+    for (int i = 0; i < nIters; ++i) {
+	for (int j = 0; j < batchSize; ++j) randomMessage(m[j], p);
+
+	TIMER_TIME(CubingLoop, for (int j = 0; j < batchSize; ++j) mpz_powm_ui(c[j], m[j], 3l, p), fileptr);
+	TIMER_TIME(CubingBatch, batchCube(&ctx, r, m, batchSize), fileptr);
+	for (int j = 0; j < batchSize; ++j) {
+	    if (mpz_cmp(r[j], c[j]) != 0) {
+		fprintf(fileptr, "ERROR: batch cubing is wrong!!!!\n");
+		fprintf(stderr, "ERROR: batch cubing failed\n");
+		break;
+	    }
+	}
 
-    fprintf(fileptr, "Testing AES256-OFB encryption with a modulo of size %lu\n", N);
+	TIMER_TIME(CubeRootLoop, for (int j = 0; j < batchSize; ++j) mpz_powm(r[j], c[j], b, p), fileptr);
+	TIMER_TIME(CubeRootBatch, batchCubeRoot(&ctx, c, c, b, batchSize), fileptr);
+	for (int j = 0; j < batchSize; ++j) {
+	    if (mpz_cmp(c[j], m[j]) != 0 || mpz_cmp(r[j], m[j]) != 0) {
+		fprintf(fileptr, "ERROR: batch cube root is wrong!!!!\n");
+		fprintf(stderr, "ERROR: batch cube root failed\n");
+		break;
+	    }
+	}
+    }
 
-    mpz_t m, M;
+    TIMER_REPORT(CubingLoop, fileptr);
+    TIMER_REPORT(CubingBatch, fileptr);
+    TIMER_REPORT(CubeRootLoop, fileptr);
+    TIMER_REPORT(CubeRootBatch, fileptr);
+    fprintf(fileptr, "Tested batches of %d messages using a prime of %lu bits\n", batchSize, N);
 
-    TIMER_INIT(streamCipher, nIters);
+    writelineSep(fileptr);
+
+    batchClear(&ctx);
+ free:
+    for (int j = 0; j < batchSize; ++j) mpz_clears(m[j], c[j], r[j], NULL);
+    free(m);
+    free(c);
+    free(r);
+    clearRandomness();
+}
+
+void testTimesProof(const mpz_t p, const mpz_t b, const int nIters, FILE * const fileptr) {
+
+    const unsigned long N = mpz_sizeinbase(p, 2);
+    const uint64_t T = mpz_sizeinbase(b, 2) - 1;
+
+    writeTimestamp(fileptr);
+    writeTimestamp(stdout);
+    fprintf(fileptr, "Testing proofs of %lu squarings using a modulus of %lu bits\n", (unsigned long) T, N);
+
+    TIMER_INIT(ProofChain, nIters);
+    TIMER_INIT(Prove, nIters);
+    TIMER_INIT(Verify, nIters);
+
+    struct sqChain chain;
+    struct wesoStats stats = { 0 };
+    double chainSeconds = 0, proofSeconds = 0;
+    mpz_t x, y, y2, pi;
+    bool proved = false;
+
+    mpz_inits(x, y, y2, pi, NULL);
+
+    for (int i = 0; i < nIters; ++i) {
+	randomMessage(x, p);
+
+	// the chain alone, with the fastest kernel for p
+	TIMER_TIME_WALL(ProofChain, {
+		if (sqChainInit(&chain, p, x, T) == 0) {
+		    sqChainAdvance(&chain, T);
+		    mpz_set(y2, chain.x);
+		    sqChainClear(&chain);
+		}
+	    }, fileptr);
+
+	TIMER_TIME_WALL(Prove, proved = wesoProve(y, pi, p, x, T, &stats) == 0, fileptr);
+	if (!proved) break;
+	chainSeconds += stats.chainSeconds;
+	proofSeconds += stats.proofSeconds;
+	if (mpz_cmp(y, y2) != 0) {
+	    fprintf(fileptr, "ERROR: squaring chain of the prover is wrong!!!!\n");
+	    fprintf(stderr, "ERROR: squaring chain of the prover failed\n");
+	}
+
+	TIMER_TIME_WALL(Verify, proved = wesoVerify(p, x, y, T, pi) == 0, fileptr);
+	if (!proved) {
+	    fprintf(fileptr, "ERROR: proof is rejected!!!!\n");
+	    fprintf(stderr, "ERROR: proof verification failed\n");
+	}
 
-    mpz_inits(m, M, NULL);
+	// a wrong solution must be rejected
+	mpz_add_ui(y2, y, 1);
+	mpz_mod(y2, y2, p);
+	if (wesoVerify(p, x, y2, T, pi) == 0) {
+	    fprintf(fileptr, "ERROR: proof of a wrong solution is accepted!!!!\n");
+	    fprintf(stderr, "ERROR: proof of a wrong solution verified\n");
+	}
+    }
+
+    if (stats.nstored == 0) { // wesoProve never succeeded
+	fprintf(fileptr, "Proofs need an odd modulus\n");
+	free(allTime_ProofChain);
+	free(allTime_Prove);
+	free(allTime_Verify);
+    } else {
+	fprintf(fileptr, "Proof with x^(2^(jL)) stored every L = %lu squarings (%ld values) and %d-bit windows\n",
+		(unsigned long) stats.interval, stats.nstored, stats.w);
+	TIMER_REPORT(ProofChain, fileptr);
+	TIMER_REPORT(Prove, fileptr);
+	TIMER_REPORT(Verify, fileptr);
+	fprintf(fileptr, "Proof overhead: %.2f%% of the squarings, verification in %.3f%% of the time of the chain\n",
+		chainSeconds > 0 ? 100*proofSeconds/chainSeconds : 0.0, 100*avgTime_Verify/avgTime_ProofChain);
+    }
+    fprintf(fileptr, "Tested proofs using a modulus of %lu bits\n", N);
+
+    writelineSep(fileptr);
+
+    mpz_clears(x, y, y2, pi, NULL);
+    clearRandomness();
+}
+
+void testTimesJobs(const char* jobFile, const long njobs, const unsigned long N, const int nThreads, FILE * const fileptr) {
+
+    struct job* jobs = NULL;
+    struct schedStats stats;
+    long n = njobs;
+    mpz_t e, r;
+
+    writeTimestamp(fileptr);
+    writeTimestamp(stdout);
+    if (jobFile) {
+	fprintf(fileptr, "Testing the jobs of %s on %d threads\n", jobFile, nThreads);
+	n = readJobs(&jobs, jobFile);
+    } else {
+	fprintf(fileptr, "Testing %ld jobs on moduli of %lu bits on %d threads\n", njobs, N, nThreads);
+	if (generateJobs(&jobs, njobs, N, N) != 0) n = -1;
+    }
+    if (n <= 0) {
+	fprintf(fileptr, "No jobs to run\n");
+	free(jobs);
+	return;
+    }
 
-    if (0 != initialiseOpenSSL()){
+    if (schedRun(jobs, n, nThreads, SCHED_CHUNK, &stats) != 0) {
+	fprintf(fileptr, "Failed to run the jobs\n");
+    } else {
+	fprintf(fileptr, "Jobs took %.3fms (wall-clock) on %d threads\n", stats.seconds*1000, stats.nThreads);
+	fprintf(fileptr, "Puzzles per hour: %.0f\n", stats.puzzlesPerHour);
+	fprintf(fileptr, "Squarings per second per core: %.0f\n", stats.squaringsPerCore);
+	fprintf(fileptr, "Steals: %lu, chunks run after a migration: %lu\n", stats.steals, stats.migrations);
+
+	// the first jobs again with GMP
+	mpz_inits(e, r, NULL);
+	for (long j = 0; j < n && j < SCHED_CHECKED_JOBS; ++j) {
+	    if (jobs[j].type == JOB_SQUARE) {
+		mpz_set_ui(e, 0);
+		mpz_setbit(e, jobs[j].T);
+	    } else mpz_set(e, jobs[j].e);
+	    mpz_powm(r, jobs[j].x, e, jobs[j].N);
+	    if (mpz_cmp(r, jobs[j].result) != 0) {
+		fprintf(fileptr, "ERROR: job %ld is wrong!!!!\n", j);
+		fprintf(stderr, "ERROR: job %ld failed\n", j);
+	    }
+	}
+	mpz_clears(e, r, NULL);
+    }
+    fprintf(fileptr, "Tested %ld jobs\n", n);
+
+    writelineSep(fileptr);
+
+    for (long j = 0; j < n; ++j) jobClear(jobs + j);
+    free(jobs);
+    clearRandomness();
+}
+
+// encrypts CTR_CHECK_MESSAGES messages with a threaded CTR session and with cycle walking over one AES-256-CTR keystream
+// the modulus is just above a power of 2, so that a fair share of the messages need more than one batch, and the
+// counters of the IVs carry out of their low 64 bits within the first blocks
+// returns the number of encryptions that differ, -1 on failure
+static int checkCtrSession() {
+    const size_t nbytes = (CTR_CHECK_BITS + 7)/8;
+    const size_t streamBytes = 64*nbytes;
+    struct modulus mod;
+    struct cipherSession session;
+    EVP_CIPHER_CTX* ref = EVP_CIPHER_CTX_new();
+    uint8_t key[48], *stream = calloc(streamBytes, 1), *bytes = calloc(nbytes, 1);
+    mpz_t m, c, c2;
+    int outl, wrong = -1;
+
+    initModulus(&mod);
+    mod.type = MODULUS_SAFE_PRIME; // only q is used, and no unit test
+    mpz_set_ui(mod.q, 0);
+    mpz_setbit(mod.q, CTR_CHECK_BITS - 1);
+    mpz_add_ui(mod.q, mod.q, 1);
+    mpz_inits(m, c, c2, NULL);
+
+    if (!ref || !stream || !bytes || cipherSessionInit(&session, CIPHER_CTR, CIPHER_CYCLE_WALK, CTR_CHECK_THREADS) != 0) goto free;
+    if (cipherSessionSetModulus(&session, &mod) != 0) {
+	cipherSessionClear(&session);
+	goto free;
+    }
+
+    wrong = 0;
+    for (int i = 0; i < CTR_CHECK_MESSAGES; ++i) {
+	for (int j = 0; j < 6; ++j) {
+	    uint64_t t = xorshf64();
+	    memcpy(key + j*8, &t, 8);
+	}
+	// the IV is the first 16 bytes, a big endian counter whose low 64 bits overflow after i%256 + 1 blocks
+	memset(key + 8, 0xff, 7);
+	key[15] = 0xff - i%256;
+	randomMessage(m, mod.q);
+
+	if (cipherSessionSetKey(&session, key) != 0 || cipherSessionEncrypt(&session, c, m) != 0
+	    || 1 != EVP_EncryptInit_ex2(ref, EVP_aes_256_ctr(), key+16, key, NULL)
+	    || !EVP_EncryptUpdate(ref, stream, &outl, stream, streamBytes)) {
+	    wrong = -1;
+	    break;
+	}
+
+	// the attempts take consecutive nbytes of the keystream
+	memset(bytes, 0, nbytes);
+	mpz_export(bytes, NULL, -1, 1, -1, 0, m);
+	for (size_t pos = 0; pos + nbytes <= streamBytes; pos += nbytes) {
+	    for (size_t j = 0; j < nbytes; ++j) bytes[j] ^= stream[pos + j];
+	    bytes[nbytes-1] &= 0xff >> (nbytes*8 - CTR_CHECK_BITS);
+	    mpz_import(c2, nbytes, -1, 1, -1, 0, bytes);
+	    if (mpz_cmp(c2, mod.q) < 0) break;
+	}
+	if (mpz_cmp(c, c2) != 0) ++wrong;
+	memset(stream, 0, streamBytes);
+    }
+    cipherSessionClear(&session);
+
+ free:
+    mpz_clears(m, c, c2, NULL);
+    clearModulus(&mod);
+    EVP_CIPHER_CTX_free(ref);
+    free(stream);
+    free(bytes);
+    return wrong;
+}
+
+void testTimesEnc(const size_t N, const unsigned int nprimes, const size_t secpar, const int nWorkers, const int nThreads, const int nIters, FILE * const fileptr) {
+
+    writeTimestamp(fileptr);
+    writeTimestamp(stdout);
+
+    fprintf(fileptr, "Testing AES256-OFB and AES256-CTR encryption with a modulo of size %lu\n", N);
+
+    mpz_t m, c, c2, c3;
+    struct modulus local, *mod = &local;
+    struct modulusFactory factory;
+    struct factoryStats stats;
+    struct cipherSession session, ctr, ctrPar, wide;
+    bool hasSession = false, hasCtr = false, hasCtrPar = false, hasWide = false;
+    bool isUnit, isUnitFactored;
+    const enum modulusType type = nprimes ? MODULUS_M_POWER : MODULUS_PRIME_POWER;
+
+    TIMER_INIT(streamCipher, nIters);
+    TIMER_INIT(cipherSession, nIters);
+    TIMER_INIT(cipherSessionCTR, nIters);
+    TIMER_INIT(cipherSessionCTRPar, nIters);
+    TIMER_INIT(cipherSessionWide, nIters);
+    TIMER_INIT(getModulus, nIters);
+    TIMER_INIT(unitGcd, nIters);
+    TIMER_INIT(unitFactored, nIters);
+
+    mpz_inits(m, c, c2, c3, NULL);
+    initModulus(&local);
+
+    if (0 != initialiseOpenSSL() || !(hasSession = cipherSessionInit(&session, CIPHER_OFB, CIPHER_CYCLE_WALK, 1) == 0)
+	|| !(hasCtr = cipherSessionInit(&ctr, CIPHER_CTR, CIPHER_CYCLE_WALK, 1) == 0)){
 	fprintf(stderr, "Failed to initialise OpenSSL\n");
 	fprintf(fileptr, "Failed to initialise OpenSSL\n");
 	goto free;
     }
+    if (nThreads > 1) hasCtrPar = cipherSessionInit(&ctrPar, CIPHER_CTR, CIPHER_CYCLE_WALK, nThreads) == 0;
+    // the wide encoding does not give units modulo m2^k
+    if (type != MODULUS_M_POWER) hasWide = cipherSessionInit(&wide, CIPHER_CTR, CIPHER_WIDE, 1) == 0;
+
+    const int wrongCtr = checkCtrSession();
+    fprintf(fileptr, "CTR session on %d threads against a contiguous keystream with a modulo of %d bits: %d of %d encryptions wrong\n",
+	    CTR_CHECK_THREADS, CTR_CHECK_BITS, wrongCtr, CTR_CHECK_MESSAGES);
+    if (wrongCtr != 0) fprintf(stderr, "ERROR: the CTR session differs from a contiguous keystream\n");
+
+    // the moduli are constructed in the background, so that we only wait if the workers cannot keep up
+    if (nWorkers && 0 != startFactory(&factory, type, N, secpar, nprimes, FACTORY_CAPACITY, nWorkers)) {
+	fprintf(fileptr, "Failed to start the modulus factory\n");
+	goto free;
+    }
 
     for (int i = 0; i < nIters; ++i) {
-	if (nprimes) constructmPower(M, NULL, nprimes, N);
-	else constructPrimePower(M, NULL, secpar, N);
+	// the time we wait for a modulus, the rows below only count this thread so that the workers
+	// refilling the factory meanwhile are left out
+	if (nWorkers) {
+	    TIMER_TIME_WALL(getModulus, mod = waitModulus(&factory), fileptr);
+	} else {
+	    TIMER_TIME_WALL(getModulus, constructModulus(mod, type, N, secpar, nprimes), fileptr);
+	}
 
-	randomMessage(m, M);
+	randomUnit(m, mod);
+
+	// membership in ZZ^*_q of a random residue, with a gcd and with the factorization of the modulus
+	// every other residue of an m2^k modulus is made a multiple of one of its primes
+	mp_limb_t* cp = mpz_limbs_write(c, mpz_size(mod->q));
+	for (size_t j = 0; j < mpz_size(mod->q); ++j) cp[j] = xorshf64();
+	mpz_limbs_finish(c, mpz_size(mod->q));
+	if (mod->type == MODULUS_M_POWER && i % 2) mpz_mul_ui(c, c, mod->primes[(i/2) % mod->nprimes]);
+	mpz_mod(c, c, mod->q);
+	TIMER_TIME_THREAD(unitGcd, {
+		mpz_gcd(c2, c, mod->q);
+		isUnit = mpz_cmp_ui(c2, 1) == 0;
+	    }, fileptr);
+	TIMER_TIME_THREAD(unitFactored, isUnitFactored = isUnitModulo(mod, c), fileptr);
+	if (isUnit != isUnitFactored) {
+	    fprintf(fileptr, "ERROR: unit test with the factorization is wrong!!!!\n");
+	    fprintf(stderr, "ERROR: unit test with the factorization failed\n");
+	}
 
 	// construct random key of 256 bits (32 bytes or 4 64-bits words)
 	// and 128 bits of IV (so 48 bytes total)
@@ -206,35 +824,129 @@ void testTimesEnc(const size_t N, const unsigned int nprimes, const size_t secpa
 	    memcpy(key + i*8, &t, 8);
 	}
 
-	TIMER_TIME(streamCipher, streamCipher(m, m, M, key, nprimes != 0), fileptr);
+	TIMER_TIME_THREAD(streamCipher, streamCipher(c, m, mod->q, key, nprimes != 0), fileptr);
+
+	// the same encryption with a session kept across messages, only its key and modulus change
+	cipherSessionSetModulus(&session, mod);
+	TIMER_TIME_THREAD(cipherSession, {
+		cipherSessionSetKey(&session, key);
+		cipherSessionEncrypt(&session, c2, m);
+	    }, fileptr);
+	if (mpz_cmp(c, c2) != 0) {
+	    fprintf(fileptr, "ERROR: encryption of the cipher session is wrong!!!!\n");
+	    fprintf(stderr, "ERROR: encryption of the cipher session failed\n");
+	}
+
+	// CTR, on one thread and with the keystream split across nThreads threads
+	cipherSessionSetModulus(&ctr, mod);
+	TIMER_TIME_THREAD(cipherSessionCTR, {
+		cipherSessionSetKey(&ctr, key);
+		cipherSessionEncrypt(&ctr, c2, m);
+	    }, fileptr);
+	if (hasCtrPar) {
+	    cipherSessionSetModulus(&ctrPar, mod);
+	    TIMER_TIME_WALL(cipherSessionCTRPar, {
+		    cipherSessionSetKey(&ctrPar, key);
+		    cipherSessionEncrypt(&ctrPar, c3, m);
+		}, fileptr);
+	    if (mpz_cmp(c2, c3) != 0) {
+		fprintf(fileptr, "ERROR: encryption of the threaded CTR session is wrong!!!!\n");
+		fprintf(stderr, "ERROR: encryption of the threaded CTR session failed\n");
+	    }
+	}
+
+	// CTR without retries, m + (K mod M) mod M for a keystream K wider than M
+	if (hasWide) {
+	    cipherSessionSetModulus(&wide, mod);
+	    TIMER_TIME_THREAD(cipherSessionWide, {
+		    cipherSessionSetKey(&wide, key);
+		    cipherSessionEncrypt(&wide, c2, m);
+		}, fileptr);
+	    cipherSessionDecrypt(&wide, c3, c2);
+	    if (mpz_cmp(c2, mod->q) >= 0 || mpz_cmp(c3, m) != 0) {
+		fprintf(fileptr, "ERROR: wide encryption of the CTR session is wrong!!!!\n");
+		fprintf(stderr, "ERROR: wide encryption of the CTR session failed\n");
+	    }
+	}
 
+	if (nWorkers) recycleModulus(&factory, mod);
     }
 
+    TIMER_REPORT(getModulus, fileptr);
+    TIMER_REPORT(unitGcd, fileptr);
+    TIMER_REPORT(unitFactored, fileptr);
     TIMER_REPORT(streamCipher, fileptr);
+    TIMER_REPORT(cipherSession, fileptr);
+    TIMER_REPORT_P99(cipherSessionCTR, fileptr);
+    fprintf(fileptr, "Cycle walking CTR: %lu retries over %lu encryptions (%.3f per encryption)\n",
+	    ctr.attempts - ctr.calls, ctr.calls, ctr.calls ? (double) (ctr.attempts - ctr.calls)/ctr.calls : 0.0);
+    if (hasWide) {
+	TIMER_REPORT_P99(cipherSessionWide, fileptr);
+	fprintf(fileptr, "Wide CTR: %lu retries over %lu encryptions, %zu keystream bytes per encryption\n",
+		wide.attempts - wide.calls, wide.calls, (wide.nLimbs + CIPHER_WIDE_EXTRA_LIMBS)*sizeof(mp_limb_t));
+    } else {
+	free(allTime_cipherSessionWide);
+	fprintf(fileptr, "No wide encoding for m2^k moduli\n");
+    }
+    if (hasCtrPar) {
+	TIMER_REPORT(cipherSessionCTRPar, fileptr);
+	fprintf(fileptr, "Threaded CTR keystream on %d threads\n", nThreads);
+    } else free(allTime_cipherSessionCTRPar);
+    fprintf(fileptr, "Cipher session: %.3f cycle-walk attempts per encryption\n", session.calls ? (double) session.attempts/session.calls : 0.0);
+
+    if (nWorkers) {
+	getFactoryStats(&factory, &stats);
+	fprintf(fileptr, "Modulus factory with %d workers: %lu moduli constructed (%.3f per second), %zu ready at the end\n",
+		nWorkers, stats.produced, stats.refillRate, stats.depth);
+	stopFactory(&factory);
+    }
 
-    fprintf(fileptr, "Tested AES256-OFB encryption with a modulo of size %lu\n", N);
+    fprintf(fileptr, "Tested AES256-OFB and AES256-CTR encryption with a modulo of size %lu\n", N);
 
     writelineSep(fileptr);
  free:
-    mpz_clears(m, M, NULL);
+    if (hasSession) cipherSessionClear(&session);
+    if (hasCtr) cipherSessionClear(&ctr);
+    if (hasCtrPar) cipherSessionClear(&ctrPar);
+    if (hasWide) cipherSessionClear(&wide);
+    mpz_clears(m, c, c2, c3, NULL);
+    clearModulus(&local);
     clearRandomness();
     cleanOpenSSL();
 }
 
-void testTimesHash(const mpz_t M, const int nIters, FILE* const fileptr){
+void testTimesHash(const struct modulus* mod, const int nIters, FILE* const fileptr){
 
     writeTimestamp(fileptr);
     writeTimestamp(stdout);
 
+    const mpz_srcptr M = mod->q;
     fprintf(fileptr, "Testing hasing (SHA3-256) with modulo of size %lu\n", mpz_sizeinbase(M, 2));
 
-    mpz_t m;
-    uint8_t* digest;
+    mpz_t m, r, r2;
+    mpz_t* batch;
+    uint8_t *digest, *digests, *batchDigests, *encoding;
+    uint8_t canonical[HASH_DIGEST_BYTES];
+    const size_t nLimbs = mpz_size(M);
+    const size_t width = (mpz_sizeinbase(M, 2) + 7)/8;
+    size_t count;
 
     TIMER_INIT(hashing, nIters);
-
-    mpz_init(m);
+    TIMER_INIT(hashCanonical, nIters);
+    TIMER_INIT(hashToGroup, nIters);
+    TIMER_INIT(sampleLoop, nIters);
+    TIMER_INIT(sampleBulk, nIters);
+    TIMER_INIT(hashLoop, nIters);
+    TIMER_INIT(hashBatch, nIters);
+
+    mpz_inits(m, r, r2, NULL);
     digest = (uint8_t*) malloc(32); // digest is 32 bytes = 256 bits
+    batch = (mpz_t*) malloc(HASH_BATCH_SIZE*sizeof(mpz_t));
+    digests = (uint8_t*) malloc(2*HASH_BATCH_SIZE*HASH_DIGEST_BYTES);
+    batchDigests = digests + HASH_BATCH_SIZE*HASH_DIGEST_BYTES;
+    encoding = (uint8_t*) malloc(width);
+    assert(digest && batch && digests && encoding);
+    for (int j = 0; j < HASH_BATCH_SIZE; ++j) mpz_init(batch[j]);
 
     if (0 != initialiseHashing() ){
 	fprintf(stderr, "Error initialising OpenSSL\n");
@@ -246,16 +958,72 @@ void testTimesHash(const mpz_t M, const int nIters, FILE* const fileptr){
 	randomMessage(m, M);
 
 	TIMER_TIME(hashing, hash(digest, m), fileptr);
+
+	// the canonical encoding hashed from the limbs, against SHA3-256 of the exported bytes
+	TIMER_TIME(hashCanonical, hashCanonical(canonical, m, M), fileptr);
+	memset(encoding, 0, width);
+	mpz_export(encoding, &count, -1, 1, -1, 0, m);
+	EVP_Digest(encoding, width, digest, NULL, EVP_sha3_256(), NULL);
+	if (memcmp(canonical, digest, HASH_DIGEST_BYTES) != 0) {
+	    fprintf(fileptr, "ERROR: canonical hashing is wrong!!!!\n");
+	    fprintf(stderr, "ERROR: canonical hashing failed\n");
+	}
+
+	// hashing into the group twice must give the same element of ZZ^*_M
+	TIMER_TIME(hashToGroup, hashToGroup(r, m, mod), fileptr);
+	hashToGroup(r2, m, mod);
+	if (mpz_cmp(r, r2) != 0 || mpz_cmp(r, M) >= 0 || (mod->type == MODULUS_M_POWER && !isUnitModulo(mod, r))) {
+	    fprintf(fileptr, "ERROR: hashing to the group is wrong!!!!\n");
+	    fprintf(stderr, "ERROR: hashing to the group failed\n");
+	}
+
+	// HASH_BATCH_SIZE random units, sampled one at a time with a gcd and then in bulk,
+	// hashed one at a time and then at once
+	TIMER_TIME(sampleLoop, {
+		for (int j = 0; j < HASH_BATCH_SIZE; ++j) randomMessage(batch[j], M);
+	    }, fileptr);
+	TIMER_TIME(sampleBulk, randomUnits(batch, HASH_BATCH_SIZE, mod), fileptr);
+	for (int j = 0; j < HASH_BATCH_SIZE; ++j) {
+	    if (mpz_cmp(batch[j], M) >= 0 || !isUnitModulo(mod, batch[j])) {
+		fprintf(fileptr, "ERROR: bulk sampling is wrong!!!!\n");
+		fprintf(stderr, "ERROR: bulk sampling failed\n");
+		break;
+	    }
+	}
+	TIMER_TIME(hashLoop, {
+		for (int j = 0; j < HASH_BATCH_SIZE; ++j) hash(digests + j*HASH_DIGEST_BYTES, batch[j]);
+	    }, fileptr);
+	TIMER_TIME(hashBatch, hashBatch(batchDigests, batch, HASH_BATCH_SIZE), fileptr);
+	if (memcmp(digests, batchDigests, HASH_BATCH_SIZE*HASH_DIGEST_BYTES) != 0) {
+	    fprintf(fileptr, "ERROR: batch hashing is wrong!!!!\n");
+	    fprintf(stderr, "ERROR: batch hashing failed\n");
+	}
     }
 
     TIMER_REPORT(hashing, fileptr);
+    TIMER_REPORT(hashCanonical, fileptr);
+    TIMER_REPORT(hashToGroup, fileptr);
+    TIMER_REPORT(sampleLoop, fileptr);
+    TIMER_REPORT(sampleBulk, fileptr);
+    fprintf(fileptr, "Sampling batches of %d units: %.1fMB/s with randomMessage, %.1fMB/s in bulk\n", HASH_BATCH_SIZE,
+	    HASH_BATCH_SIZE*nLimbs*sizeof(mp_limb_t)*CLOCKS_PER_SEC/avgTime_sampleLoop/1e6,
+	    HASH_BATCH_SIZE*nLimbs*sizeof(mp_limb_t)*CLOCKS_PER_SEC/avgTime_sampleBulk/1e6);
+    TIMER_REPORT(hashLoop, fileptr);
+    TIMER_REPORT(hashBatch, fileptr);
+    fprintf(fileptr, "Batches of %d elements, %d at once: %.0f hashes per second one at a time, %.0f batched\n",
+	    HASH_BATCH_SIZE, HASH_WAYS, HASH_BATCH_SIZE*CLOCKS_PER_SEC/avgTime_hashLoop, HASH_BATCH_SIZE*CLOCKS_PER_SEC/avgTime_hashBatch);
 
     fprintf(fileptr, "Tested hasing (SHA3-256) with modulo of size %lu\n", mpz_sizeinbase(M, 2));
 
     writelineSep(fileptr);
 
  free:
-    mpz_clear(m);
+    mpz_clears(m, r, r2, NULL);
+    for (int j = 0; j < HASH_BATCH_SIZE; ++j) mpz_clear(batch[j]);
+    free(batch);
     free(digest);
+    free(encoding);
+    free(digests);
+    clearRandomness();
     cleanHashing();
 }
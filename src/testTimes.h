@@ -5,18 +5,37 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include "constructPrimes.h"
+
 void testModuloConstruction(const unsigned long N, const unsigned int nprimes, const unsigned long secpar, const int nIters, FILE* const fileptr);
 
-// picks a random message m, computes m^3 mod p and then (m^3)^b mod p
+// picks a random message m, computes m^3 mod p and then (m^3)^b mod p with p = mod->q and b = mod->b
 // prints out the time taken and stores the time as well
 // repeate for nIters and outputs means and std
-void testTimesSq(mpz_t p, const mpz_t b, const unsigned long N, const int nIters, FILE * const fileptr);
+// the factorization in mod is used for the cube roots through the trapdoor
+// if nThreads > 1, the squaring chain is also timed with every squaring split across nThreads threads
+void testTimesSq(struct modulus* mod, const int nThreads, const int nIters, FILE * const fileptr);
+
+// cubes and takes cube roots of batchSize random messages at once, comparing a loop over the messages
+// with the batched functions in batch.h
+void testTimesBatch(const mpz_t p, const mpz_t b, const unsigned long N, const int batchSize, const int nIters, FILE * const fileptr);
+
+// solves x^(2^T) mod p for random x and T the bits of b minus one, with a Wesolowski proof of the solution,
+// comparing the time of the chain alone, of the chain with the proof and of the verification
+void testTimesProof(const mpz_t p, const mpz_t b, const int nIters, FILE * const fileptr);
+
+// solves the jobs of jobFile, or njobs random jobs on moduli of N bits if jobFile is NULL, on nThreads threads
+// with work stealing and reports puzzles per hour and squarings per second per core
+void testTimesJobs(const char* jobFile, const long njobs, const unsigned long N, const int nThreads, FILE * const fileptr);
 
-// test stream cipher encryption AES256-OFB with cycle walking
+// test stream cipher encryption AES256-OFB with cycle walking, and the same with AES256-CTR
 // we generate new moduli at each iteration to avoid biases in the modulo
-void testTimesEnc(const size_t N, const unsigned int nprimes, const size_t secpar, const int nIters, FILE * const fileptr);
+// if nWorkers is non-zero, the moduli are taken from a modulus factory running nWorkers threads
+// if nThreads > 1, the CTR keystream is also split across nThreads threads
+void testTimesEnc(const size_t N, const unsigned int nprimes, const size_t secpar, const int nWorkers, const int nThreads, const int nIters, FILE * const fileptr);
 
-// test the times it takes to hash random messages modulo M
-void testTimesHash(const mpz_t M, const int nIters, FILE* const fileptr);
+// test the times it takes to hash random messages modulo M = mod->q, with the limbs, the canonical encoding
+// and into ZZ^*_M with SHAKE256
+void testTimesHash(const struct modulus* mod, const int nIters, FILE* const fileptr);
 
 #endif
@@ -0,0 +1,15 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+// Wall-clock time for the code measuring its own rates (squarings per second, jobs per second).
+
+#include <time.h>
+
+// seconds since an arbitrary fixed point, not affected by changes of the system clock
+static inline double wallTime() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+#endif
@@ -0,0 +1,355 @@
+#include "trapdoor.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// b^e mod p for a 32-bit p, products fit in 64 bits
+static uint32_t powMod32(uint64_t b, uint64_t e, const uint64_t p) {
+    uint64_t r = 1;
+
+    b %= p;
+    for (; e; e >>= 1) {
+	if (e & 1) r = r*b % p;
+	b = b*b % p;
+    }
+    return r;
+}
+
+static void freeLevels(mpz_t** levels, const int* sizes, const int nlevels) {
+    if (!levels) return;
+    for (int l = 0; l < nlevels; ++l) {
+	if (!levels[l]) continue;
+	for (int j = 0; j < sizes[l]; ++j) mpz_clear(levels[l][j]);
+	free(levels[l]);
+    }
+    free(levels);
+}
+
+static mpz_t** allocLevels(const int* sizes, const int nlevels) {
+    mpz_t** levels = calloc(nlevels, sizeof(mpz_t*));
+
+    if (!levels) return NULL;
+    for (int l = 0; l < nlevels; ++l) {
+	levels[l] = malloc(sizes[l]*sizeof(mpz_t));
+	if (!levels[l]) {
+	    freeLevels(levels, sizes, l);
+	    return NULL;
+	}
+	for (int j = 0; j < sizes[l]; ++j) mpz_init(levels[l][j]);
+    }
+    return levels;
+}
+
+void trapdoorClear(struct trapdoor* td) {
+    freeLevels(td->tree, td->levelSize, td->nlevels);
+    freeLevels(td->rem, td->levelSize, td->nlevels);
+    free(td->levelSize);
+    free(td->primes);
+    free(td->inv);
+    free(td->w);
+    if (td->lift) {
+	for (int i = 0; i < td->nlifts; ++i) mpz_clears(td->lift[i], td->lift3[i], NULL);
+	free(td->lift);
+	free(td->lift3);
+    }
+    for (int i = 0; i < 2; ++i) if (td->isSpecial[i]) specialClear(&td->special[i]);
+    if (td->hasPlans) {
+	expPlanClear(&td->plan[0]);
+	expPlanClear(&td->plan[1]);
+    }
+    if (td->init) mpz_clears(td->m, td->minv, td->inv3, td->p, td->e, td->p2, td->e2, td->pinv, td->z, td->t, td->u, NULL);
+    memset(td, 0, sizeof(*td));
+}
+
+static int initmPower(struct trapdoor* td, const struct modulus* mod) {
+    const int n = mod->nprimes;
+    const uint32_t* ps = mod->primes;
+    mpz_t** tree;
+    mpz_t** rem;
+    int top;
+
+    if (n == 0) return 1;
+    for (int i = 0; i < n; ++i) if (ps[i] % 3 != 2) return 1; // otherwise cubing is not a permutation mod p_i
+
+    td->nprimes = n;
+
+    td->primes = malloc(n*sizeof(uint32_t));
+    td->inv = malloc(n*sizeof(uint32_t));
+    td->w = malloc(n*sizeof(uint32_t));
+    for (int size = (n+1)/2; ; size = (size+1)/2) {
+	++td->nlevels;
+	if (size == 1) break;
+    }
+    td->levelSize = malloc(td->nlevels*sizeof(int));
+    if (!td->primes || !td->inv || !td->w || !td->levelSize) goto error;
+    memcpy(td->primes, ps, n*sizeof(uint32_t));
+    td->levelSize[0] = (n+1)/2;
+    for (int l = 1; l < td->nlevels; ++l) td->levelSize[l] = (td->levelSize[l-1]+1)/2;
+
+    tree = td->tree = allocLevels(td->levelSize, td->nlevels);
+    rem = td->rem = allocLevels(td->levelSize, td->nlevels);
+    if (!tree || !rem) goto error;
+    top = td->nlevels - 1;
+
+    // product tree, with pairs of primes in the leaves as in constructmPower
+    for (int j = 0; j < td->levelSize[0]; ++j) {
+	unsigned long x = ps[2*j];
+	if (2*j+1 < n) x *= ps[2*j+1];
+	mpz_set_ui(tree[0][j], x);
+    }
+    for (int l = 1; l <= top; ++l) {
+	for (int j = 0; j < td->levelSize[l]; ++j) {
+	    if (2*j+1 < td->levelSize[l-1]) mpz_mul(tree[l][j], tree[l-1][2*j], tree[l-1][2*j+1]);
+	    else mpz_set(tree[l][j], tree[l-1][2*j]);
+	}
+    }
+    mpz_set(td->m, tree[top][0]);
+
+    // (m/p_i) mod p_i going down the tree: a child gets the cofactor of its parent times its sibling
+    mpz_set_ui(rem[top][0], 1);
+    for (int l = top; l > 0; --l) {
+	for (int j = 0; j < td->levelSize[l-1]; ++j) {
+	    if ((j^1) < td->levelSize[l-1]) mpz_mul(rem[l-1][j], rem[l][j/2], tree[l-1][j^1]);
+	    else mpz_set(rem[l-1][j], rem[l][j/2]);
+	    mpz_mod(rem[l-1][j], rem[l-1][j], tree[l-1][j]);
+	}
+    }
+    for (int i = 0; i < n; ++i) {
+	uint64_t cof = mpz_fdiv_ui(rem[0][i/2], ps[i]);
+	if ((i^1) < n) cof = cof*ps[i^1] % ps[i];
+	td->inv[i] = powMod32(cof, ps[i]-2, ps[i]);
+    }
+
+    // the constants for the 2-adic part
+    mpz_set_ui(td->t, 0);
+    mpz_setbit(td->t, td->k);
+    mpz_invert(td->minv, td->m, td->t);
+    mpz_set_ui(td->u, 3);
+    mpz_invert(td->inv3, td->u, td->t);
+
+    return 0;
+
+ error:
+    fprintf(stderr, "ERROR initialising the trapdoor\n");
+    return 1;
+}
+
+static int initPrimePower(struct trapdoor* td, const struct modulus* mod) {
+    unsigned long j;
+    int i;
+
+    if (mpz_fdiv_ui(mod->p, 3) != 2) return 1;
+
+    mpz_set(td->p, mod->p);
+    mpz_mul_2exp(td->e, td->p, 1);
+    mpz_sub_ui(td->e, td->e, 1);
+    mpz_divexact_ui(td->e, td->e, 3);
+
+    // precisions k, ceil(k/2), ... down to 1 (excluded), stored from the smallest
+    for (j = td->k; j > 1; j = (j+1)/2) ++td->nlifts;
+    td->lift = malloc(td->nlifts*sizeof(mpz_t));
+    td->lift3 = malloc(td->nlifts*sizeof(mpz_t));
+    if (!td->lift || !td->lift3) {
+	free(td->lift);
+	free(td->lift3);
+	td->lift = td->lift3 = NULL;
+	td->nlifts = 0;
+	fprintf(stderr, "ERROR initialising the trapdoor\n");
+	return 1;
+    }
+
+    mpz_set_ui(td->u, 3);
+    for (j = td->k, i = td->nlifts-1; j > 1; j = (j+1)/2, --i) {
+	mpz_inits(td->lift[i], td->lift3[i], NULL);
+	if (j == td->k) mpz_set(td->lift[i], mod->q);
+	else mpz_pow_ui(td->lift[i], td->p, j);
+	mpz_invert(td->lift3[i], td->u, td->lift[i]);
+    }
+
+    return 0;
+}
+
+static int initRSA(struct trapdoor* td, const struct modulus* mod) {
+    if (mpz_fdiv_ui(mod->p, 3) != 2 || mpz_fdiv_ui(mod->p2, 3) != 2 || mpz_cmp(mod->p, mod->p2) == 0) return 1;
+
+    mpz_set(td->p, mod->p);
+    mpz_set(td->p2, mod->p2);
+    mpz_invert(td->pinv, td->p, td->p2);
+
+    mpz_mul_2exp(td->e, td->p, 1);
+    mpz_sub_ui(td->e, td->e, 1);
+    mpz_divexact_ui(td->e, td->e, 3);
+    mpz_mul_2exp(td->e2, td->p2, 1);
+    mpz_sub_ui(td->e2, td->e2, 1);
+    mpz_divexact_ui(td->e2, td->e2, 3);
+
+    td->isSpecial[0] = specialInit(&td->special[0], td->p) == 0;
+    td->isSpecial[1] = specialInit(&td->special[1], td->p2) == 0;
+
+    if (expPlanInit(&td->plan[0], td->e) != 0) return 1;
+    if (expPlanInit(&td->plan[1], td->e2) != 0) {
+	expPlanClear(&td->plan[0]);
+	return 1;
+    }
+    td->hasPlans = true;
+
+    return 0;
+}
+
+int trapdoorInit(struct trapdoor* td, const struct modulus* mod) {
+    int err = 1;
+
+    memset(td, 0, sizeof(*td));
+    td->type = mod->type;
+    td->k = mod->k;
+    if (mod->k == 0) return 1;
+
+    mpz_inits(td->m, td->minv, td->inv3, td->p, td->e, td->p2, td->e2, td->pinv, td->z, td->t, td->u, NULL);
+    td->init = true;
+
+    if (mod->type == MODULUS_M_POWER) err = initmPower(td, mod);
+    else if (mod->type == MODULUS_PRIME_POWER) err = initPrimePower(td, mod);
+    else if (mod->type == MODULUS_RSA) err = initRSA(td, mod);
+
+    if (err) trapdoorClear(td);
+    return err;
+}
+
+// td->z = c^(1/3) mod 2^k, for c odd
+static void cubeRoot2k(struct trapdoor* td, const mpz_t c) {
+    const mp_bitcnt_t k = td->k;
+    mpz_ptr z = td->z, t = td->t, u = td->u;
+    mp_bitcnt_t prec = 3;
+
+    // odd x satisfy x^2 = 1 mod 8, so c^(-1/3) = c mod 8
+    mpz_fdiv_r_2exp(z, c, prec);
+
+    while (prec < k) {
+	prec = 2*prec < k ? 2*prec : k;
+
+	// t = 1 - cz^3 mod 2^prec
+	mpz_mul(t, z, z);
+	mpz_mul(t, t, z);
+	mpz_fdiv_r_2exp(u, c, prec);
+	mpz_mul(t, t, u);
+	mpz_fdiv_r_2exp(t, t, prec);
+	mpz_ui_sub(t, 1, t);
+
+	// z = z + zt/3 mod 2^prec
+	mpz_mul(t, t, z);
+	mpz_fdiv_r_2exp(t, t, prec);
+	mpz_mul(t, t, td->inv3);
+	mpz_add(z, z, t);
+	mpz_fdiv_r_2exp(z, z, prec);
+    }
+
+    // c^(1/3) = c z^2
+    mpz_mul(t, z, z);
+    mpz_fdiv_r_2exp(t, t, k);
+    mpz_fdiv_r_2exp(u, c, k);
+    mpz_mul(t, t, u);
+    mpz_fdiv_r_2exp(z, t, k);
+}
+
+// r = c^(1/3) mod p^k
+static void cubeRootPrimePower(struct trapdoor* td, mpz_t r, const mpz_t c) {
+    mpz_ptr z = td->z, t = td->t, u = td->u;
+
+    // root mod p and its inverse, which is c^(-1/3) mod p
+    mpz_powm(r, c, td->e, td->p);
+    if (td->nlifts == 0) return;
+    mpz_invert(z, r, td->p);
+
+    // z = z + z(1 - cz^3)/3, from p^j to p^2j
+    for (int i = 0; i < td->nlifts; ++i) {
+	mpz_srcptr P = td->lift[i];
+
+	mpz_mul(t, z, z);
+	mpz_mul(t, t, z);
+	mpz_mod(t, t, P);
+	mpz_mod(u, c, P);
+	mpz_mul(t, t, u);
+	mpz_mod(t, t, P);
+	mpz_ui_sub(t, 1, t);
+
+	mpz_mul(t, t, z);
+	mpz_mod(t, t, P);
+	mpz_mul(t, t, td->lift3[i]);
+	mpz_add(z, z, t);
+	mpz_mod(z, z, P);
+    }
+
+    // c^(1/3) = c z^2
+    mpz_mul(t, z, z);
+    mpz_mod(t, t, td->lift[td->nlifts-1]);
+    mpz_mul(t, t, c);
+    mpz_mod(r, t, td->lift[td->nlifts-1]);
+}
+
+// r = c^(1/3) mod m2^k
+static void cubeRootmPower(struct trapdoor* td, mpz_t r, const mpz_t c) {
+    const int n = td->nprimes, top = td->nlevels - 1;
+    const uint32_t* ps = td->primes;
+    mpz_t** tree = td->tree;
+    mpz_t** rem = td->rem;
+
+    // remainder tree: c mod every node
+    mpz_mod(rem[top][0], c, td->m);
+    for (int l = top; l > 0; --l) {
+	for (int j = 0; j < td->levelSize[l-1]; ++j) mpz_mod(rem[l-1][j], rem[l][j/2], tree[l-1][j]);
+    }
+
+    // roots mod p_i, already multiplied by the CRT coefficients; 3(2p-1)/3 = 1 mod p-1
+    for (int i = 0; i < n; ++i) {
+	const uint64_t root = powMod32(mpz_fdiv_ui(rem[0][i/2], ps[i]), (2*(uint64_t)ps[i]-1)/3, ps[i]);
+	td->w[i] = root*td->inv[i] % ps[i];
+    }
+
+    // CRT going up: x = sum w_i m/p_i, so a node is x_left P_right + x_right P_left
+    for (int j = 0; j < td->levelSize[0]; ++j) {
+	if (2*j+1 < n) { // both products fit in a limb, not their sum
+	    mpz_set_ui(rem[0][j], (uint64_t)td->w[2*j]*ps[2*j+1]);
+	    mpz_add_ui(rem[0][j], rem[0][j], (uint64_t)td->w[2*j+1]*ps[2*j]);
+	} else mpz_set_ui(rem[0][j], td->w[2*j]);
+    }
+    for (int l = 1; l <= top; ++l) {
+	for (int j = 0; j < td->levelSize[l]; ++j) {
+	    if (2*j+1 < td->levelSize[l-1]) {
+		mpz_mul(rem[l][j], rem[l-1][2*j], tree[l-1][2*j+1]);
+		mpz_addmul(rem[l][j], rem[l-1][2*j+1], tree[l-1][2*j]);
+	    } else mpz_set(rem[l][j], rem[l-1][2*j]);
+	}
+    }
+    mpz_mod(rem[top][0], rem[top][0], td->m);
+
+    // root mod 2^k and x + m((z-x)/m mod 2^k)
+    cubeRoot2k(td, c);
+    mpz_sub(td->t, td->z, rem[top][0]);
+    mpz_mul(td->t, td->t, td->minv);
+    mpz_fdiv_r_2exp(td->t, td->t, td->k);
+    mpz_mul(r, td->t, td->m);
+    mpz_add(r, r, rem[top][0]);
+}
+
+// r = c^(1/3) mod p p2
+static void cubeRootRSA(struct trapdoor* td, mpz_t r, const mpz_t c) {
+    mpz_ptr t = td->t;
+
+    if (td->isSpecial[0]) specialPowmPlan(&td->special[0], r, c, &td->plan[0]);
+    else mpz_powm(r, c, td->e, td->p);
+
+    if (td->isSpecial[1]) specialPowmPlan(&td->special[1], t, c, &td->plan[1]);
+    else mpz_powm(t, c, td->e2, td->p2);
+
+    // Garner: r + p((t-r)p^{-1} mod p2)
+    mpz_sub(t, t, r);
+    mpz_mul(t, t, td->pinv);
+    mpz_mod(t, t, td->p2);
+    mpz_addmul(r, t, td->p);
+}
+
+void trapdoorCubeRoot(struct trapdoor* td, mpz_t r, const mpz_t c) {
+    if (td->type == MODULUS_PRIME_POWER) cubeRootPrimePower(td, r, c);
+    else if (td->type == MODULUS_RSA) cubeRootRSA(td, r, c);
+    else cubeRootmPower(td, r, c);
+}
@@ -0,0 +1,65 @@
+#ifndef TRAPDOOR_H
+#define TRAPDOOR_H
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "constructPrimes.h"
+#include "expPlan.h"
+#include "specialMod.h"
+
+// Cube roots using the factorization of the modulus rather than a full exponentiation c^b mod q.
+// For q = m2^k with m a product of 32-bit primes p_i = 2 mod 3:
+//  - c mod p_i for all i with a remainder tree, then the root c^((2p_i-1)/3) mod p_i with 64-bit arithmetic
+//  - the root mod 2^k from the inverse cube root z = c^(-1/3), lifted by the Newton iteration
+//    z' = z + z(1 - cz^3)/3 which doubles the precision at every step, so that the root is cz^2
+//  - the roots mod p_i are recombined mod m with a CRT product tree, and then with the one mod 2^k
+// For q = p^k with p = 2 mod 3:
+//  - the root c^((2p-1)/3) mod p, with an exponent of the size of p rather than of q
+//  - the inverse cube root is lifted from p to p^k with the same Newton iteration, whose precision doubles
+//    from p^j to p^2j, so the cost is a few multiplications of the size of q
+// For q = p p2 with two safe primes = 2 mod 3:
+//  - the roots c^((2p-1)/3) mod p and c^((2p2-1)/3) mod p2, exponents and moduli of half the size,
+//    with the reduction of specialMod and precomputed plans for the fixed primes of the form k2^e-1
+//  - the two roots are recombined with Garner's formula x + p((x2-x)p^{-1} mod p2)
+// The trees and powers of p are computed once per modulus, so the context is meant to be reused for many cube roots.
+// The scratch space makes a context usable by one thread at a time.
+
+struct trapdoor {
+    enum modulusType type;
+    bool init; // whether the mpz below are initialised
+    mp_bitcnt_t k; // q = m2^k or q = p^k
+    // MODULUS_M_POWER
+    int nprimes;
+    uint32_t* primes; // copy of the primes of m
+    uint32_t* inv; // (m/p_i)^{-1} mod p_i
+    uint32_t* w; // scratch for the roots mod p_i
+    int nlevels; // levels of the trees, level 0 holds pairs of primes and the last one m
+    int* levelSize;
+    mpz_t** tree; // tree[l][j] = tree[l-1][2j] tree[l-1][2j+1]
+    mpz_t** rem; // remainders going down the tree and CRT values going up
+    mpz_t m, minv, inv3; // m, m^{-1} mod 2^k and 3^{-1} mod 2^k
+    // MODULUS_PRIME_POWER
+    int nlifts; // Newton steps from p to q
+    mpz_t* lift; // p^j for the precisions j of the Newton steps, the last one is q
+    mpz_t* lift3; // 3^{-1} mod lift[i]
+    mpz_t p, e; // p and (2p-1)/3, also used for MODULUS_RSA
+    // MODULUS_RSA
+    mpz_t p2, e2, pinv; // p2, (2p2-1)/3 and p^{-1} mod p2
+    struct specialMod special[2]; // for p and p2 if they are of the form k2^e-1
+    bool isSpecial[2];
+    struct expPlan plan[2]; // for (2p-1)/3 and (2p2-1)/3
+    bool hasPlans;
+    mpz_t z, t, u; // scratch
+};
+
+// returns 0 on success, 1 if the modulus has no trapdoor implemented
+int trapdoorInit(struct trapdoor* td, const struct modulus* mod);
+
+void trapdoorClear(struct trapdoor* td);
+
+// r = c^(1/3) mod q, for c in Z^*_q; r and c must be different
+void trapdoorCubeRoot(struct trapdoor* td, mpz_t r, const mpz_t c);
+
+#endif
@@ -0,0 +1,197 @@
+#include "wesolowski.h"
+
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "montgomery.h"
+#include "sqChain.h"
+#include "timing.h"
+
+// hash the size and the limbs of a, so that different splits of the input give different hashes
+static void hashMpz(EVP_MD_CTX* ctx, const mpz_t a) {
+    const uint64_t size = mpz_size(a);
+    EVP_DigestUpdate(ctx, &size, sizeof(size));
+    EVP_DigestUpdate(ctx, mpz_limbs_read(a), size*sizeof(mp_limb_t));
+}
+
+void wesoChallenge(mpz_t l, const mpz_t N, const mpz_t x, const mpz_t y, const uint64_t T) {
+    uint8_t digest[32];
+    unsigned int digestLength = 0;
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+
+    if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha3_256(), NULL)) {
+	fprintf(stderr, "ERROR creating the SHA3-256 context of the challenge\n");
+	memset(digest, 0, sizeof(digest));
+    } else {
+	hashMpz(ctx, N);
+	hashMpz(ctx, x);
+	hashMpz(ctx, y);
+	EVP_DigestUpdate(ctx, &T, sizeof(T));
+	EVP_DigestFinal_ex(ctx, digest, &digestLength);
+    }
+    EVP_MD_CTX_free(ctx);
+
+    // the next prime after the hash with its top bit set, so that l has exactly WESO_PRIME_BITS bits
+    mpz_import(l, WESO_PRIME_BITS/8, 1, 1, 0, 0, digest);
+    mpz_setbit(l, WESO_PRIME_BITS - 1);
+    mpz_nextprime(l, l);
+}
+
+// the width bits of q from pos on, width <= WESO_MAX_WINDOW
+static unsigned long getBits(mp_srcptr qp, const mp_size_t qn, const mp_bitcnt_t pos, const int width) {
+    const mp_size_t limb = pos / GMP_NUMB_BITS;
+    const unsigned int off = pos % GMP_NUMB_BITS;
+    mp_limb_t v;
+
+    if (limb >= qn) return 0;
+    v = qp[limb] >> off;
+    if (off + width > GMP_NUMB_BITS && limb + 1 < qn) v |= qp[limb + 1] << (GMP_NUMB_BITS - off);
+    return v & ((1ul << width) - 1);
+}
+
+// the interval L and the window w of the cheapest proof that fits in WESO_MAX_MEMORY
+// returns 1 if none fits
+static int choosePlan(uint64_t* interval, uint64_t* window, const uint64_t T, const mp_size_t n) {
+    const uint64_t maxValues = WESO_MAX_MEMORY / (n*sizeof(mp_limb_t));
+    const uint64_t maxL = T < (1u << 16) ? T : (1u << 16);
+    double best = -1;
+
+    for (uint64_t L = 1; L <= maxL; ++L) {
+	const uint64_t S = (T + L - 1)/L;
+	for (uint64_t w = 1; w <= WESO_MAX_WINDOW && w <= L; ++w) {
+	    const uint64_t nwin = (L + w - 1)/w;
+	    double cost;
+
+	    if (S + (1ul << w) > maxValues) break;
+	    cost = (double) S*WESO_CHUNK_COST + (double) nwin*(S + (2ul << w)) + L;
+	    if (best < 0 || cost < best) {
+		best = cost;
+		*interval = L;
+		*window = w;
+	    }
+	}
+    }
+
+    return best < 0;
+}
+
+// rp = rp ap or, if *set is false, rp = ap
+static inline void mulOrSet(struct montCtx* ctx, mp_ptr rp, mp_srcptr ap, bool* set) {
+    if (*set) montMul(ctx, rp, rp, ap);
+    else mpn_copyi(rp, ap, ctx->n);
+    *set = true;
+}
+
+int wesoProve(mpz_t y, mpz_t pi, const mpz_t N, const mpz_t x, const uint64_t T, struct wesoStats* stats) {
+    const mp_size_t n = mpz_size(N);
+    double start = wallTime();
+    struct sqChain chain;
+    struct montCtx ctx;
+    uint64_t L = 0, w = 0;
+    long nstored;
+    mp_limb_t *stored, *buckets, *run, *sum, *acc;
+    bool *hasBucket, hasRun, hasSum, hasAcc = false;
+    mpz_t l, q;
+
+    if (montInit(&ctx, N) != 0) return 1;
+    if (choosePlan(&L, &w, T, n) != 0) {
+	fprintf(stderr, "ERROR the proof of %lu squarings does not fit in %lu bytes\n", (unsigned long) T, WESO_MAX_MEMORY);
+	montClear(&ctx);
+	return 1;
+    }
+
+    nstored = (T + L - 1)/L;
+    stored = malloc((nstored + (1l << w) + 3)*n*sizeof(mp_limb_t));
+    hasBucket = malloc((1l << w)*sizeof(bool));
+    if (!stored || !hasBucket || sqChainInit(&chain, N, x, T) != 0) {
+	fprintf(stderr, "ERROR allocating the proof\n");
+	free(stored);
+	free(hasBucket);
+	montClear(&ctx);
+	return 1;
+    }
+    buckets = stored + nstored*n;
+    run = buckets + (1l << w)*n;
+    sum = run + n;
+    acc = sum + n;
+
+    // the chain, keeping x_j = x^(2^(jL)) in Montgomery form
+    for (long j = 0; j < nstored; ++j) {
+	montToMont(&ctx, stored + j*n, chain.x);
+	sqChainAdvance(&chain, L);
+    }
+    mpz_set(y, chain.x);
+    if (stats) stats->chainSeconds = chain.squaringSeconds;
+    sqChainClear(&chain);
+
+    // q = floor(2^T/l), whose L-bit digits are the exponents of the x_j
+    mpz_inits(l, q, NULL);
+    wesoChallenge(l, N, x, y, T);
+    mpz_set_ui(q, 0);
+    mpz_setbit(q, T);
+    mpz_tdiv_q(q, q, l);
+
+    // windows of the digits from the top, acc = acc^(2^w) prod_d bucket_d^d
+    for (long t = (L + w - 1)/w - 1; t >= 0; --t) {
+	const uint64_t width = (t + 1)*w <= L ? w : L - t*w;
+
+	if (hasAcc) for (uint64_t i = 0; i < w; ++i) montSqr(&ctx, acc, acc);
+
+	memset(hasBucket, 0, (1l << w)*sizeof(bool));
+	for (long j = 0; j < nstored; ++j) {
+	    const unsigned long d = getBits(mpz_limbs_read(q), mpz_size(q), j*L + t*w, width);
+	    if (d) mulOrSet(&ctx, buckets + d*n, stored + j*n, hasBucket + d);
+	}
+
+	// prod_d bucket_d^d = prod_d (prod_{d' >= d} bucket_d')
+	hasRun = hasSum = false;
+	for (long d = (1l << width) - 1; d > 0; --d) {
+	    if (hasBucket[d]) mulOrSet(&ctx, run, buckets + d*n, &hasRun);
+	    if (hasRun) mulOrSet(&ctx, sum, run, &hasSum);
+	}
+	if (hasSum) mulOrSet(&ctx, acc, sum, &hasAcc);
+    }
+
+    if (hasAcc) montFromMont(&ctx, pi, acc);
+    else mpz_set_ui(pi, 1);
+
+    if (stats) {
+	stats->interval = L;
+	stats->w = w;
+	stats->nstored = nstored;
+	stats->proofSeconds = wallTime() - start - stats->chainSeconds;
+    }
+
+    mpz_clears(l, q, NULL);
+    free(stored);
+    free(hasBucket);
+    montClear(&ctx);
+    return 0;
+}
+
+int wesoVerify(const mpz_t N, const mpz_t x, const mpz_t y, const uint64_t T, const mpz_t pi) {
+    mpz_t l, r, a, b;
+    int valid;
+
+    if (mpz_sgn(pi) <= 0 || mpz_cmp(pi, N) >= 0 || mpz_sgn(y) < 0 || mpz_cmp(y, N) >= 0) return 1;
+
+    mpz_inits(l, r, a, b, NULL);
+    wesoChallenge(l, N, x, y, T);
+
+    // r = 2^T mod l
+    mpz_set_ui(r, 2);
+    mpz_powm_ui(r, r, T, l);
+
+    // pi^l x^r = x^(l floor(2^T/l) + 2^T mod l) = x^(2^T)
+    mpz_powm(a, pi, l, N);
+    mpz_powm(b, x, r, N);
+    mpz_mul(a, a, b);
+    mpz_mod(a, a, N);
+    valid = mpz_cmp(a, y) == 0;
+
+    mpz_clears(l, r, a, b, NULL);
+    return !valid;
+}
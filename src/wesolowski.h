@@ -0,0 +1,44 @@
+#ifndef WESOLOWSKI_H
+#define WESOLOWSKI_H
+
+#include <gmp.h>
+#include <stdint.h>
+
+// Wesolowski proofs that y = x^(2^T) mod N, so that a solution is checked with two exponentiations
+// of WESO_PRIME_BITS bits instead of T squarings.
+// The challenge l is the prime following a SHA3-256 hash of N, x, y and T, and the proof is pi = x^floor(2^T/l).
+// The verifier checks pi^l x^(2^T mod l) = y mod N.
+// The prover keeps x_j = x^(2^(jL)) every L squarings of the chain, then pi = prod x_j^q_j where q_j are the
+// L-bit digits of floor(2^T/l). The product is a multi-exponentiation with buckets: for each w-bit window
+// of the digits, the x_j are multiplied into the bucket of their window and the buckets combined with a running
+// product, so that the proof costs about T/w + 2^(w+1) L/w multiplications rather than T.
+// L and w minimise that cost within WESO_MAX_MEMORY bytes of stored values and buckets.
+
+#define WESO_PRIME_BITS 256
+
+// memory for the stored values and the buckets of the prover
+#define WESO_MAX_MEMORY (64ul << 20)
+
+#define WESO_MAX_WINDOW 16
+
+// multiplications lost at each chunk of the chain, converting in and out of Montgomery form
+#define WESO_CHUNK_COST 6
+
+struct wesoStats {
+    uint64_t interval; // L
+    int w;
+    long nstored;
+    double chainSeconds, proofSeconds; // wall-clock time of the squarings and of the proof
+};
+
+// l, the challenge for y = x^(2^T) mod N
+void wesoChallenge(mpz_t l, const mpz_t N, const mpz_t x, const mpz_t y, const uint64_t T);
+
+// y = x^(2^T) mod N and its proof pi, with stats (if not NULL) filled in
+// returns 0 on success, 1 if N is even or the stored values do not fit in WESO_MAX_MEMORY
+int wesoProve(mpz_t y, mpz_t pi, const mpz_t N, const mpz_t x, const uint64_t T, struct wesoStats* stats);
+
+// returns 0 if pi proves y = x^(2^T) mod N, 1 otherwise
+int wesoVerify(const mpz_t N, const mpz_t x, const mpz_t y, const uint64_t T, const mpz_t pi);
+
+#endif